@@ -0,0 +1,293 @@
+/*
+ * aquarius-ctl: command line client for the local control socket
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "ctl_protocol.h"
+
+// These mirror HWState, LeakSensor, HeaterController, Valve and Relay enums.
+// The client doesn't link with the daemon code, so the names are duplicated here.
+static const char* const sysStates[] =
+{
+    "fault", "closing", "closed", "switch-to-central", "central",
+    "switch-to-heater", "heater", "maintenance", nullptr
+};
+
+static const char* const modes[] =
+{
+    "auto", "manual", "maintenance", nullptr
+};
+
+static const char* const leakStates[] =
+{
+    "fault", "enabled", "disabled", "alarm", nullptr
+};
+
+static const char* const heaterStates[] =
+{
+    "fault", "ok", "wash", "protection", "pressurize", nullptr
+};
+
+static const char* const valveStates[] =
+{
+    "reset", "close", "closing", "opening", "open", "fault", nullptr
+};
+
+static const char* const relayStates[] =
+{
+    "off", "on", nullptr
+};
+
+static int lookup(const char* const* names, const char* str)
+{
+    for (int i = 0; names[i]; i++) {
+        if (!strcmp(names[i], str)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static const char* name(const char* const* names, int value)
+{
+    for (int i = 0; names[i]; i++) {
+        if (i == value) {
+            return names[i];
+        }
+    }
+
+    return "unknown";
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: aquarius-ctl [-s socket] [-t] command\n"
+            "Commands:\n"
+            "  status\n"
+            "  watch\n"
+            "  mode auto|manual|maintenance\n"
+            "  state closed|central|heater\n"
+            "  leak enabled|disabled\n"
+            "  heater wash\n"
+            "  valve <id> open|close|reset\n"
+            "  relay <id> on|off\n"
+            "Options:\n"
+            "  -s socket  Control socket path, default " CTL_SOCKET_PATH "\n"
+            "  -t         Print request round-trip time\n");
+    exit(2);
+}
+
+static int s_fd;
+static std::string s_input;
+
+static bool sendRequest(uint8_t op, const std::string& payload)
+{
+    std::string msg = CtlEncode(op, 1, payload.data(), payload.size());
+
+    return write(s_fd, msg.data(), msg.size()) == (ssize_t)msg.size();
+}
+
+// Reads one message, returns its opcode and payload, or -1 on disconnect
+static int receive(std::string& payload)
+{
+    int size;
+
+    while ((size = CtlMessageSize(s_input)) == 0) {
+        char buf[4096];
+        ssize_t l = read(s_fd, buf, sizeof(buf));
+
+        if (l <= 0) {
+            return -1;
+        }
+        s_input.append(buf, l);
+    }
+
+    if (size == -1) {
+        return -1;
+    }
+
+    CtlHeader hdr;
+
+    memcpy(&hdr, s_input.data(), sizeof(hdr));
+    payload = s_input.substr(sizeof(hdr), size - sizeof(hdr));
+    s_input.erase(0, size);
+
+    return hdr.op;
+}
+
+static void printEvent(const std::string& payload)
+{
+    uint32_t v;
+
+    if (payload.size() < 5) {
+        return;
+    }
+
+    memcpy(&v, &payload[1], sizeof(v));
+    v = le32toh(v);
+
+    if (payload[0] == CTL_FLOAT) {
+        float f;
+
+        memcpy(&f, &v, sizeof(f));
+        printf("%s = %g\n", payload.c_str() + 5, f);
+    } else {
+        printf("%s = %d\n", payload.c_str() + 5, (int)v);
+    }
+    fflush(stdout);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = CTL_SOCKET_PATH;
+    bool timing = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:t")) != -1) {
+        switch (opt)
+        {
+        case 's':
+            path = optarg;
+            break;
+        case 't':
+            timing = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1) {
+        usage();
+    }
+
+    const char* cmd = argv[0];
+    std::string payload;
+    const char* const* resultNames = nullptr;
+    uint8_t op;
+    int v = 0;
+
+    if (!strcmp(cmd, "status") && argc == 1) {
+        op = CTL_GET_STATE;
+    } else if (!strcmp(cmd, "watch") && argc == 1) {
+        op = CTL_SUBSCRIBE;
+    } else if (!strcmp(cmd, "mode") && argc == 2) {
+        op = CTL_SET_MODE;
+        v = lookup(modes, argv[1]);
+    } else if (!strcmp(cmd, "state") && argc == 2) {
+        op = CTL_SET_STATE;
+        v = lookup(sysStates, argv[1]);
+    } else if (!strcmp(cmd, "leak") && argc == 2) {
+        op = CTL_SET_LEAK;
+        v = lookup(leakStates, argv[1]);
+    } else if (!strcmp(cmd, "heater") && argc == 2) {
+        op = CTL_SET_HEATER;
+        v = lookup(heaterStates, argv[1]);
+    } else if (!strcmp(cmd, "valve") && argc == 3) {
+        op = CTL_VALVE;
+        v = lookup(valveStates, argv[2]);
+        resultNames = valveStates;
+    } else if (!strcmp(cmd, "relay") && argc == 3) {
+        op = CTL_RELAY;
+        v = lookup(relayStates, argv[2]);
+        resultNames = relayStates;
+    } else {
+        usage();
+    }
+
+    if (v == -1) {
+        usage();
+    }
+
+    if (op != CTL_GET_STATE && op != CTL_SUBSCRIBE) {
+        payload += (char)v;
+        if (argc == 3) {
+            payload += argv[1];
+        }
+    }
+
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    s_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s_fd == -1 || connect(s_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "Failed to connect to %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    double start = now();
+
+    if (!sendRequest(op, payload)) {
+        fprintf(stderr, "Failed to send request: %s\n", strerror(errno));
+        return 1;
+    }
+
+    std::string reply;
+    int replyOp = receive(reply);
+
+    if (timing) {
+        fprintf(stderr, "Round trip: %.0f us\n", now() - start);
+    }
+
+    if (replyOp == CTL_STATE && reply.size() == 4) {
+        printf("state:  %s\n", name(sysStates, (int8_t)reply[0]));
+        printf("mode:   %s\n", name(modes, (int8_t)reply[1]));
+        printf("leak:   %s\n", name(leakStates, (int8_t)reply[2]));
+        printf("heater: %s\n", name(heaterStates, (int8_t)reply[3]));
+        return 0;
+    }
+
+    if (replyOp != CTL_RESULT || reply.size() != 2) {
+        fprintf(stderr, "Malformed reply from the daemon\n");
+        return 1;
+    }
+
+    int err = (int8_t)reply[0];
+
+    if (err) {
+        fprintf(stderr, "%s failed: %s\n", cmd, strerror(err));
+        return 1;
+    }
+
+    if (resultNames) {
+        printf("%s\n", name(resultNames, (int8_t)reply[1]));
+    }
+
+    if (op == CTL_SUBSCRIBE) {
+        while ((replyOp = receive(reply)) != -1) {
+            if (replyOp == CTL_EVENT) {
+                printEvent(reply);
+            }
+        }
+        fprintf(stderr, "Connection closed\n");
+        return 1;
+    }
+
+    close(s_fd);
+    return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * aquarius-logdump: render contents of the binary log ring
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "logring.h"
+
+static const char* const levelTags[] =
+{
+    "ERROR",
+    "WARNING",
+    "INFO",
+    "DEBUG"
+};
+
+// Our records are self-describing, so conversion specifiers in the format
+// are only used for flags, width and precision. Value types come from
+// the record itself.
+static std::string formatArgs(const char* fmt, const LogRingRecord& r)
+{
+    const uint8_t* p = r.data;
+    const uint8_t* end = r.data + std::min<size_t>(r.size, sizeof(r.data));
+    std::string out;
+
+    while (*fmt) {
+        if (*fmt != '%') {
+            out += *fmt++;
+            continue;
+        }
+        if (fmt[1] == '%') {
+            out += '%';
+            fmt += 2;
+            continue;
+        }
+
+        std::string spec = "%";
+        char buf[256];
+
+        for (fmt++; *fmt && strchr("-+ #0123456789.", *fmt); fmt++) {
+            spec += *fmt;
+        }
+        // Drop length modifiers, our types are fixed
+        while (*fmt && strchr("hlLqjzt", *fmt)) {
+            fmt++;
+        }
+
+        char conv = *fmt;
+
+        if (conv) {
+            fmt++;
+        }
+
+        if (p >= end) {
+            out += "<missing>";
+            continue;
+        }
+
+        switch (*p++)
+        {
+        case LOGRING_INT:
+        {
+            int64_t v;
+
+            memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            spec += (conv && strchr("ouxX", conv)) ? std::string("ll") + conv : std::string("lld");
+            snprintf(buf, sizeof(buf), spec.c_str(), (long long)v);
+            break;
+        }
+
+        case LOGRING_FLOAT:
+        {
+            double v;
+
+            memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            spec += (conv && strchr("eEfFgGaA", conv)) ? conv : 'g';
+            snprintf(buf, sizeof(buf), spec.c_str(), v);
+            break;
+        }
+
+        case LOGRING_STR:
+        {
+            unsigned int l = *p++;
+            std::string s((const char *)p, std::min<size_t>(l, end - p));
+
+            p += l;
+            spec += 's';
+            snprintf(buf, sizeof(buf), spec.c_str(), s.c_str());
+            break;
+        }
+
+        default:
+            // Garbage, don't try to go further
+            return out + "<corrupted>";
+        }
+
+        out += buf;
+    }
+
+    return out;
+}
+
+// For records, whose format we don't know
+static std::string rawArgs(const LogRingRecord& r)
+{
+    std::string fmt;
+
+    for (unsigned int i = 0; i < r.nArgs; i++) {
+        fmt += i ? " %s" : "%s";
+    }
+
+    return formatArgs(fmt.c_str(), r);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: aquarius-logdump <ring file>\n");
+        return 2;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st)) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if ((size_t)st.st_size < LogRingFileSize(0)) {
+        fprintf(stderr, "%s is not a log ring\n", argv[1]);
+        return 1;
+    }
+
+    void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    const LogRingHeader* hdr = (const LogRingHeader *)mem;
+
+    if (hdr->magic != LOGRING_MAGIC || hdr->version != LOGRING_VERSION ||
+        hdr->formatCount != LogRingFormats ||
+        (size_t)st.st_size != LogRingFileSize(hdr->recordCount)) {
+        fprintf(stderr, "%s is not a log ring or has unsupported version\n", argv[1]);
+        return 1;
+    }
+
+    const char* formats = (const char *)mem + LogRingHeaderSize;
+    const LogRingRecord* records = (const LogRingRecord *)(formats + LogRingFormats * LogRingFormatSize);
+    unsigned int nFormats = hdr->nFormats;
+    std::vector<const LogRingRecord*> valid;
+
+    for (unsigned int i = 0; i < hdr->recordCount; i++) {
+        // Zero sequence means either never written or torn by a crash
+        if (records[i].seq) {
+            valid.push_back(&records[i]);
+        }
+    }
+
+    std::sort(valid.begin(), valid.end(), [](const LogRingRecord* a, const LogRingRecord* b) {
+        return a->seq < b->seq;
+    });
+
+    for (const LogRingRecord* r : valid) {
+        time_t t = r->time / 1000000000;
+        unsigned int ms = (r->time / 1000000) % 1000;
+        struct tm pt;
+        char ts[64];
+        std::string text;
+
+        localtime_r(&t, &pt);
+        strftime(ts, sizeof(ts), "%d.%m.%Y %H:%M:%S", &pt);
+
+        if (r->format == LogRingText) {
+            text.assign((const char *)r->data, std::min<size_t>(r->size, sizeof(r->data)));
+        } else if (r->format < nFormats) {
+            std::string fmt(formats + r->format * LogRingFormatSize,
+                            strnlen(formats + r->format * LogRingFormatSize, LogRingFormatSize));
+            text = formatArgs(fmt.c_str(), *r);
+        } else {
+            text = "<unknown format> " + rawArgs(*r);
+        }
+
+        printf("[%s] %s.%03u %s\n", r->level < 4 ? levelTags[r->level] : "?", ts, ms, text.c_str());
+    }
+
+    return 0;
+}
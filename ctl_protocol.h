@@ -0,0 +1,104 @@
+/*
+ * Local control socket protocol, shared by the daemon and aquarius-ctl.
+ * Every message in both directions is a 4-byte header followed by a payload.
+ * The header holds little-endian 16-bit payload length, opcode and a tag,
+ * which the daemon copies into the reply, so a client can match replies with
+ * requests while subscribed to events.
+ * Integers in payloads are single bytes unless noted otherwise; device ids
+ * are sent as raw strings, taking up the rest of the payload.
+ */
+#ifndef CTL_PROTOCOL_H
+#define CTL_PROTOCOL_H
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#define CTL_SOCKET_PATH "/run/aquarius.sock"
+
+// Sanity limit, real messages are much smaller
+static const unsigned int CtlMaxPayload = 1024;
+
+enum CtlOp
+{
+    // Requests
+    CTL_GET_STATE = 1, // -> CTL_STATE
+    CTL_SUBSCRIBE,     // -> CTL_RESULT, then CTL_EVENT for all current values and every change
+    CTL_SET_MODE,      // mode -> CTL_RESULT
+    CTL_SET_STATE,     // state -> CTL_RESULT
+    CTL_SET_LEAK,      // leak sensor state -> CTL_RESULT
+    CTL_SET_HEATER,    // heater state -> CTL_RESULT
+    CTL_VALVE,         // state, id -> CTL_RESULT with resulting valve state
+    CTL_RELAY,         // state, id -> CTL_RESULT with resulting relay state
+
+    // Replies
+    CTL_RESULT = 0x80, // errno code, resulting state
+    CTL_STATE,         // system state, mode, leak sensor state, heater state
+    CTL_EVENT          // value type, 32-bit value, topic
+};
+
+enum CtlValueType
+{
+    CTL_INT,
+    CTL_FLOAT
+};
+
+struct CtlHeader
+{
+    uint16_t length;
+    uint8_t  op;
+    uint8_t  tag;
+};
+
+static inline std::string CtlEncode(uint8_t op, uint8_t tag, const void* payload, size_t size)
+{
+    CtlHeader hdr;
+    std::string msg;
+
+    hdr.length = htole16(size);
+    hdr.op     = op;
+    hdr.tag    = tag;
+
+    msg.reserve(sizeof(hdr) + size);
+    msg.append((const char*)&hdr, sizeof(hdr));
+    msg.append((const char*)payload, size);
+
+    return msg;
+}
+
+static inline std::string CtlEncodeEvent(const std::string& topic, uint8_t type, uint32_t value)
+{
+    std::string payload(5, 0);
+
+    payload[0] = type;
+    value = htole32(value);
+    memcpy(&payload[1], &value, sizeof(value));
+    payload += topic;
+
+    return CtlEncode(CTL_EVENT, 0, payload.data(), payload.size());
+}
+
+// Returns size of complete message at the beginning of buffer, 0 if more
+// data is needed, -1 if the data is garbage
+static inline int CtlMessageSize(const std::string& buf)
+{
+    CtlHeader hdr;
+
+    if (buf.size() < sizeof(hdr)) {
+        return 0;
+    }
+
+    memcpy(&hdr, buf.data(), sizeof(hdr));
+
+    unsigned int len = le16toh(hdr.length);
+
+    if (len > CtlMaxPayload) {
+        return -1;
+    }
+
+    return buf.size() < sizeof(hdr) + len ? 0 : sizeof(hdr) + len;
+}
+
+#endif
@@ -0,0 +1,412 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pwd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ctl_protocol.h"
+#include "ctl_server.h"
+#include "logging.h"
+#include "userdb.h"
+
+// A subscriber which doesn't read its events gets disconnected
+static const size_t MaxOutput = 65536;
+
+CtlServer::CtlServer(HWConfig* cfg, HWState* hwState, const char* path)
+    : m_hwConfig(cfg), m_hwState(hwState), m_Path(path ? path : CTL_SOCKET_PATH),
+      m_ListenFd(-1), m_Quit(false)
+{
+    struct sockaddr_un addr;
+
+    if (m_Path.size() >= sizeof(addr.sun_path)) {
+        LOG(ERR) << "Control socket path is too long: " << m_Path;
+        return;
+    }
+
+    if (pipe2(m_WakePipe, O_NONBLOCK|O_CLOEXEC)) {
+        LOG(ERR) << "Failed to create control server pipe: " << strerror(errno);
+        return;
+    }
+
+    m_ListenFd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (m_ListenFd == -1) {
+        LOG(ERR) << "Failed to create control socket: " << strerror(errno);
+        return;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, m_Path.c_str());
+
+    // Stale socket from the previous run would prevent bind()
+    unlink(addr.sun_path);
+
+    if (bind(m_ListenFd, (struct sockaddr *)&addr, sizeof(addr)) || listen(m_ListenFd, 8)) {
+        LOG(ERR) << "Failed to listen on " << m_Path << ": " << strerror(errno);
+        close(m_ListenFd);
+        m_ListenFd = -1;
+        return;
+    }
+
+    // Filesystem permissions decide who can connect, credentials decide what they can do
+    chmod(addr.sun_path, 0660);
+
+    EventBus::getInstance().AddListener(this);
+    m_Thread = std::thread(&CtlServer::Run, this);
+}
+
+CtlServer::~CtlServer()
+{
+    if (m_ListenFd == -1) {
+        return;
+    }
+
+    EventBus::getInstance().RemoveListener(this);
+
+    m_Quit = true;
+    Wake();
+    m_Thread.join();
+
+    for (Client* c : m_Clients) {
+        close(c->fd);
+        delete c;
+    }
+
+    close(m_ListenFd);
+    close(m_WakePipe[0]);
+    close(m_WakePipe[1]);
+    unlink(m_Path.c_str());
+}
+
+void CtlServer::Wake()
+{
+    char c = 0;
+
+    // EAGAIN means there's already a pending wakeup, which is fine
+    if (write(m_WakePipe[1], &c, 1)) {
+    }
+}
+
+static std::string encodeEvent(const std::string& topic, GValue value)
+{
+    if (std::holds_alternative<int>(value)) {
+        return CtlEncodeEvent(topic, CTL_INT, std::get<int>(value));
+    } else {
+        float f = std::get<float>(value);
+        uint32_t v;
+
+        memcpy(&v, &f, sizeof(v));
+        return CtlEncodeEvent(topic, CTL_FLOAT, v);
+    }
+}
+
+void CtlServer::OnEvent(const std::string& topic, GValue value)
+{
+    std::string msg = encodeEvent(topic, value);
+
+    m_Lock.lock();
+
+    for (Client* c : m_Clients) {
+        if (c->subscribed) {
+            c->output += msg;
+        }
+    }
+
+    m_Lock.unlock();
+
+    Wake();
+}
+
+void CtlServer::Run()
+{
+    std::vector<struct pollfd> fds;
+
+    while (!m_Quit) {
+        fds.resize(2);
+        fds[0] = { m_ListenFd, POLLIN, 0 };
+        fds[1] = { m_WakePipe[0], POLLIN, 0 };
+
+        m_Lock.lock();
+        for (Client* c : m_Clients) {
+            fds.push_back({ c->fd, (short)(c->output.empty() ? POLLIN : POLLIN|POLLOUT), 0 });
+        }
+        m_Lock.unlock();
+
+        if (poll(fds.data(), fds.size(), -1) == -1) {
+            if (errno != EINTR) {
+                LOG(ERR) << "Control server poll() failed: " << strerror(errno);
+                break;
+            }
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char buf[64];
+
+            while (read(m_WakePipe[0], buf, sizeof(buf)) > 0);
+        }
+
+        // Clients, accepted below, are not in the fds array yet, they'll be
+        // polled on the next round
+        size_t nClients = fds.size() - 2;
+
+        for (size_t i = 0; i < nClients; ) {
+            Client* c = m_Clients[i];
+            short revents = fds[i + 2].revents;
+            bool ok = true;
+
+            if (revents & (POLLIN|POLLHUP|POLLERR)) {
+                ok = Receive(c);
+            }
+            // Events may have arrived after we've built the pollfd array.
+            // Also try to deliver replies to a client, which has just hung up.
+            if (!Send(c)) {
+                ok = false;
+            }
+
+            if (ok) {
+                i++;
+            } else {
+                m_Lock.lock();
+                m_Clients.erase(m_Clients.begin() + i);
+                m_Lock.unlock();
+
+                fds.erase(fds.begin() + i + 2);
+                nClients--;
+
+                LOG(DEBUG) << c->user << " control connection closed";
+                close(c->fd);
+                delete c;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            Accept();
+        }
+    }
+}
+
+void CtlServer::Accept()
+{
+    int fd;
+
+    while ((fd = accept4(m_ListenFd, nullptr, nullptr, SOCK_NONBLOCK|SOCK_CLOEXEC)) != -1) {
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+            LOG(ERR) << "Failed to get control client credentials: " << strerror(errno);
+            close(fd);
+            continue;
+        }
+
+        Client* c = new Client;
+        struct passwd pwd, *pw;
+        char buf[1024];
+
+        c->fd         = fd;
+        c->subscribed = false;
+
+        // The daemon's own user and root are trusted. Everybody else, who is
+        // allowed to open the socket, are normal users.
+        if (cred.uid == 0 || cred.uid == geteuid()) {
+            c->access = User::TECHNICIAN;
+        } else {
+            c->access = User::NORMAL;
+        }
+
+        if (!getpwuid_r(cred.uid, &pwd, buf, sizeof(buf), &pw) && pw) {
+            c->user = pw->pw_name;
+        } else {
+            c->user = "uid" + std::to_string(cred.uid);
+        }
+        c->user += "@local";
+
+        LOG(DEBUG) << c->user << " control connection opened";
+
+        m_Lock.lock();
+        m_Clients.push_back(c);
+        m_Lock.unlock();
+    }
+}
+
+bool CtlServer::Receive(Client* c)
+{
+    char buf[512];
+    ssize_t l;
+
+    while ((l = read(c->fd, buf, sizeof(buf))) > 0) {
+        c->input.append(buf, l);
+    }
+
+    // The client may send its last request and disconnect, serve it anyways
+    bool connected = (l == -1) && (errno == EAGAIN || errno == EINTR);
+    int size;
+
+    while ((size = CtlMessageSize(c->input)) > 0) {
+        CtlHeader hdr;
+
+        memcpy(&hdr, c->input.data(), sizeof(hdr));
+        HandleRequest(c, hdr.op, hdr.tag, (const uint8_t *)c->input.data() + sizeof(hdr),
+                      size - sizeof(hdr));
+        c->input.erase(0, size);
+    }
+
+    if (size == -1) {
+        LOG(ERR) << c->user << " sent malformed control request";
+        return false;
+    }
+
+    return connected;
+}
+
+bool CtlServer::Send(Client* c)
+{
+    std::lock_guard lock(m_Lock);
+
+    if (c->output.size() > MaxOutput) {
+        LOG(ERR) << c->user << " doesn't read control events, dropping";
+        return false;
+    }
+
+    while (!c->output.empty()) {
+        // Don't get killed by SIGPIPE if the client is gone
+        ssize_t l = send(c->fd, c->output.data(), c->output.size(), MSG_NOSIGNAL);
+
+        if (l == -1) {
+            return errno == EAGAIN || errno == EINTR;
+        }
+
+        c->output.erase(0, l);
+    }
+
+    return true;
+}
+
+void CtlServer::Reply(Client* c, uint8_t op, uint8_t tag, const void* data, unsigned int size)
+{
+    std::string msg = CtlEncode(op, tag, data, size);
+
+    m_Lock.lock();
+    c->output += msg;
+    m_Lock.unlock();
+}
+
+unsigned int CtlServer::GetControlUserLevel()
+{
+    // If the system in maintenance mode, only technician can control
+    return m_hwState->GetMode() == HWState::FullManual ? User::TECHNICIAN : User::NORMAL;
+}
+
+void CtlServer::HandleRequest(Client* c, uint8_t op, uint8_t tag, const uint8_t* data, unsigned int size)
+{
+    int8_t result[2] = { EINVAL, -1 };
+
+    switch (op)
+    {
+    case CTL_GET_STATE:
+    {
+        int8_t state[4];
+
+        state[0] = m_hwState->GetState();
+        state[1] = m_hwState->GetMode();
+        state[2] = m_hwState->GetLeakState();
+        state[3] = m_hwState->GetHeaterState();
+
+        Reply(c, CTL_STATE, tag, state, sizeof(state));
+        return;
+    }
+
+    case CTL_SUBSCRIBE:
+    {
+        result[0] = 0;
+
+        // Initial snapshot is taken under the lock, so that no change can slip
+        // in before the subscription is in effect
+        m_Lock.lock();
+
+        c->output += CtlEncode(CTL_RESULT, tag, result, sizeof(result));
+        for (const auto& it : EventBus::getInstance().CollectValues("")) {
+            c->output += encodeEvent(it.first, it.second);
+        }
+        c->subscribed = true;
+
+        m_Lock.unlock();
+        return;
+    }
+
+    case CTL_SET_MODE:
+        if (size == 1 && data[0] <= HWState::FullManual) {
+            HWState::ctlmode_t mode = (HWState::ctlmode_t)data[0];
+
+            // Only technician can switch to maintenance mode
+            if (c->access < GetControlUserLevel() ||
+                (mode == HWState::FullManual && c->access < User::TECHNICIAN)) {
+                result[0] = EACCES;
+            } else {
+                m_hwState->SetMode(mode, c->user);
+                result[0] = 0;
+            }
+        }
+        break;
+
+    case CTL_SET_STATE:
+        if (size == 1) {
+            result[0] = c->access < GetControlUserLevel() ? EACCES :
+                        m_hwState->SetState((HWState::state_t)data[0], c->user);
+        }
+        break;
+
+    case CTL_SET_LEAK:
+        if (size == 1) {
+            result[0] = c->access < GetControlUserLevel() ? EACCES :
+                        m_hwState->SetLeakState((LeakSensor::status_t)data[0], c->user);
+        }
+        break;
+
+    case CTL_SET_HEATER:
+        if (size == 1) {
+            result[0] = c->access < GetControlUserLevel() ? EACCES :
+                        m_hwState->SetHeaterState(data[0], c->user);
+        }
+        break;
+
+    case CTL_VALVE:
+        if (size > 1) {
+            std::string id((const char *)data + 1, size - 1);
+            int state = data[0];
+
+            if (c->access < User::TECHNICIAN) {
+                result[0] = EACCES;
+            } else if (state == Valve::Open || state == Valve::Closed || state == Valve::Reset) {
+                result[0] = m_hwState->ValveControl(id.c_str(), state, c->user);
+                result[1] = state;
+            }
+        }
+        break;
+
+    case CTL_RELAY:
+        if (size > 1) {
+            std::string id((const char *)data + 1, size - 1);
+            bool state = data[0];
+
+            if (c->access < User::TECHNICIAN) {
+                result[0] = EACCES;
+            } else {
+                result[0] = m_hwState->RelayControl(id.c_str(), state, c->user);
+                result[1] = state;
+            }
+        }
+        break;
+
+    default:
+        result[0] = ENOSYS;
+        break;
+    }
+
+    Reply(c, CTL_RESULT, tag, result, sizeof(result));
+}
@@ -0,0 +1,62 @@
+#ifndef CTL_SERVER_H
+#define CTL_SERVER_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event_bus.h"
+#include "hwconfig.h"
+#include "hwstate.h"
+
+/*
+ * Local control API over a Unix domain socket. Intended for automation,
+ * running on the same box. Clients are authenticated by their uid, obtained
+ * using SO_PEERCRED, so no passwords are involved. See ctl_protocol.h for
+ * the wire format.
+ */
+class CtlServer : public EventListener
+{
+public:
+    CtlServer(HWConfig* cfg, HWState* hwState, const char* path = nullptr);
+    ~CtlServer();
+
+private:
+    struct Client
+    {
+        int          fd;
+        unsigned int access;
+        bool         subscribed;
+        std::string  user;
+        std::string  input;
+        std::string  output;
+    };
+
+    virtual void OnEvent(const std::string& topic, GValue value) override;
+
+    void Run();
+    void Accept();
+    bool Receive(Client* c);
+    bool Send(Client* c);
+    void HandleRequest(Client* c, uint8_t op, uint8_t tag, const uint8_t* data, unsigned int size);
+    void Reply(Client* c, uint8_t op, uint8_t tag, const void* data, unsigned int size);
+    void Wake();
+    unsigned int GetControlUserLevel();
+
+    HWConfig* m_hwConfig;
+    HWState*  m_hwState;
+
+    std::string m_Path;
+    int         m_ListenFd;
+    int         m_WakePipe[2];
+    std::atomic<bool> m_Quit;
+
+    // Protects output buffers, which are also filled from OnEvent()
+    std::mutex           m_Lock;
+    std::vector<Client*> m_Clients;
+    std::thread          m_Thread;
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "event_bus.h"
 #include "logging.h"
+#include "logring.h"
 
 // This is our global singletone
 EventBus EventBus::g_Bus;
@@ -23,6 +24,36 @@ void EventBus::SendEvent(const std::string& topic, GValue value)
         return;
     }
 
-    Log(Log::DEBUG) << topic << " = " << value;
+    LOG(DEBUG) << topic << " = " << value;
+
+    if (std::holds_alternative<int>(value)) {
+        RLOG(DEBUG, "%s = %d", topic, std::get<int>(value));
+    } else {
+        RLOG(DEBUG, "%s = %f", topic, std::get<float>(value));
+    }
+
+    std::lock_guard lock(m_ListenersLock);
+
+    for (EventListener* l : m_Listeners) {
+        l->OnEvent(topic, value);
+    }
+}
+
+void EventBus::AddListener(EventListener* l)
+{
+    std::lock_guard lock(m_ListenersLock);
+    m_Listeners.push_back(l);
+}
+
+void EventBus::RemoveListener(EventListener* l)
+{
+    std::lock_guard lock(m_ListenersLock);
+
+    for (auto it = m_Listeners.begin(); it != m_Listeners.end(); it++) {
+        if (*it == l) {
+            m_Listeners.erase(it);
+            break;
+        }
+    }
 }
 
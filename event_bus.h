@@ -2,12 +2,24 @@
 #define EVENT_BUS_H
 
 #include <map>
+#include <mutex>
 #include <shared_mutex>
 #include <string>
 #include <variant>
+#include <vector>
 
 typedef std::variant<int, float> GValue;
 
+class EventListener
+{
+public:
+    virtual ~EventListener()
+    {}
+
+    // Called synchronously from SendEvent(), so must be quick
+    virtual void OnEvent(const std::string& topic, GValue value) = 0;
+};
+
 class EventBus
 {
 public:
@@ -51,13 +63,18 @@ public:
         return it == g_values.end() ? def : std::get<T>(it->second);
     }
 
+    // The process-wide bus. In multi-site mode every site has its own one,
+    // see HWConfig::GetBus().
     static EventBus& getInstance() {return g_Bus; }
 
+    EventBus() = default;
+
     void SendEvent(const std::string& topic, GValue value);
 
-private:
-    EventBus() = default;
+    void AddListener(EventListener* l);
+    void RemoveListener(EventListener* l);
 
+private:
     bool Update(const std::string& topic, GValue value)
     {
         std::unique_lock readLock(g_mutex);
@@ -74,6 +91,9 @@ private:
     std::map<std::string, GValue> g_values;
     mutable std::shared_mutex g_mutex;
 
+    std::vector<EventListener*> m_Listeners;
+    std::mutex                  m_ListenersLock;
+
     static EventBus g_Bus;
 };
 
@@ -0,0 +1,400 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "gpio_hw.h"
+#include "hwconfig.h"
+#include "logging.h"
+
+static const char* const consumerName = "aquarius";
+
+GpioEvent::~GpioEvent()
+{
+    close(m_Fd);
+}
+
+// Line events via GPIO uAPI v2, available since Linux 5.10
+static int requestLineV2(int chip, unsigned int line)
+{
+    struct gpio_v2_line_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.offsets[0]   = line;
+    req.num_lines    = 1;
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    strncpy(req.consumer, consumerName, sizeof(req.consumer) - 1);
+
+    return ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req) ? -1 : req.fd;
+}
+
+// Older kernels, still found on many SBC images
+static int requestLineV1(int chip, unsigned int line)
+{
+    struct gpioevent_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.lineoffset  = line;
+    req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    req.eventflags  = GPIOEVENT_REQUEST_FALLING_EDGE;
+    strncpy(req.consumer_label, consumerName, sizeof(req.consumer_label) - 1);
+
+    return ioctl(chip, GPIO_GET_LINEEVENT_IOCTL, &req) ? -1 : req.fd;
+}
+
+// Accepts "gpiochipN" or a full path
+static int openChip(std::string path)
+{
+    if (path[0] != '/') {
+        path = "/dev/" + path;
+    }
+
+    int chip = open(path.c_str(), O_RDWR | O_CLOEXEC);
+
+    if (chip == -1) {
+        LOG(ERR) << "Failed to open " << path << ": " << strerror(errno);
+    }
+
+    return chip;
+}
+
+GpioEvent* GpioEvent::Open(const char* spec)
+{
+    const char* sep = strrchr(spec, ':');
+    char* end;
+
+    if (!sep || !sep[1]) {
+        LOG(ERR) << "Malformed GPIO line " << spec << ", must be gpiochipN:line";
+        return nullptr;
+    }
+
+    unsigned int line = strtoul(sep + 1, &end, 10);
+
+    if (*end) {
+        LOG(ERR) << "Malformed GPIO line " << spec << ", must be gpiochipN:line";
+        return nullptr;
+    }
+
+    int chip = openChip(std::string(spec, sep - spec));
+
+    if (chip == -1) {
+        return nullptr;
+    }
+
+    size_t eventSize = sizeof(struct gpio_v2_line_event);
+    int fd = requestLineV2(chip, line);
+
+    if (fd == -1 && (errno == ENOTTY || errno == EINVAL)) {
+        eventSize = sizeof(struct gpioevent_data);
+        fd = requestLineV1(chip, line);
+    }
+
+    if (fd == -1) {
+        LOG(ERR) << "Failed to request events from " << spec << ": " << strerror(errno);
+        close(chip);
+        return nullptr;
+    }
+
+    // The line stays requested after the chip is closed
+    close(chip);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return new GpioEvent(fd, eventSize);
+}
+
+GpioEvent* GpioEvent::OpenFifo(const char* path)
+{
+    // Opening for writing too keeps us from seeing endless EOF when
+    // the test script closes its end
+    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd == -1) {
+        LOG(ERR) << "Failed to open " << path << ": " << strerror(errno);
+        return nullptr;
+    }
+
+    return new GpioEvent(fd, 1);
+}
+
+unsigned int GpioEvent::Consume()
+{
+    char buf[512];
+    size_t total = 0;
+    ssize_t l;
+
+    while ((l = read(m_Fd, buf, sizeof(buf) - sizeof(buf) % m_EventSize)) > 0) {
+        total += l;
+    }
+
+    return total / m_EventSize;
+}
+
+GpioChip::GpioChip(int fd, const std::string& path, unsigned int debounce)
+    : m_ChipFd(fd), m_Fd(-1), m_Path(path), m_Debounce(debounce), m_HaveEvents(false),
+      m_OutputMask(0), m_Outputs(0)
+{}
+
+GpioChip::~GpioChip()
+{
+    if (m_Fd != -1) {
+        close(m_Fd);
+    }
+    close(m_ChipFd);
+}
+
+GpioChip* GpioChip::Open(const char* name, unsigned int debounce)
+{
+    int fd = openChip(name);
+
+    return fd == -1 ? nullptr : new GpioChip(fd, name, debounce);
+}
+
+int GpioChip::AddLine(unsigned int offset, bool output, bool value)
+{
+    if (m_Fd != -1) {
+        LOG(ERR) << m_Path << " lines can't be added after startup";
+        return -1;
+    }
+    if (m_Offsets.size() == GPIO_V2_LINES_MAX) {
+        LOG(ERR) << "Too many lines used on " << m_Path;
+        return -1;
+    }
+    for (unsigned int o : m_Offsets) {
+        if (o == offset) {
+            LOG(ERR) << m_Path << " line " << offset << " is used twice";
+            return -1;
+        }
+    }
+
+    uint64_t mask = 1ULL << m_Offsets.size();
+
+    if (output) {
+        m_OutputMask |= mask;
+        if (value)
+            m_Outputs |= mask;
+    }
+
+    m_Offsets.push_back(offset);
+    return m_Offsets.size() - 1;
+}
+
+int GpioChip::Request(uint64_t inputFlags, bool debounce)
+{
+    struct gpio_v2_line_request req;
+    uint64_t inputMask = ~m_OutputMask & ((1ULL << m_Offsets.size()) - 1);
+
+    memset(&req, 0, sizeof(req));
+    strncpy(req.consumer, consumerName, sizeof(req.consumer) - 1);
+
+    for (size_t i = 0; i < m_Offsets.size(); i++) {
+        req.offsets[i] = m_Offsets[i];
+    }
+    req.num_lines = m_Offsets.size();
+
+    // Lines default to inputs, outputs are overridden by attributes
+    req.config.flags = inputFlags;
+
+    if (m_OutputMask) {
+        struct gpio_v2_line_config_attribute* a = &req.config.attrs[req.config.num_attrs++];
+
+        a->attr.id    = GPIO_V2_LINE_ATTR_ID_FLAGS;
+        a->attr.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+        a->mask       = m_OutputMask;
+
+        // Initial values; anything written before startup ends up here
+        a = &req.config.attrs[req.config.num_attrs++];
+        a->attr.id     = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+        a->attr.values = m_Outputs;
+        a->mask        = m_OutputMask;
+    }
+
+    if (debounce && inputMask) {
+        struct gpio_v2_line_config_attribute* a = &req.config.attrs[req.config.num_attrs++];
+
+        a->attr.id               = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+        a->attr.debounce_period_us = m_Debounce;
+        a->mask                  = inputMask;
+    }
+
+    return ioctl(m_ChipFd, GPIO_V2_GET_LINE_IOCTL, &req) ? -1 : req.fd;
+}
+
+void GpioChip::Start()
+{
+    if (m_Offsets.empty()) {
+        return;
+    }
+
+    // Not every chip can do debounce or edge detection, try the best
+    // configuration first
+    m_HaveEvents = true;
+    m_Fd = Request(GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING,
+                   m_Debounce);
+
+    if (m_Fd == -1 && m_Debounce) {
+        LOG(WARN) << m_Path << " doesn't support debounce: " << strerror(errno);
+        m_Fd = Request(GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING,
+                       false);
+    }
+
+    if (m_Fd == -1) {
+        m_HaveEvents = false;
+        m_Fd = Request(GPIO_V2_LINE_FLAG_INPUT, false);
+    }
+
+    if (m_Fd == -1) {
+        LOG(ERR) << "Failed to request lines from " << m_Path << ": " << strerror(errno);
+        return;
+    }
+
+    fcntl(m_Fd, F_SETFL, fcntl(m_Fd, F_GETFL) | O_NONBLOCK);
+}
+
+bool GpioChip::ReadInput(uint64_t& value)
+{
+    if (m_Fd == -1) {
+        return false;
+    }
+
+    struct gpio_v2_line_values v;
+
+    v.bits = 0;
+    v.mask = (1ULL << m_Offsets.size()) - 1;
+
+    if (ioctl(m_Fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &v)) {
+        return false;
+    }
+
+    value = v.bits;
+    return true;
+}
+
+int GpioChip::Read(int index)
+{
+    uint64_t input;
+
+    if (index == -1 || !GetInput(input, GetPollCycle())) {
+        return -1;
+    }
+
+    return (input >> index) & 1;
+}
+
+int GpioChip::Sample(int index)
+{
+    if (index == -1 || m_Fd == -1) {
+        return -1;
+    }
+
+    struct gpio_v2_line_values v;
+
+    v.bits = 0;
+    v.mask = 1ULL << index;
+
+    if (ioctl(m_Fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &v)) {
+        return -1;
+    }
+
+    return (v.bits >> index) & 1;
+}
+
+void GpioChip::Write(int index, bool value)
+{
+    if (index == -1) {
+        return;
+    }
+
+    m_OutputLock.lock();
+    if (value)
+        m_Outputs |= 1ULL << index;
+    else
+        m_Outputs &= ~(1ULL << index);
+    m_OutputLock.unlock();
+
+    // Before startup we only remember the value
+    if (m_Fd != -1 && !OutputBatch::Defer(this)) {
+        FlushOutput();
+    }
+}
+
+void GpioChip::FlushOutput()
+{
+    std::lock_guard lock(m_OutputLock);
+    struct gpio_v2_line_values v;
+
+    v.bits = m_Outputs;
+    v.mask = m_OutputMask;
+
+    if (ioctl(m_Fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v)) {
+        LOG(ERR) << "Failed to set outputs on " << m_Path << ": " << strerror(errno);
+    }
+}
+
+int GpioChip::GetEventFd() const
+{
+    // Before startup we don't know yet; HWConfig asks again after Start()
+    return m_HaveEvents ? m_Fd : -1;
+}
+
+void GpioChip::HandleEvent()
+{
+    struct gpio_v2_line_event ev[16];
+
+    while (read(m_Fd, ev, sizeof(ev)) > 0)
+        ;
+
+    InvalidateInput();
+}
+
+// *** XML deserializers begin here ***
+
+// <bus type="GpioChip" id="GPIO0" chip="gpiochip0" debounce="10000"/>
+REGISTER_DEVICE_TYPE(GpioChip)(xmlNode *node, HWConfig *)
+{
+    const char* chip = GetStrProp(node, "chip");
+    int debounce = GetIntProp(node, "debounce", 0);
+
+    if (!chip || debounce < 0) {
+        LOG(ERR) << "Malformed GpioChip description";
+        return nullptr;
+    }
+
+    return GpioChip::Open(chip, debounce);
+}
+
+REGISTER_DEVICE_TYPE(GpiodRelay)(xmlNode *node, HWConfig *cfg)
+{
+    GpioChip *chip = dynamic_cast<GpioChip *>(cfg->GetDeviceProp(node, "device"));
+    int line = GetIntProp(node, "line");
+    int inactive = GetIntProp(node, "inactive");
+
+    if ((!chip) || (line == -1) || (inactive == -1)) {
+        LOG(ERR) << "Malformed GpiodRelay definition";
+        return nullptr;
+    }
+
+    int index = chip->AddLine(line, true, inactive);
+
+    return index == -1 ? nullptr : new GpiodRelay(chip, index, inactive);
+}
+
+REGISTER_DEVICE_TYPE(GpiodSwitch)(xmlNode *node, HWConfig *cfg)
+{
+    GpioChip *chip = dynamic_cast<GpioChip *>(cfg->GetDeviceProp(node, "device"));
+    int line = GetIntProp(node, "line");
+    int inverted = GetIntProp(node, "inverted", 0);
+
+    if ((!chip) || (line == -1) || (inverted == -1)) {
+        LOG(ERR) << "Malformed GpiodSwitch definition";
+        return nullptr;
+    }
+
+    int index = chip->AddLine(line, false, false);
+
+    return index == -1 ? nullptr : new GpiodSwitch(chip, index, inverted);
+}
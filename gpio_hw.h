@@ -0,0 +1,142 @@
+/*
+ * GPIO support via the Linux GPIO character device (uAPI v2). No wiringPi or
+ * libgpiod needed, and it works with gpio-sim for testing.
+ */
+#ifndef GPIO_HW_H
+#define GPIO_HW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "hardware.h"
+
+// Edge events from a single GPIO line. The event source is a file descriptor,
+// so it can be waited for in poll() together with everything else.
+class GpioEvent
+{
+public:
+    ~GpioEvent();
+
+    // Watch falling edges on "gpiochipN:line" (or "/dev/gpiochipN:line").
+    // Returns nullptr on failure.
+    static GpioEvent* Open(const char* spec);
+    // Mock for testing: every byte written into the FIFO at path is an event
+    static GpioEvent* OpenFifo(const char* path);
+
+    int GetFd() const
+    {
+        return m_Fd;
+    }
+
+    // Drain pending events, returns how many there were
+    unsigned int Consume();
+
+private:
+    GpioEvent(int fd, size_t eventSize) : m_Fd(fd), m_EventSize(eventSize)
+    {}
+
+    int    m_Fd;
+    size_t m_EventSize;
+};
+
+/*
+ * All lines of a chip, used by GpiodRelay and GpiodSwitch devices, are
+ * requested at once, when the configuration is complete, so that all outputs
+ * are written, or all inputs are read, with a single ioctl. Inputs get
+ * kernel-side debounce and edge events, if the chip supports them.
+ */
+class GpioChip : public Hardware, public SnapshotInput, public BatchedOutput
+{
+public:
+    GpioChip(int fd, const std::string& path, unsigned int debounce);
+    ~GpioChip();
+
+    // "gpiochipN" or a full path; debounce period is in microseconds
+    static GpioChip* Open(const char* name, unsigned int debounce);
+
+    // Returns line index for Read() and Write(), or -1 on error
+    int AddLine(unsigned int offset, bool output, bool value);
+
+    // Returns 0 or 1, or -1 on failure
+    int Read(int index);
+    // Same, but reads the line right now, leaving the snapshot alone
+    int Sample(int index);
+    void Write(int index, bool value);
+
+    void Start() override;
+    void FlushOutput() override;
+    int GetEventFd() const override;
+    void HandleEvent() override;
+
+protected:
+    bool ReadInput(uint64_t& value) override;
+
+private:
+    int Request(uint64_t flags, bool debounce);
+
+    int          m_ChipFd;
+    int          m_Fd; // Line request, -1 until started
+    std::string  m_Path;
+    unsigned int m_Debounce;
+    bool         m_HaveEvents;
+
+    std::vector<unsigned int> m_Offsets;
+    uint64_t m_OutputMask;
+    uint64_t m_Outputs; // Shadow register, bit per line index
+};
+
+class GpiodRelay : public Relay
+{
+public:
+    // index is from GpioChip::AddLine()
+    GpiodRelay(GpioChip* chip, int index, bool resetState)
+        : Relay(resetState), m_Chip(chip), m_Index(index)
+    {}
+
+protected:
+    virtual void ApplyState(bool on) override
+    {
+        m_Chip->Write(m_Index, on);
+    }
+
+private:
+    GpioChip* m_Chip;
+    int       m_Index;
+};
+
+class GpiodSwitch : public Switch
+{
+public:
+    GpiodSwitch(GpioChip* chip, int index, bool activeLow)
+        : Switch(activeLow), m_Chip(chip), m_Index(index)
+    {}
+
+    virtual int GetState() override
+    {
+        return Decode(m_Chip->Read(m_Index));
+    }
+
+    virtual int Sample() override
+    {
+        return Decode(m_Chip->Sample(m_Index));
+    }
+
+private:
+    int Decode(int val)
+    {
+        if (val == -1)
+            return Fault;
+        if (m_activeLow)
+            val = !val;
+
+        return val ? On : Off;
+    }
+
+    GpioChip* m_Chip;
+    int       m_Index;
+};
+
+#endif
@@ -1,9 +1,113 @@
 #include <math.h>
+#include <algorithm>
 #include <string>
 
 #include "hardware.h"
 #include "logging.h"
 #include "utils.h"
+#include "worker.h"
+
+std::atomic<unsigned int> Hardware::g_PollCycle;
+
+thread_local OutputBatch* OutputBatch::g_Current;
+
+SnapshotInput::SnapshotInput(int maxAge)
+    : m_MaxAge(maxAge), m_RefreshPeriod(0), m_InputStale(true), m_InputOk(false), m_Input(0),
+      m_InputCycle(0), m_InputTime(0)
+{}
+
+bool SnapshotInput::GetInput(uint64_t& value, unsigned int cycle)
+{
+    std::lock_guard lock(m_InputLock);
+    uint64_t now = GetMonotonicTimeMs();
+
+    if (!m_InputStale) {
+        bool fresh;
+
+        if (m_RefreshPeriod) {
+            // If the worker got stuck, we'll notice it
+            fresh = now - m_InputTime < 2 * m_RefreshPeriod;
+        } else if (m_MaxAge < 0) {
+            fresh = cycle == m_InputCycle;
+        } else {
+            fresh = now - m_InputTime < (uint64_t)m_MaxAge;
+        }
+
+        if (fresh) {
+            value = m_Input;
+            return m_InputOk;
+        }
+    }
+
+    // A failed read is cached too, so that a dead chip produces one
+    // fault per cycle, not one per switch
+    TRACE_SPAN("ReadInput");
+
+    m_InputStale = false;
+    m_InputOk    = ReadInput(m_Input);
+    m_InputCycle = cycle;
+    m_InputTime  = now;
+
+    value = m_Input;
+    return m_InputOk;
+}
+
+void SnapshotInput::RefreshInput()
+{
+    TRACE_SPAN("RefreshInput");
+    uint64_t start = GetMonotonicTimeMs();
+    uint64_t value = 0;
+    bool ok = ReadInput(value);
+    std::lock_guard lock(m_InputLock);
+
+    // Don't overwrite a newer reading, taken by GetInput()
+    if (start >= m_InputTime) {
+        m_InputOk   = ok;
+        m_Input     = value;
+        m_InputTime = start;
+    }
+}
+
+OutputBatch::OutputBatch() : m_Outermost(!g_Current)
+{
+    if (m_Outermost)
+        g_Current = this;
+}
+
+OutputBatch::~OutputBatch()
+{
+    Flush();
+
+    if (m_Outermost)
+        g_Current = nullptr;
+}
+
+void OutputBatch::Flush()
+{
+    if (!m_Outermost)
+        return;
+
+    for (BatchedOutput* dev : m_Pending)
+        dev->FlushOutput();
+
+    m_Pending.clear();
+}
+
+bool OutputBatch::Defer(BatchedOutput* dev)
+{
+    OutputBatch* b = g_Current;
+
+    if (!b)
+        return false;
+
+    for (BatchedOutput* d : b->m_Pending) {
+        if (d == dev)
+            return true;
+    }
+
+    b->m_Pending.push_back(dev);
+    return true;
+}
 
 const char* const Relay::statusStrings[] =
 {
@@ -11,15 +115,222 @@ const char* const Relay::statusStrings[] =
     "on"
 };
 
+Switch::Switch(bool inverted)
+    : m_activeLow(inverted), m_LastState(Off),
+      m_DebounceCount(1), m_StableTime(0), m_Raw(-1), m_RawCount(0), m_RawCycle(0), m_RawSince(0),
+      m_ChatterLimit(0), m_ChatterHold(0), m_Changes(0), m_ChangesSince(0), m_Chatter(false)
+{}
+
+int Switch::poll()
+{
+    TRACE_SPAN("Switch::poll", m_name);
+    int raw = GetState();
+
+    HwTrace::Input(this, raw);
+
+    int state = Debounce(raw);
+
+    if (state != m_LastState) {
+        m_LastState = state;
+        ReportCurrentState();
+    }
+
+    return state;
+}
+
+int Switch::Debounce(int raw)
+{
+    uint64_t now = GetMonotonicTimeMs();
+    unsigned int cycle = GetPollCycle();
+
+    if (raw != m_Raw) {
+        if (m_Raw != -1)
+            CountChange();
+        m_Raw      = raw;
+        m_RawCount = 1;
+        m_RawCycle = cycle;
+        m_RawSince = now;
+    } else if (cycle != m_RawCycle) {
+        // Several polls within one cycle count as one
+        m_RawCount++;
+        m_RawCycle = cycle;
+    }
+
+    if (m_ChatterLimit && now - m_ChangesSince >= 60000) {
+        if (m_Chatter && m_Changes <= m_ChatterLimit)
+            SetChatter(false);
+        m_Changes = 0;
+        m_ChangesSince = now;
+    }
+
+    unsigned int stable = m_Chatter ? std::max(m_StableTime, m_ChatterHold) : m_StableTime;
+
+    if (m_RawCount >= m_DebounceCount && now - m_RawSince >= stable)
+        return m_Raw;
+
+    return m_LastState;
+}
+
+void Switch::CountChange()
+{
+    if (!m_ChatterLimit)
+        return;
+
+    if (++m_Changes > m_ChatterLimit && !m_Chatter)
+        SetChatter(true);
+}
+
+void Switch::SetChatter(bool on)
+{
+    m_Chatter = on;
+
+    if (on)
+        LOG(WARN) << m_description << " input is chattering, changes are rate limited";
+    else
+        LOG(INFO) << m_description << " input is stable again";
+
+    if (!m_name.empty())
+        m_Bus->SendEvent(m_StatePrefix + '/' + m_name + "/chatter", (int)on);
+}
+
+class ThermometerSampler : public Worker
+{
+public:
+    ThermometerSampler(Thermometer* t, unsigned int period)
+        : Worker("therm-" + t->m_name, period), m_Thermometer(t)
+    {}
+
+protected:
+    void Run() override
+    {
+        m_Thermometer->Sample();
+    }
+
+private:
+    Thermometer* m_Thermometer;
+};
+
+Thermometer::Thermometer(float thresh)
+    : m_Threshold(thresh), m_SampleInterval(0), m_MaxAge(0), m_State(Normal), m_LastValue(0),
+      m_Deadband(0), m_Hysteresis(0), m_Filter(NoFilter), m_Alpha(1), m_Window(1),
+      m_Sampler(nullptr), m_Sample(NAN), m_SampleTime(0)
+{}
+
+Thermometer::~Thermometer()
+{
+    // Normally it's already stopped; by now Measure() of the subclass is gone
+    delete m_Sampler;
+}
+
+void Thermometer::SetSampling(unsigned int interval, unsigned int maxAge)
+{
+    m_SampleInterval = interval;
+    m_MaxAge = maxAge;
+
+    // Nothing is known until the first sample arrives. Set quietly, the first
+    // real reading will be reported as a change. Done here, not in Start(),
+    // because thermometers, sampled by their bus, don't call it.
+    m_State     = interval ? Fault : Normal;
+    m_LastValue = interval ? NAN : 0;
+}
+
+void Thermometer::Start()
+{
+    if (m_SampleInterval && !m_Sampler) {
+        m_Sampler = new ThermometerSampler(this, m_SampleInterval);
+        m_Sampler->Start();
+    }
+}
+
+void Thermometer::Stop()
+{
+    if (m_Sampler)
+        m_Sampler->Stop();
+}
+
+float Thermometer::Filter(float raw)
+{
+    if (isnan(raw)) {
+        // Start over when the sensor recovers
+        m_History.clear();
+        return raw;
+    }
+
+    switch (m_Filter)
+    {
+    case EMA:
+        if (!m_History.empty())
+            raw = m_History.front() + m_Alpha * (raw - m_History.front());
+        m_History.assign(1, raw);
+        return raw;
+
+    case Median:
+    {
+        m_History.push_back(raw);
+        if (m_History.size() > m_Window)
+            m_History.pop_front();
+
+        std::vector<float> sorted(m_History.begin(), m_History.end());
+        auto mid = sorted.begin() + sorted.size() / 2;
+
+        std::nth_element(sorted.begin(), mid, sorted.end());
+        return *mid;
+    }
+
+    default:
+        return raw;
+    }
+}
+
+void Thermometer::PutSample(float value)
+{
+    HwTrace::Input(this, value);
+
+    std::lock_guard lock(m_SampleLock);
+
+    m_Sample     = Filter(value);
+    m_SampleTime = GetMonotonicTimeMs();
+}
+
 float Thermometer::GetValue()
 {
-    float temp = Measure();
+    float temp;
     int state;
 
+    if (m_SampleInterval) {
+        uint64_t sampleTime;
+
+        m_SampleLock.lock();
+        temp = m_Sample;
+        sampleTime = m_SampleTime;
+        m_SampleLock.unlock();
+
+        if (!sampleTime) {
+            // The first sample is not taken yet, we know nothing
+            return NAN;
+        }
+
+        if (m_MaxAge && GetMonotonicTimeMs() - sampleTime > m_MaxAge) {
+            if (!isnan(m_LastValue)) {
+                LOG(ERR) << "Thermometer " << m_name << " is not responding";
+            }
+            temp = NAN;
+        }
+    } else {
+        TRACE_SPAN("Thermometer::Measure", m_name);
+
+        temp = Measure();
+        HwTrace::Input(this, temp);
+        temp = Filter(temp);
+    }
+
     if (isnan(temp)) {
         state = Fault;
     } else if (temp >= m_Threshold) {
         state = Normal;
+    } else if (m_State == Normal && temp >= m_Threshold - m_Hysteresis) {
+        // Hovering around the threshold, don't flip
+        state = Normal;
     } else {
         state = Cold;
     }
@@ -29,7 +340,10 @@ float Thermometer::GetValue()
         m_State = state;
         Hardware::ReportState("thermometer", state);
     }
-    if (temp != m_LastValue && !(isnan(temp) && isnan(m_LastValue))) {
+    bool changed = isnan(temp) ? !isnan(m_LastValue) :
+                   (isnan(m_LastValue) || fabs(temp - m_LastValue) > m_Deadband);
+
+    if (changed) {
         m_LastValue = temp;
         Hardware::ReportValue("thermometer", temp);
     }
@@ -71,7 +385,7 @@ void Valve::ReportFault(const char* s)
     // Avoid flooding the log
     if (m_State != Fault) {
         ReportState(Fault);
-        Log(Log::ERR) << m_description << " valve " << s;
+        LOG(ERR) << m_description << " valve " << s;
     }
 }
 
@@ -107,6 +421,9 @@ bool Valve::SetState(int state, bool force)
     }
 
     if ((m_State != Fault) || force) {
+        // Drive both pins at once if they are on the same expander
+        OutputBatch batch;
+
         switch (state)
         {
         case Open:
@@ -144,13 +461,15 @@ bool Valve::SetState(int state, bool force)
 
 void Valve::Poll()
 {
+    TRACE_SPAN("Valve::Poll", m_name);
+
     GetStateFromSwitches();
 
     if ((m_State == Opening) || (m_State == Closing)) {
         if (GetMonotonicTime() - m_StateChange > m_StateChangeTimeout) {
 	    if (HaveSwitches()) {
 		// Timeout exceeded, mechanical fault
-		Log(Log::ERR) << m_description << " valve "
+		LOG(ERR) << m_description << " valve "
 		              << statusStrings[m_State] << " timeout";
 		ReportState(Fault);
             } else if (m_State == Opening) {
@@ -1,10 +1,17 @@
 #ifndef HARDWARE_H
 #define HARDWARE_H
 
+#include <stdint.h>
 #include <time.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include "event_bus.h"
+#include "hwtrace.h"
+#include "trace.h"
 
 class Hardware
 {
@@ -13,21 +20,127 @@ public:
 
     virtual void ReportCurrentState() const {}
 
+    // Called once the whole configuration is parsed, before the control
+    // logic starts up
+    virtual void Start() {}
+    // Called before the configuration is destroyed. Stop background activity here.
+    virtual void Stop() {}
+
+    // Devices, which can signal input changes, return a file descriptor to
+    // wait on. HandleEvent() is called when it becomes readable.
+    virtual int GetEventFd() const
+    {
+        return -1;
+    }
+
+    virtual void HandleEvent() {}
+
+    // Poll cycle counter of the device's configuration, advanced by HWState
+    // on every Poll(). Input devices use it in order to access the hardware
+    // only once per cycle.
+    unsigned int GetPollCycle() const
+    {
+        return m_PollCycle->load(std::memory_order_relaxed);
+    }
+
     std::string m_name;
     std::string m_description;
+    int         m_TraceId = -1; // See HwTrace
+    EventBus*   m_Bus = &EventBus::getInstance();
+    // Set by HWConfig; every site has its own
+    std::atomic<unsigned int>* m_PollCycle = &g_PollCycle;
 
 protected:
     void ReportState(const std::string& prefix, int value) const
     {
         if (!m_name.empty())
-            SendEvent(prefix + '/' + m_name + "/state", value);
+            m_Bus->SendEvent(prefix + '/' + m_name + "/state", value);
     }
 
     void ReportValue(const std::string& prefix, float value) const
     {
         if (!m_name.empty())
-            SendEvent(prefix + '/' + m_name + "/value", value);
+            m_Bus->SendEvent(prefix + '/' + m_name + "/value", value);
+    }
+
+private:
+    // For devices, created outside of a configuration
+    static std::atomic<unsigned int> g_PollCycle;
+};
+
+// Inputs, which keep a snapshot of the hardware state, so that all the
+// switches on a chip are decoded from a single read. The snapshot is taken
+// once per poll cycle, or once per maxAge ms if that is given. A bus worker
+// may also keep it fresh in background, then reading doesn't touch the
+// hardware at all. An invalidated snapshot is re-read by the reader.
+class SnapshotInput
+{
+public:
+    SnapshotInput(int maxAge = -1);
+    virtual ~SnapshotInput() {}
+
+    // Returns false if the hardware could not be read. cycle is the poll
+    // cycle of the owning device, see Hardware::GetPollCycle().
+    bool GetInput(uint64_t& value, unsigned int cycle);
+    // Read the hardware now; called by the bus worker every period ms
+    void RefreshInput();
+
+    void SetRefreshPeriod(unsigned int period)
+    {
+        m_RefreshPeriod = period;
     }
+
+    void InvalidateInput()
+    {
+        m_InputStale = true;
+    }
+
+protected:
+    virtual bool ReadInput(uint64_t& value) = 0;
+
+private:
+    std::mutex        m_InputLock;
+    int               m_MaxAge;
+    unsigned int      m_RefreshPeriod;
+    std::atomic<bool> m_InputStale;
+    bool              m_InputOk;
+    uint64_t          m_Input;
+    unsigned int      m_InputCycle;
+    uint64_t          m_InputTime;
+};
+
+// Outputs, which can postpone hardware writes while an OutputBatch is active
+class BatchedOutput
+{
+public:
+    virtual void FlushOutput() = 0;
+
+protected:
+    // Guards the output shadow register and writing it out. A chip may
+    // serve several zones, which are controlled under different locks.
+    std::mutex m_OutputLock;
+};
+
+// While an instance exists, output changes made by the current thread are
+// accumulated in devices' shadow registers and written out at once when it
+// goes out of scope. Nested batches join the outermost one.
+class OutputBatch
+{
+public:
+    OutputBatch();
+    ~OutputBatch();
+
+    // Write out pending changes now, e.g. before releasing a lock
+    void Flush();
+
+    // Returns false if there's no active batch, the caller must write now
+    static bool Defer(BatchedOutput* dev);
+
+private:
+    bool m_Outermost;
+    std::vector<BatchedOutput*> m_Pending;
+
+    static thread_local OutputBatch* g_Current;
 };
 
 class Relay : public Hardware
@@ -40,6 +153,7 @@ public:
 
     void SetState(bool st)
     {
+        HwTrace::Output(this, st);
         ReportState(st);
         ApplyState(st ? !m_ResetState : m_ResetState);
     }
@@ -78,21 +192,40 @@ public:
         Fault
     };
 
-    Switch(bool inverted) : m_activeLow(inverted), m_LastState(Off)
-    {}
+    Switch(bool inverted);
 
     virtual int GetState() = 0;
 
-    int poll()
+    // Fresh raw reading, bypassing input snapshots. Unlike GetState() this
+    // may be called from threads other than the control loop.
+    virtual int Sample()
     {
-        int state = GetState();
+        return GetState();
+    }
+
+    // Returns debounced state and reports its changes
+    int poll();
+
+    // A change is accepted once the new raw state has been seen in count
+    // consecutive poll cycles and has been stable for stableTime ms
+    void SetDebounce(unsigned int count, unsigned int stableTime)
+    {
+        m_DebounceCount = count;
+        m_StableTime = stableTime;
+    }
 
-        if (state != m_LastState) {
-            m_LastState = state;
-            ReportCurrentState();
-        }
+    // An input, changing more than limit times per minute, is flagged as
+    // chattering, and then needs to be stable for hold ms for a change to be
+    // accepted. Zero limit disables the detection.
+    void SetChatterLimit(unsigned int limit, unsigned int hold)
+    {
+        m_ChatterLimit = limit;
+        m_ChatterHold = hold;
+    }
 
-        return state;
+    bool IsChattering() const
+    {
+        return m_Chatter;
     }
 
     void SetStatePrefix(const char* s)
@@ -110,10 +243,29 @@ protected:
     bool m_activeLow;
 
 private:
+    int  Debounce(int raw);
+    void CountChange();
+    void SetChatter(bool on);
+
     int         m_LastState;
     std::string m_StatePrefix = "switch";
+
+    unsigned int m_DebounceCount;
+    unsigned int m_StableTime;
+    int          m_Raw;        // Last raw state, -1 before the first poll
+    unsigned int m_RawCount;   // Number of poll cycles it's been seen in
+    unsigned int m_RawCycle;
+    uint64_t     m_RawSince;
+
+    unsigned int m_ChatterLimit;
+    unsigned int m_ChatterHold;
+    unsigned int m_Changes;    // Raw changes within the current minute
+    uint64_t     m_ChangesSince;
+    bool         m_Chatter;
 };
 
+class ThermometerSampler;
+
 class Thermometer : public Hardware
 {
 public:
@@ -124,16 +276,58 @@ public:
         Normal
     };
 
-    Thermometer(float thresh) : m_State(Normal), m_Threshold(thresh), m_LastValue(0)
-    {}
+    Thermometer(float thresh);
+    ~Thermometer();
 
     virtual int GetState()
     {
         return m_State;
     }
 
+    // Never blocks if background sampling is on; returns the latest sample
     float GetValue();
 
+    // Sample every interval ms in background; zero means synchronous
+    // measurement on every GetValue(). Samples, older than maxAge ms, are
+    // considered a fault. With background sampling the state is Fault until
+    // the first sample arrives.
+    void SetSampling(unsigned int interval, unsigned int maxAge);
+
+    // Readings, differing from the last reported one by less than deadband,
+    // are not reported. Once Normal, the state goes Cold only when temperature
+    // drops hysteresis degrees below the threshold.
+    void SetDeadband(float deadband, float hysteresis)
+    {
+        m_Deadband = deadband;
+        m_Hysteresis = hysteresis;
+    }
+
+    // Smoothing of raw readings: exponential moving average, or median of
+    // the last window samples, which also kills single spikes
+    void SetEMA(float alpha)
+    {
+        m_Filter = EMA;
+        m_Alpha = alpha;
+    }
+
+    void SetMedian(unsigned int window)
+    {
+        m_Filter = Median;
+        m_Window = window;
+    }
+
+    // Take a new sample, may be called from any thread
+    void PutSample(float value);
+    // Measure() and store the result
+    void Sample()
+    {
+        TRACE_SPAN("Thermometer::Measure", m_name);
+        PutSample(Measure());
+    }
+
+    void Start() override;
+    void Stop() override;
+
     void ReportCurrentState() const override
     {
         Hardware::ReportState("thermometer", m_State);
@@ -148,9 +342,33 @@ protected:
 
     float m_Threshold;
 
+    unsigned int m_SampleInterval;
+    unsigned int m_MaxAge;
+
 private:
+    enum FilterType
+    {
+        NoFilter,
+        EMA,
+        Median
+    };
+
+    float Filter(float raw);
+
     int   m_State;
     float m_LastValue;
+
+    float m_Deadband;
+    float m_Hysteresis;
+    FilterType m_Filter;
+    float m_Alpha;
+    unsigned int m_Window;
+    std::deque<float> m_History; // Median window, or single EMA value
+
+    ThermometerSampler* m_Sampler;
+    std::mutex m_SampleLock;
+    float      m_Sample;
+    uint64_t   m_SampleTime; // Monotonic, ms; zero if there's no sample yet
 };
 
 class Valve : public Hardware
@@ -1,5 +1,7 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef _WIN32
@@ -19,6 +21,7 @@
 #include "event_bus.h"
 #include "httpd.h"
 #include "logging.h"
+#include "trace.h"
 #include "userdb.h"
 
 // TODO: These have to go to some config file
@@ -106,8 +109,9 @@ FileReader::~FileReader()
 class HTTPSession : public Session, public LogListener
 {
 public:
-    HTTPSession(const char* user, const std::string& connId, unsigned int access)
-		: Session(user, connId), m_Access(access)
+    HTTPSession(const char* user, const std::string& connId, unsigned int access,
+                const std::string& site)
+		: Session(user, connId), m_Access(access), m_Site(site)
     {
 		AddLogListener(this);
 	}
@@ -128,10 +132,19 @@ public:
     }
 
 	unsigned int m_Access;
+    // Sessions are valid only within the site, where the user has logged in
+    std::string  m_Site;
 
 private:
     virtual void Write(const std::string& line) override
     {
+        const std::string* site = LogContext::Get();
+
+        // In multi-site mode show only our site's messages; lines without
+        // a site are process-wide and are not for site users either
+        if (!m_Site.empty() && (!site || *site != m_Site))
+            return;
+
         m_Lock.lock();
         m_Lines.push_back(line);
         m_Lock.unlock();
@@ -165,7 +178,18 @@ void HTTPServer::freeCallBack(void* cls)
 }
 
 HTTPServer::HTTPServer(HWConfig* cfg, HWState* hwState)
-    : m_hwConfig(cfg), m_hwState(hwState)
+{
+    m_Sites[""] = {cfg, hwState};
+    start();
+}
+
+HTTPServer::HTTPServer(const std::map<std::string, HTTPSite>& sites)
+    : m_Sites(sites)
+{
+    start();
+}
+
+void HTTPServer::start()
 {
     m_httpd = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY|MHD_USE_DEBUG, port,
                                NULL, NULL, urlHandler, this,
@@ -187,10 +211,10 @@ void HTTPServer::Run()
     }
 }
 
-static void formatStates(std::ostream& output, const char* prefix)
+static void formatStates(std::ostream& output, const EventBus* bus, const char* prefix)
 {
     size_t l = strlen(prefix) + 1;
-    std::map<std::string, int> states = EventBus::getInstance().CollectValues<int>(prefix);
+    std::map<std::string, int> states = bus->CollectValues<int>(prefix);
     bool first = true;
 
     output << '{';
@@ -214,10 +238,10 @@ struct StateValue
     float value = NAN;
 };
 
-static void formatValues(std::ostream& output, const char* prefix)
+static void formatValues(std::ostream& output, const EventBus* bus, const char* prefix)
 {
     size_t l = strlen(prefix) + 1;
-    std::map<std::string, GValue> states = EventBus::getInstance().CollectValues(prefix);
+    std::map<std::string, GValue> states = bus->CollectValues(prefix);
     std::map<std::string, StateValue> grouped;
     bool first = true;
 
@@ -257,9 +281,9 @@ static void formatValues(std::ostream& output, const char* prefix)
     output << '}';
 }
 
-static void formatSingleValue(std::ostream& os, const char* json_name, const char* name)
+static void formatSingleValue(std::ostream& os, const EventBus* bus, const char* json_name, const char* name)
 {
-    int state = EventBus::getInstance().getValue<int>(name, -1);
+    int state = bus->getValue<int>(name, -1);
 
     if (state == -1)
         return;
@@ -288,27 +312,45 @@ static void formatItemStatus(std::ostream& output, const char* id, int state)
     output << "{\"" << id << "\":" << state << '}';
 }
 
-void HTTPServer::formatFullStatus(std::ostream& output, HTTPSession* s)
+void HTTPServer::formatFullStatus(std::ostream& output, const HTTPSite& site, HTTPSession* s)
 {
+    const EventBus* bus = site.cfg->GetBus();
+
     output << "{\"valves\":";
-    formatStates(output, "valve");
+    formatStates(output, bus, "valve");
     output << ",\"relays\":";
-    formatStates(output, "relay");
+    formatStates(output, bus, "relay");
     output << ",\"switches\":";
-    formatStates(output, "pressure_switch");
+    formatStates(output, bus, "pressure_switch");
     output << ",\"thermometers\":";
-    formatValues(output, "thermometer");
+    formatValues(output, bus, "thermometer");
     output << ",\"leak_sensors\":";
-    formatStates(output, "leak_sensor");
-    formatSingleValue(output, "sys", "ValveController/state");
-    formatSingleValue(output, "mode", "ValveController/mode");
-    formatSingleValue(output, "leak", "LeakDetector/state");
-    formatSingleValue(output, "heater", "HeaterController/state");
-
-    output << ",\"sys\":" << m_hwState->GetState();
-    output << ",\"mode\":" << m_hwState->GetMode();
-    output << ",\"leak\":" << m_hwState->GetLeakState();
-    output << ",\"heater\":" << m_hwState->GetHeaterState();
+    formatStates(output, bus, "leak_sensor");
+    formatSingleValue(output, bus, "sys", "ValveController/state");
+    formatSingleValue(output, bus, "mode", "ValveController/mode");
+    formatSingleValue(output, bus, "leak", "LeakDetector/state");
+    formatSingleValue(output, bus, "heater", "HeaterController/state");
+
+    output << ",\"sys\":" << site.hwState->GetState();
+    output << ",\"mode\":" << site.hwState->GetMode();
+    output << ",\"leak\":" << site.hwState->GetLeakState();
+    output << ",\"heater\":" << site.hwState->GetHeaterState();
+
+    // Additional zones, if any; the main one is reported above
+    const std::vector<Zone*>& zones = site.hwState->GetZones();
+
+    if (zones.size() > 1) {
+        output << ",\"zones\":{";
+        for (size_t i = 1; i < zones.size(); i++) {
+            if (i > 1)
+                output << ',';
+            output << '"' << zones[i]->m_Id << "\":{\"sys\":" << zones[i]->GetState()
+                   << ",\"leak\":" << zones[i]->GetLeakState()
+                   << ",\"heater\":" << zones[i]->GetHeaterState() << '}';
+        }
+        output << '}';
+    }
+
     formatLog(output, s);
     output << '}';
 }
@@ -336,7 +378,8 @@ static std::string getConnId(struct MHD_Connection *conn)
     return std::string(buf) + "/http";
 }
 
-HTTPSession* HTTPServer::findSession(struct MHD_Connection *connection, unsigned int permission)
+HTTPSession* HTTPServer::findSession(struct MHD_Connection *connection, const std::string& site,
+                                     unsigned int permission)
 {
     const char* sidStr = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "session");
 
@@ -345,6 +388,7 @@ HTTPSession* HTTPServer::findSession(struct MHD_Connection *connection, unsigned
         HTTPSession *s = dynamic_cast<HTTPSession *>(GetSession(sid));
 
         if (s && (s->m_ConnId == getConnId(connection))
+              && (s->m_Site == site)
 			  && (s->m_Access >= permission))
 		{
             return s;
@@ -354,14 +398,70 @@ HTTPSession* HTTPServer::findSession(struct MHD_Connection *connection, unsigned
     return nullptr;
 }
 
-unsigned int HTTPServer::GetControlUserLevel()
+unsigned int HTTPServer::GetControlUserLevel(HWState* hwState)
 {
 	// If the system in maintenance mode, only technician can control
-	return m_hwState->GetMode() == HWState::FullManual ? User::TECHNICIAN : User::NORMAL;
+	return hwState->GetMode() == HWState::FullManual ? User::TECHNICIAN : User::NORMAL;
 }
 
 int HTTPServer::handleRequest(struct MHD_Connection *connection, const char* url)
 {
+    auto single = m_Sites.find("");
+
+    if (single != m_Sites.end())
+        return handleSiteRequest(connection, "", single->second, "", url);
+
+    // Multi-site: /site/<name>/<path>
+    static const char sitePrefix[] = "/site/";
+    std::string redirect;
+    std::string str;
+    int res = MHD_HTTP_NOT_FOUND;
+
+    if (!strncmp(url, sitePrefix, sizeof(sitePrefix) - 1)) {
+        const char* name = url + sizeof(sitePrefix) - 1;
+        const char* path = strchr(name, '/');
+        auto it = m_Sites.find(path ? std::string(name, path - name) : std::string(name));
+
+        if (it != m_Sites.end()) {
+            std::string base = sitePrefix + it->first;
+
+            if (path)
+                return handleSiteRequest(connection, it->first, it->second, base, path);
+
+            // Relative links in our pages need the trailing slash
+            redirect = base + "/index.html";
+        }
+    } else if (!strcmp(url, "/")) {
+        str = "<html><body>";
+        for (const auto& it : m_Sites)
+            str += "<p><a href=\"/site/" + it.first + "/index.html\">" + it.first + "</a></p>";
+        str += "</body></html>";
+        res = MHD_HTTP_OK;
+    }
+
+    if (res != MHD_HTTP_OK && redirect.empty())
+        str = "<html><body>404 Not found</body></html>";
+
+    struct MHD_Response *response = MHD_create_response_from_buffer(str.length(), (void*)str.c_str(),
+                                                                    MHD_RESPMEM_MUST_COPY);
+    if (!redirect.empty()) {
+        MHD_add_response_header(response, MHD_HTTP_HEADER_LOCATION, redirect.c_str());
+        res = MHD_HTTP_TEMPORARY_REDIRECT;
+    }
+
+    int ret = MHD_queue_response(connection, res, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+int HTTPServer::handleSiteRequest(struct MHD_Connection *connection, const std::string& name,
+                                  const HTTPSite& site, const std::string& base, const char* url)
+{
+    // Commands, issued via the web, are logged with the site name
+    LogContext logContext(name.empty() ? nullptr : &name);
+    TRACE_SPAN("HTTP", url);
+    HWState* hwState = site.hwState;
     struct MHD_Response *response;
     int res = MHD_HTTP_BAD_REQUEST;
     int ret;
@@ -379,27 +479,27 @@ int HTTPServer::handleRequest(struct MHD_Connection *connection, const char* url
             unsigned int permissions = Authenticate(user, passwd);
 
             if (permissions > User::NOACCESS) {
-                s = new HTTPSession(user, getConnId(connection), permissions);
+                s = new HTTPSession(user, getConnId(connection), permissions, name);
                 RegisterSession(s);
             }
         }
 
         if (s) {
-            redirect = std::string("/panel.html?session=") + std::to_string(s->m_Id);
+            redirect = base + "/panel.html?session=" + std::to_string(s->m_Id);
         } else {
-            redirect = "/noaccess.html";
+            redirect = base + "/noaccess.html";
         }
     } else if (!strcmp(url, "/logout")) {
-        s = findSession(connection);
+        s = findSession(connection, name);
 
         if (s) {
             TerminateSession(s);
             s = nullptr;
         }
 
-        redirect = "/index.html";
+        redirect = base + "/index.html";
     } else if (!strcmp(url, "/valve")) {
-        s = findSession(connection, User::TECHNICIAN);
+        s = findSession(connection, name, User::TECHNICIAN);
         if (s) {
             const char *id = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "id");
             const char *action = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "action");
@@ -413,7 +513,7 @@ int HTTPServer::handleRequest(struct MHD_Connection *connection, const char* url
                 else if (!strcmp(action, "reset"))
                     state = Valve::Reset;
 
-                int err = m_hwState->ValveControl(id, state, s->GetConnStr());
+                int err = hwState->ValveControl(id, state, s->GetConnStr());
 
                 if (err == 0) {
                     output << "{\"valves\":";
@@ -427,7 +527,7 @@ int HTTPServer::handleRequest(struct MHD_Connection *connection, const char* url
             res = MHD_HTTP_UNAUTHORIZED;
         }
     } else if (!strcmp(url, "/relay")) {
-        s = findSession(connection, User::TECHNICIAN);
+        s = findSession(connection, name, User::TECHNICIAN);
         if (s) {
             const char *id = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "id");
             const char *action = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "action");
@@ -445,7 +545,7 @@ int HTTPServer::handleRequest(struct MHD_Connection *connection, const char* url
                 }
 
                 if (err == 0) {
-                    err = m_hwState->RelayControl(id, state, s->GetConnStr());
+                    err = hwState->RelayControl(id, state, s->GetConnStr());
                 }
 
                 if (err == 0) {
@@ -460,16 +560,20 @@ int HTTPServer::handleRequest(struct MHD_Connection *connection, const char* url
             res = MHD_HTTP_UNAUTHORIZED;
         }
     } else if (!strcmp(url, "/status")) {
-        s = findSession(connection);
+        s = findSession(connection, name);
         if (s) {
-            formatFullStatus(output, s);
+            formatFullStatus(output, site, s);
             res = MHD_HTTP_OK;
         } else {
             res = MHD_HTTP_UNAUTHORIZED;
         }
     } else if (!strcmp(url, "/control")) {
-        s = findSession(connection, GetControlUserLevel());
+        s = findSession(connection, name, GetControlUserLevel(hwState));
         if (s) {
+            // State, leak and heater commands may be addressed to a zone
+            const char* zoneStr = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "zone");
+            std::string zone = zoneStr ? zoneStr : "";
+
             if (const char *modeStr = MHD_lookup_connection_value(connection,
                                                                   MHD_GET_ARGUMENT_KIND, "mode"))
             {
@@ -488,8 +592,8 @@ int HTTPServer::handleRequest(struct MHD_Connection *connection, const char* url
                 }
 
                 if (mode != HWState::BadMode) {
-                    m_hwState->SetMode(mode, s->GetConnStr());
-                    formatFullStatus(output, s);
+                    hwState->SetMode(mode, s->GetConnStr());
+                    formatFullStatus(output, site, s);
                     res = MHD_HTTP_OK;
                 }
             }
@@ -506,9 +610,10 @@ int HTTPServer::handleRequest(struct MHD_Connection *connection, const char* url
                     state = HWState::Heater;
                 }
                 if (state != HWState::Fault) {
-                    m_hwState->SetState(state, s->GetConnStr());
-                    formatFullStatus(output, s);
-                    res = MHD_HTTP_OK;
+                    if (hwState->SetState(state, s->GetConnStr(), zone) != ENOENT) {
+                        formatFullStatus(output, site, s);
+                        res = MHD_HTTP_OK;
+                    }
                 }
             }
             else if (const char* leakStr = MHD_lookup_connection_value(connection,
@@ -522,9 +627,10 @@ int HTTPServer::handleRequest(struct MHD_Connection *connection, const char* url
                     state = LeakSensor::Disabled;
                 }
                 if (state != LeakSensor::Fault) {
-                    m_hwState->SetLeakState(state, s->GetConnStr());
-                    formatFullStatus(output, s);
-                    res = MHD_HTTP_OK;
+                    if (hwState->SetLeakState(state, s->GetConnStr(), zone) != ENOENT) {
+                        formatFullStatus(output, site, s);
+                        res = MHD_HTTP_OK;
+                    }
                 }
             }
             else if (const char* heaterStr = MHD_lookup_connection_value(connection,
@@ -536,14 +642,32 @@ int HTTPServer::handleRequest(struct MHD_Connection *connection, const char* url
                     state = HeaterController::Wash;
                 }
                 if (state != HeaterController::Fault) {
-                    m_hwState->SetHeaterState(state, s->GetConnStr());
-                    formatFullStatus(output, s);
-                    res = MHD_HTTP_OK;
+                    if (hwState->SetHeaterState(state, s->GetConnStr(), zone) != ENOENT) {
+                        formatFullStatus(output, site, s);
+                        res = MHD_HTTP_OK;
+                    }
                 }
             }
         } else {
             res = MHD_HTTP_UNAUTHORIZED;
         }
+    } else if (!strcmp(url, "/debug/trace")) {
+        // Timing spans of the last "seconds", Chrome trace format. The first
+        // request only turns tracing on, so the trace is empty.
+        s = findSession(connection, name, User::TECHNICIAN);
+        if (s) {
+            const char* secStr = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "seconds");
+            int seconds = secStr ? atoi(secStr) : 10;
+
+            if (seconds > 0) {
+                Trace::Enable();
+                // A site's technician sees only that site's control loop
+                Trace::Dump(output, seconds, name.empty() ? nullptr : name.c_str());
+                res = MHD_HTTP_OK;
+            }
+        } else {
+            res = MHD_HTTP_UNAUTHORIZED;
+        }
     } else if (!(strcmp(url, "/") && strcmp(url, "/index.htm"))) {
         localPath = "/index.html";
     } else {
@@ -552,10 +676,10 @@ int HTTPServer::handleRequest(struct MHD_Connection *connection, const char* url
 
     if (!strcmp(url, "/panel.html")) {
         // TODO: Define protected zone in some different, flexible way
-        s = findSession(connection);
+        s = findSession(connection, name);
         if (!s) {
             localPath = nullptr;
-            redirect = "/index.html";
+            redirect = base + "/index.html";
         }
     }
 
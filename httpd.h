@@ -6,18 +6,30 @@
 
 class HTTPSession;
 
+struct HTTPSite
+{
+    HWConfig* cfg;
+    HWState*  hwState;
+};
+
 class HTTPServer
 {
 public:
     HTTPServer(HWConfig* cfg, HWState* hwState);
+    // Multi-site mode: every site is served under /site/<name>/
+    HTTPServer(const std::map<std::string, HTTPSite>& sites);
     ~HTTPServer();
 
     void Run();
 
 private:
+    void start();
     int handleRequest(struct MHD_Connection *connection, const char *url);
-    HTTPSession *findSession(struct MHD_Connection *connection, unsigned int permission = User::GUEST);
-	unsigned int GetControlUserLevel();
+    int handleSiteRequest(struct MHD_Connection *connection, const std::string& name,
+                          const HTTPSite& site, const std::string& base, const char *url);
+    HTTPSession *findSession(struct MHD_Connection *connection, const std::string& site,
+                             unsigned int permission = User::GUEST);
+	unsigned int GetControlUserLevel(HWState* hwState);
 
     static int urlHandler(void *cls, struct MHD_Connection *connection, const char *url,
                           const char *method, const char *version,
@@ -25,9 +37,9 @@ private:
     static ssize_t readCallBack(void* cls, uint64_t pos, char *buf, size_t max);
     static void freeCallBack(void* cls);
 
-    void formatFullStatus(std::ostream& output, HTTPSession* s);
+    void formatFullStatus(std::ostream& output, const HTTPSite& site, HTTPSession* s);
 
     struct MHD_Daemon* m_httpd;
-    HWConfig* m_hwConfig;
-    HWState* m_hwState;
+    // Single site has an empty name
+    std::map<std::string, HTTPSite> m_Sites;
 };
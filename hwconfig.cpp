@@ -2,10 +2,16 @@
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
+#ifndef _WIN32
+#include <poll.h>
+#endif
 
 #include "hwconfig.h"
 #include "hwstate.h"
+#include "hwtrace.h"
 #include "logging.h"
+#include "utils.h"
+#include "worker.h"
 
 #ifdef _WIN32
 static const char *const configPath = "C:\\aquarius\\etc\\aquarius\\config.xml";
@@ -63,13 +69,13 @@ int GetIntProp(xmlNode *node, const char *name, int defVal)
         int ret = ReadInt(str);
 
         if (ret == -1) {
-	    Log(Log::ERR) << "Invalid value for \"" << name << "\" attribute " << *node;
+	    LOG(ERR) << "Invalid value for \"" << name << "\" attribute " << *node;
 	}
 
         return ret;
     } else {
 	if (defVal == -1) {
-	    Log(Log::ERR) << "Missing mandatory \"" << name << "\" attribute " << *node;
+	    LOG(ERR) << "Missing mandatory \"" << name << "\" attribute " << *node;
 	}
         return defVal;
     }
@@ -138,25 +144,37 @@ Hardware *HWConfig::createDevice(xmlNode *node)
 {
     const char *type = GetStrProp(node, "type");
     DeviceType *dt;
+    Hardware *dev;
 
     if (!type) {
-        Log(Log::ERR) << "Malformed configuration element " << node->name;
+        LOG(ERR) << "Malformed configuration element " << node->name;
         return nullptr;
     }
 
-    for (dt = g_DeviceTypes; dt; dt = dt->m_Next) {
-        if (!strcmp(dt->m_Type, type))
-            break;
-    }
+    if (HwTrace::IsReplaying()) {
+        // Real hardware may not even exist here
+        dev = HwTrace::CreateReplayDevice(node);
+    } else {
+        for (dt = g_DeviceTypes; dt; dt = dt->m_Next) {
+            if (!strcmp(dt->m_Type, type))
+                break;
+        }
 
-    if (!dt) {
-        Log(Log::ERR) << "Unknown device type " << type;
-        return nullptr;
-    }
+        if (!dt) {
+            LOG(ERR) << "Unknown device type " << type;
+            return nullptr;
+        }
+
+        dev = dt->CreateDevice(node, this);
 
-    Hardware *dev = dt->CreateDevice(node, this);
+        if (dev && HwTrace::IsRecording())
+            HwTrace::AddDevice(dev, node);
+    }
 
     if (dev) {
+        dev->m_Bus = m_Bus;
+        dev->m_PollCycle = &m_PollCycle;
+
         // Optional fields: id and description
         // id is required for referencing and status display
         setId(dev, node);
@@ -166,12 +184,82 @@ Hardware *HWConfig::createDevice(xmlNode *node)
         const char *desc = GetStrProp(node, "description");
         if (desc)
             dev->m_description = desc;
+
+        Thermometer *t = dynamic_cast<Thermometer *>(dev);
+        if (t)
+            configureThermometer(t, node);
+
+        Switch *sw = dynamic_cast<Switch *>(dev);
+        if (sw)
+            configureSwitch(sw, node);
     }
 
     return dev;
 }
 
-void HWConfig::createLogger(xmlNode* node)
+void HWConfig::configureSwitch(Switch *sw, xmlNode *node)
+{
+    // Debounce is off and chatter detection is disabled by default
+    int count = GetIntProp(node, "debounce", 1);
+    int stableTime = GetIntProp(node, "stable_time", 0);
+    int chatter = GetIntProp(node, "chatter", 0);
+    int hold = GetIntProp(node, "chatter_hold", 10000);
+
+    if (count < 1 || stableTime < 0 || chatter < 0 || hold < 0) {
+        LOG(ERR) << "Malformed switch debounce parameters " << *node;
+        return;
+    }
+
+    sw->SetDebounce(count, stableTime);
+    sw->SetChatterLimit(chatter, hold);
+}
+
+void HWConfig::configureThermometer(Thermometer *t, xmlNode *node)
+{
+    // 1-wire sensors take up to 750 ms to convert, so by default they are
+    // sampled in background once per second. sample_interval="0" restores
+    // synchronous reading.
+    int interval = GetIntProp(node, "sample_interval", 1000);
+    int maxAge = GetIntProp(node, "max_age", 10000);
+
+    if (interval < 0 || maxAge < 0) {
+        LOG(ERR) << "Malformed thermometer sampling parameters " << *node;
+        return;
+    }
+
+    t->SetSampling(interval, maxAge);
+
+    // Noise filtering, all optional
+    float deadband = GetFloatProp(node, "deadband");
+    float hysteresis = GetFloatProp(node, "hysteresis");
+    const char *filter = GetStrProp(node, "filter");
+
+    t->SetDeadband(isnan(deadband) ? 0 : deadband, isnan(hysteresis) ? 0 : hysteresis);
+
+    if (!filter) {
+        return;
+    } else if (!strcmp(filter, "ema")) {
+        float alpha = GetFloatProp(node, "alpha");
+
+        if (isnan(alpha) || alpha <= 0 || alpha > 1) {
+            LOG(ERR) << "EMA filter requires alpha in (0, 1] " << *node;
+        } else {
+            t->SetEMA(alpha);
+        }
+    } else if (!strcmp(filter, "median")) {
+        int window = GetIntProp(node, "window", 5);
+
+        if (window < 1) {
+            LOG(ERR) << "Malformed median filter window " << *node;
+        } else {
+            t->SetMedian(window);
+        }
+    } else {
+        LOG(ERR) << "Unknown thermometer filter " << filter << *node;
+    }
+}
+
+LogListener *HWConfig::CreateLogger(xmlNode* node, HWConfig *cfg)
 {
     const char *type = GetStrProp(node, "type");
     LoggerType* lt;
@@ -181,7 +269,7 @@ void HWConfig::createLogger(xmlNode* node)
         // are practically critical, so we log them to console. Anyways we don't have
         // anything else at this point
         std::cerr << "Malformed configuration element " << node->name << std::endl;
-        return;
+        return nullptr;
     }
 
     for (lt = g_LoggerTypes; lt; lt = lt->m_Next) {
@@ -191,31 +279,122 @@ void HWConfig::createLogger(xmlNode* node)
 
     if (!lt) {
         std::cerr << "Unknown logger type " << type << std::endl;
-        return;
+        return nullptr;
     }
 
-    LogListener *logger = lt->CreateLogger(node, this);
+    return lt->CreateLogger(node, cfg);
+}
+
+void HWConfig::createLogger(xmlNode* node)
+{
+    LogListener *logger = CreateLogger(node, this);
+
+    if (!logger) {
+        // The factory has already complained
+        return;
+    }
 
     m_Loggers.push_back(logger);
     AddLogListener(logger);
 }
 
+void HWConfig::configureLogLimits(xmlNode* node)
+{
+    ConfigureLogLimits(node);
+}
+
+void HWConfig::ConfigureLogLimits(xmlNode* node)
+{
+    LogLimits limits;
+
+    // Zero disables respective limit
+    limits.burst        = GetIntProp(node, "burst", 20);
+    limits.errorBurst   = GetIntProp(node, "error_burst", 100);
+    limits.interval     = GetIntProp(node, "interval", 60);
+    limits.repeatWindow = GetIntProp(node, "repeat_window", 60);
+
+    SetLogLimits(limits);
+}
+
+// Refreshes input snapshots of all devices on a bus in background, so
+// that the control loop never waits for the bus. Every bus gets its own
+// thread, so slow buses don't add up.
+class BusWorker : public Worker
+{
+public:
+    BusWorker(const std::string& name, unsigned int period) : Worker(name, period)
+    {}
+
+    void AddDevice(Hardware* dev)
+    {
+        SnapshotInput* input = dynamic_cast<SnapshotInput*>(dev);
+
+        if (input) {
+            input->SetRefreshPeriod(GetPeriod());
+            m_Inputs.push_back(input);
+        }
+    }
+
+    bool IsEmpty() const
+    {
+        return m_Inputs.empty();
+    }
+
+protected:
+    void Run() override
+    {
+        for (SnapshotInput* input : m_Inputs)
+            input->RefreshInput();
+    }
+
+private:
+    std::vector<SnapshotInput*> m_Inputs;
+};
+
 void HWConfig::createBus(xmlNode *node)
 {
+    // Optional background refresh period in ms
+    int interval = GetIntProp(node, "poll_interval", 0);
+
     m_Parent = createDevice(node);
     AddHardware(m_Parent);
+
+    if (interval < 0) {
+        LOG(ERR) << "Malformed poll interval " << *node;
+    } else if (interval > 0 && m_Parent) {
+        std::string name = m_Parent->m_name.empty() ? std::to_string(m_BusWorkers.size()) : m_Parent->m_name;
+
+        m_ParentWorker = new BusWorker(GetWorkerName("bus-" + name), interval);
+        m_ParentWorker->AddDevice(m_Parent);
+    }
+
     readNodes(node->children, "device", &HWConfig::createDeviceOnBus);
+
+    if (m_ParentWorker) {
+        if (m_ParentWorker->IsEmpty()) {
+            LOG(WARN) << "Bus has nothing to poll " << *node;
+            delete m_ParentWorker;
+        } else {
+            m_BusWorkers.push_back(m_ParentWorker);
+        }
+    }
+
     m_Parent = nullptr;
+    m_ParentWorker = nullptr;
 }
 
 void HWConfig::createDeviceOnBus(xmlNode *node)
 {
     Hardware *dev = createDevice(node);
     AddHardware(dev);
+
+    if (m_ParentWorker)
+        m_ParentWorker->AddDevice(dev);
 }
 
 void HWConfig::createHeater(xmlNode *heaterNode)
 {
+    ZoneConfig& zone = m_Zones[m_Zone];
     xmlNode *node;
 
     for (node = heaterNode->children; node; node = node->next) {
@@ -224,29 +403,52 @@ void HWConfig::createHeater(xmlNode *heaterNode)
             Hardware *dev;
 
             if (!strcmp(name, "power_relay")) {
-               dev = createDevice(node);
+               dev = zone.heater = createDeviceOfClass<Relay>(node);
             } else if (!strcmp(name, "drain_relay")) {
-               dev = createDevice(node);
+               dev = zone.drain = createDeviceOfClass<Relay>(node);
             } else if (!strcmp(name, "pressure_switch")) {
-               dev = createDevice(node);
+               dev = zone.pressure = createDeviceOfClass<Switch>(node);
             } else if (!strcmp(name, "temp_sensor")) {
-               dev = createDevice(node);
+               dev = zone.temperature = createDeviceOfClass<Thermometer>(node);
             } else {
-                Log(Log::ERR) << "Unknown heater controller component \"" << name << '"';
+                LOG(ERR) << "Unknown heater controller component \"" << name << '"';
                 continue;
             }
 
-            // TODO: Properly create HeaterController here and connect inputs
-
             AddHardware(dev);
         }
     }
 }
 
+static void getPollInterval(xmlNode *node, unsigned int &interval)
+{
+    int val = GetIntProp(node, "poll_interval", interval);
+
+    if (val <= 0) {
+        LOG(ERR) << "Malformed poll interval " << *node;
+    } else {
+        interval = val;
+    }
+}
+
 void HWConfig::createLeakDetector(xmlNode *heaterNode)
 {
     xmlNode *node;
 
+    getPollInterval(heaterNode, m_LeakPollInterval);
+
+    int guardInterval = GetIntProp(heaterNode, "guard_interval", 0);
+    int guardConfirm  = GetIntProp(heaterNode, "guard_confirm", 1);
+    int guardPriority = GetIntProp(heaterNode, "guard_priority", 0);
+
+    if (guardInterval < 0 || guardConfirm <= 0 || guardPriority < 0) {
+        LOG(ERR) << "Malformed leak guard parameters " << *heaterNode;
+    } else {
+        m_LeakGuardInterval = guardInterval;
+        m_LeakGuardConfirm  = guardConfirm;
+        m_LeakGuardPriority = guardPriority;
+    }
+
     for (node = heaterNode->children; node; node = node->next) {
         if (node->type == XML_ELEMENT_NODE) {
             const char *name = (const char *)node->name;
@@ -255,7 +457,7 @@ void HWConfig::createLeakDetector(xmlNode *heaterNode)
             if (!strcmp(name, "switch")) {
                 dev = createDevice(node);
             } else {
-                Log(Log::ERR) << "Unknown leak detector component \"" << name << '"';
+                LOG(ERR) << "Unknown leak detector component \"" << name << '"';
                 continue;
             }
 
@@ -263,7 +465,7 @@ void HWConfig::createLeakDetector(xmlNode *heaterNode)
             if (sw) {
                 AddLeakSensor(sw);
             } else {
-                Log(Log::ERR) << "Only switches are currently supported as leak sensor inputs";
+                LOG(ERR) << "Only switches are currently supported as leak sensor inputs";
             }
         }
     }
@@ -271,14 +473,16 @@ void HWConfig::createLeakDetector(xmlNode *heaterNode)
 
 void HWConfig::createValveController(xmlNode *vcNode)
 {
-    Valve *CS = nullptr;
-    Valve *HS = nullptr;
-    Valve *HI = nullptr;
-    Valve *HO = nullptr;
-    Thermometer *HST = nullptr;
-    int recoveryDelay = -1;
+    ZoneConfig& zone = m_Zones[m_Zone];
+    Valve *&CS = zone.CS;
+    Valve *&HS = zone.HS;
+    Valve *&HI = zone.HI;
+    Valve *&HO = zone.HO;
+    Thermometer *&HST = zone.HST;
     xmlNode *node;
 
+    getPollInterval(vcNode, m_ValvePollInterval);
+
     for (node = vcNode->children; node; node = node->next) {
         if (node->type == XML_ELEMENT_NODE) {
             const char *name = (const char *)node->name;
@@ -297,23 +501,81 @@ void HWConfig::createValveController(xmlNode *vcNode)
                AddHardware(HO);
             } else if (!strcmp(name, "hot_supply_temp")) {
                 HST = createDeviceOfClass<Thermometer>(node);
+                getPollInterval(node, m_SupplyPollInterval);
                AddHardware(HST);
             } else if (!strcmp(name, "recovery_delay")) {
-                recoveryDelay = GetIntContent(node);
+                zone.recoveryDelay = GetIntContent(node);
             } else {
-                Log(Log::ERR) << "Unknown valve controller component \""
+                LOG(ERR) << "Unknown valve controller component \""
                                 << name << '"' << *node;
                 continue;
             }
         }
     }
 
-    if (recoveryDelay == -1) {
-        Log(Log::ERR) << "Valve controller recovery delay is not specified" << *vcNode;
+    if (zone.recoveryDelay == -1) {
+        LOG(ERR) << "Valve controller recovery delay is not specified" << *vcNode;
+    }
+}
+
+// Additional zone, e.g. a riser of a larger building:
+// <zone id="R1" parent="">
+//   <heater_controller>, <leak_detector> and <valve_controller>, same as
+//   the main zone's ones
+// </zone>
+// Parent is the zone, which supplies water to this one, the main zone by
+// default. A leak in a zone closes it together with all the zones, it
+// supplies.
+void HWConfig::createZone(xmlNode *zoneNode)
+{
+    const char *id = GetStrProp(zoneNode, "id");
+    const char *parent = GetStrProp(zoneNode, "parent");
+
+    // Ids are parts of event topics
+    if (!id || !*id || strchr(id, '/')) {
+        LOG(ERR) << "Malformed zone id " << *zoneNode;
         return;
     }
 
-    m_HWState = new HWState(this, CS, HS, HI, HO, HST, recoveryDelay);
+    for (const ZoneConfig& z : m_Zones) {
+        if (z.id == id) {
+            LOG(ERR) << "Duplicate zone " << id;
+            return;
+        }
+    }
+
+    m_Zone = m_Zones.size();
+    m_Zones.push_back(ZoneConfig());
+    m_Zones[m_Zone].id = id;
+    if (parent)
+        m_Zones[m_Zone].parent = parent;
+
+    readNodes(zoneNode->children, "heater_controller", &HWConfig::createHeater);
+    readNodes(zoneNode->children, "leak_detector", &HWConfig::createLeakDetector);
+    readNodes(zoneNode->children, "valve_controller", &HWConfig::createValveController);
+
+    m_Zone = 0;
+}
+
+bool HWConfig::checkZone(const ZoneConfig& zone)
+{
+    const char *missing = nullptr;
+
+    if (!zone.CS || !zone.HS || !zone.HI || !zone.HO)
+        missing = "valves";
+    else if (!zone.HST)
+        missing = "hot supply thermometer";
+    else if (zone.recoveryDelay == -1)
+        missing = "recovery delay";
+    else if (!zone.heater || !zone.drain || !zone.pressure || !zone.temperature)
+        missing = "heater controller";
+
+    if (missing) {
+        LOG(ERR) << "Zone \"" << zone.id << "\" has no " << missing;
+        return false;
+    }
+
+    return true;
 }
 
 Valve *HWConfig::createValve(xmlNode *vNode)
@@ -326,7 +588,7 @@ Valve *HWConfig::createValve(xmlNode *vNode)
     xmlNode *node;
 
     if (timeout == -1) {
-        Log(Log::ERR) << "Invalid valve timeout value in the config";
+        LOG(ERR) << "Invalid valve timeout value in the config";
         return nullptr;
     }
 
@@ -343,7 +605,7 @@ Valve *HWConfig::createValve(xmlNode *vNode)
             } else if (!strcmp(name, "open_switch")) {
                 openSwitch = dynamic_cast<Switch *>(createDevice(node));
             } else {
-                Log(Log::ERR) << "Unknown valve component " << name;
+                LOG(ERR) << "Unknown valve component " << name;
             }
 
             // Note no AddHardware() here. Valve owns its components.
@@ -357,7 +619,7 @@ Valve *HWConfig::createValve(xmlNode *vNode)
         setId(v, vNode);
         return v;
     } else {
-        Log(Log::ERR) << "Valve relay definition is invalid or missing";
+        LOG(ERR) << "Valve relay definition is invalid or missing";
 
         if (closeRelay) {
             delete closeRelay;
@@ -376,14 +638,33 @@ Valve *HWConfig::createValve(xmlNode *vNode)
     }
 }
 
-HWConfig::HWConfig()
-    : m_HWState(nullptr)
+HWConfig::HWConfig(const std::string& site, const char* path)
+    : m_HWState(nullptr),
+      m_LeakPollInterval(1000), m_ValvePollInterval(1000), m_SupplyPollInterval(1000),
+      m_LeakGuardInterval(0), m_LeakGuardConfirm(1), m_LeakGuardPriority(0),
+      m_Site(site), m_Bus(site.empty() ? &EventBus::getInstance() : new EventBus()),
+      m_PollCycle(0), m_ParentWorker(nullptr), m_Zones(1), m_Zone(0)
 {
     LIBXML_TEST_VERSION
-    xmlDoc *doc = xmlReadFile(configPath, NULL, 0);
+    xmlDoc *doc;
+
+    if (HwTrace::IsReplaying()) {
+        const std::string& cfg = HwTrace::GetConfig();
 
-    if (doc == NULL) {
-        fatal("Could not parse configuration file %s", configPath);
+        doc = xmlReadMemory(cfg.data(), cfg.size(), "trace", NULL, 0);
+        if (doc == NULL) {
+            fatal("Could not parse configuration from the trace");
+        }
+    } else {
+        if (!path)
+            path = configPath;
+
+        doc = xmlReadFile(path, NULL, 0);
+        if (doc == NULL) {
+            fatal("Could not parse configuration file %s", path);
+        }
+        if (HwTrace::IsRecording())
+            HwTrace::SaveConfig(doc);
     }
 
     xmlNode *root = xmlDocGetRootElement(doc);
@@ -398,24 +679,110 @@ HWConfig::HWConfig()
     }
 
     if (startNode) {
-        readNodes(startNode, "logger", &HWConfig::createLogger);
+        if (HwTrace::IsReplaying()) {
+            // Recorded loggers belong to the machine, where the trace was made
+            ConsoleLog *console = new ConsoleLog(Log::INFO);
+
+            m_Loggers.push_back(console);
+            AddLogListener(console);
+        } else if (m_Site.empty()) {
+            readNodes(startNode, "logger", &HWConfig::createLogger);
+        }
+        if (m_Site.empty())
+            readNodes(startNode, "log_limits", &HWConfig::configureLogLimits);
         readNodes(startNode, "bus", &HWConfig::createBus);
         readNodes(startNode, "heater_controller", &HWConfig::createHeater);
         readNodes(startNode, "leak_detector", &HWConfig::createLeakDetector);
         // Valve controller interacts with all other components, so we create it
         // after everything else
         readNodes(startNode, "valve_controller", &HWConfig::createValveController);
+        readNodes(startNode, "zone", &HWConfig::createZone);
     }
 
+    // Only complete zones take part. The main one is mandatory.
+    std::vector<ZoneConfig> zones;
+
+    for (const ZoneConfig& z : m_Zones) {
+        if (checkZone(z))
+            zones.push_back(z);
+        else if (z.id.empty())
+            fatal("Main zone configuration is incomplete");
+    }
+
+    // All the hardware is known now. Valve relays and switches live on buses,
+    // which we start here, so they don't need it themselves.
+    for (auto& hw : m_hw)
+        startHardware(hw.second);
+    for (Hardware* hw : m_AnonHW)
+        startHardware(hw);
+    for (Hardware* hw : m_LeakDetectors)
+        startHardware(hw);
+    for (BusWorker* w : m_BusWorkers)
+        w->Start();
+
+    m_HWState = new HWState(this, zones);
+
     xmlFreeDoc(doc);
-    xmlCleanupParser();
+    // Sites are loaded one after another, the site list cleans up at the end
+    if (m_Site.empty())
+        xmlCleanupParser();
+
+    // The guard samples switches in real time, while the trace runs on the
+    // virtual clock. Leaks are handled by the main loop anyway.
+    if (HwTrace::IsReplaying())
+        m_LeakGuardInterval = 0;
+}
+
+bool HWConfig::WaitForEvents(unsigned int timeout)
+{
+#ifdef _WIN32
+    msleep(timeout);
+    return false;
+#else
+    std::vector<struct pollfd> fds(m_EventSources.size());
+
+    for (size_t i = 0; i < fds.size(); i++) {
+        fds[i].fd = m_EventSources[i]->GetEventFd();
+        fds[i].events = POLLIN;
+    }
+
+    // With the virtual clock the time passes without waiting
+    if (g_VirtualClock) {
+        msleep(timeout);
+        timeout = 0;
+    }
+
+    // Interrupted by a signal is the same as timed out, the caller
+    // checks for quit anyway
+    if (poll(fds.data(), fds.size(), timeout) <= 0)
+        return false;
+
+    for (size_t i = 0; i < fds.size(); i++) {
+        if (fds[i].revents)
+            m_EventSources[i]->HandleEvent();
+    }
+
+    return true;
+#endif
 }
 
 HWConfig::~HWConfig()
 {
+    // Stop background threads first, they may refer to each other
+    for (BusWorker* w : m_BusWorkers)
+        delete w;
+
+    // This also stops the leak guard
     if (m_HWState)
         delete m_HWState;
 
+    for (auto& hw : m_hw)
+        hw.second->Stop();
+    for (auto hw : m_LeakDetectors)
+        hw->Stop();
+    for (auto hw : m_AnonHW)
+        hw->Stop();
+
     for (auto& hw : m_hw)
         delete hw.second;
 
@@ -429,4 +796,7 @@ HWConfig::~HWConfig()
         RemoveLogListener(logger);
         delete logger;
     }
+
+    if (!m_Site.empty())
+        delete m_Bus;
 }
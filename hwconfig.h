@@ -2,6 +2,7 @@
 #define HWCONFIG_H
 
 #include <libxml/tree.h>
+#include <atomic>
 #include <map>
 #include <string>
 #include <vector>
@@ -9,6 +10,7 @@
 #include "hardware.h"
 #include "logging.h"
 
+class BusWorker;
 class HWState;
 
 static inline const char *GetStrProp(xmlNode *node, const char *name)
@@ -18,15 +20,70 @@ static inline const char *GetStrProp(xmlNode *node, const char *name)
 
 int GetIntProp(xmlNode *node, const char *name, int defVal = -1);
 float GetFloatProp(xmlNode *node, const char *name);
+Log::Level GetLogLevel(xmlNode *node, const char *name = "level", Log::Level defLevel = Log::INFO);
 
 std::ostream &operator<<(std::ostream& os, const xmlNode &node);
 
+// Hardware of a single zone, see Zone
+struct ZoneConfig
+{
+    std::string id;     // Empty for the main zone
+    std::string parent; // Zone, which supplies water to this one
+
+    Valve*       CS  = nullptr;
+    Valve*       HS  = nullptr;
+    Valve*       HI  = nullptr;
+    Valve*       HO  = nullptr;
+    Thermometer* HST = nullptr;
+    int          recoveryDelay = -1;
+
+    Relay*       heater      = nullptr;
+    Relay*       drain       = nullptr;
+    Switch*      pressure    = nullptr;
+    Thermometer* temperature = nullptr;
+
+    std::vector<Switch*> leakSensors;
+};
+
 class HWConfig
 {
 public:
-    HWConfig();
+    // In multi-site mode every site has its own configuration file, event
+    // bus and saved state; loggers are shared and come from the site list
+    HWConfig(const std::string& site = "", const char* path = nullptr);
     ~HWConfig();
 
+    const std::string& GetSiteName() const
+    {
+        return m_Site;
+    }
+
+    EventBus* GetBus() const
+    {
+        return m_Bus;
+    }
+
+    // See Hardware::GetPollCycle()
+    void NextPollCycle()
+    {
+        m_PollCycle.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Names of background threads must be unique across sites
+    std::string GetWorkerName(const std::string& name) const
+    {
+        return m_Site.empty() ? name : m_Site + '/' + name;
+    }
+
+    const std::vector<Hardware *>& GetEventSources() const
+    {
+        return m_EventSources;
+    }
+
+    // Instantiate a logger, described by the node. Returns nullptr on failure.
+    static LogListener *CreateLogger(xmlNode *node, HWConfig *cfg);
+    static void ConfigureLogLimits(xmlNode *node);
+
     Hardware *GetDeviceProp(xmlNode *node, const char *name);
     Hardware *GetParentHW()
     {
@@ -54,8 +111,22 @@ public:
         return m_LeakDetectors;
     }
 
+    // Sleep for up to timeout ms, waking up early if some device signals
+    // an input change. Returns true in the latter case.
+    bool WaitForEvents(unsigned int timeout);
+
     HWState *m_HWState;
 
+    // Periods of the control loop parts in milliseconds
+    unsigned int m_LeakPollInterval;
+    unsigned int m_ValvePollInterval;
+    unsigned int m_SupplyPollInterval;
+
+    // Leak guard, see LeakGuard. Zero interval disables it.
+    unsigned int m_LeakGuardInterval;
+    unsigned int m_LeakGuardConfirm;
+    int          m_LeakGuardPriority;
+
 private:
     void AddHardware(const char* name, Hardware* hw, const char* description)
     {
@@ -68,16 +139,27 @@ private:
     {
         hw->SetStatePrefix("leak_sensor");
         m_LeakDetectors.push_back(hw);
+        m_Zones[m_Zone].leakSensors.push_back(hw);
     }
 
     void AddHardware(Hardware* hw)
     {
+        // Failed to create; or, in trace replay, a bus with no I/O of its own
+        if (!hw)
+            return;
         if (hw->m_name.empty())
             m_AnonHW.push_back(hw);
         else
             m_hw[hw->m_name] = hw;
     }
 
+    void startHardware(Hardware* hw)
+    {
+        hw->Start();
+        if (hw->GetEventFd() != -1)
+            m_EventSources.push_back(hw);
+    }
+
     void AddLeakDetector(const char* name, Switch* hw, const char* description)
     {
         hw->m_name = name;
@@ -85,14 +167,19 @@ private:
         m_LeakDetectors.push_back(hw);
     }
 
+    bool checkZone(const ZoneConfig& zone);
     Hardware *createDevice(xmlNode *node);
+    void configureThermometer(Thermometer *t, xmlNode *node);
+    void configureSwitch(Switch *sw, xmlNode *node);
     void readNodes(xmlNode *startNode, const char *name, void(HWConfig::*parserFunc)(xmlNode *));
     void createLogger(xmlNode* node);
+    void configureLogLimits(xmlNode* node);
     void createBus(xmlNode *node);
     void createDeviceOnBus(xmlNode *node);
     void createHeater(xmlNode *node);
     void createLeakDetector(xmlNode *node);
     void createValveController(xmlNode *node);
+    void createZone(xmlNode *node);
     Valve *createValve(xmlNode *node);
 
     template <class T>
@@ -102,19 +189,29 @@ private:
         T *ret = dynamic_cast<T *>(hw);
 
         if (!ret) {
-            Log(Log::ERR) << "Device " << node->name << " has wrong type " << *node;
+            LOG(ERR) << "Device " << node->name << " has wrong type " << *node;
             delete hw;
         }
 
         return ret;
     }
 
+    std::string m_Site;
+    EventBus *m_Bus;
+    std::atomic<unsigned int> m_PollCycle;
+
     Hardware *m_Parent;
+    BusWorker *m_ParentWorker;
 
     std::map<std::string, Hardware*> m_hw;
     std::vector<Switch*> m_LeakDetectors;
     std::vector<Hardware *>m_AnonHW;
+    std::vector<Hardware *>m_EventSources;
     std::vector<LogListener *> m_Loggers;
+    std::vector<BusWorker *> m_BusWorkers;
+    // The main zone goes first; m_Zone is being configured now
+    std::vector<ZoneConfig> m_Zones;
+    size_t m_Zone;
 };
 
 class DeviceType
@@ -3,6 +3,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+
 #ifdef _WIN32
 #include <io.h>
 #else
@@ -15,9 +22,9 @@
 #include "utils.h"
 #include "wiringpi_hw.h"
 
-LeakSensor::LeakSensor(HWConfig* cfg) : m_state(Enabled)
+LeakSensor::LeakSensor(EventBus* bus, const std::string& topicPrefix, const std::vector<Switch*>& sensors)
+    : m_Bus(bus), m_Topic(topicPrefix + "LeakDetector/state"), m_Sensors(sensors), m_state(Enabled)
 {
-    m_Sensors = cfg->GetLeakDetectors();
     m_SensorState = new int[m_Sensors.size()];
 
     for (size_t i = 0; i < m_Sensors.size(); i++)
@@ -26,6 +33,7 @@ LeakSensor::LeakSensor(HWConfig* cfg) : m_state(Enabled)
 
 bool LeakSensor::Poll()
 {
+    TRACE_SPAN("LeakSensor::Poll");
     bool alarm = false;
 
     for (size_t i = 0; i < m_Sensors.size(); i++) {
@@ -41,7 +49,7 @@ bool LeakSensor::Poll()
 
         switch (ss) {
         case Switch::On:
-            Log(Log::WARN) << "Leak detected in " << s->m_description;
+            LOG(WARN) << "Leak detected in " << s->m_description;
             if (m_state == Enabled) {
                 ReportState(Alarm);
                 alarm = true;
@@ -49,7 +57,7 @@ bool LeakSensor::Poll()
             break;
 
         case Switch::Fault:
-            Log(Log::ERR) << "Leak sensor fault in " << s->m_description;
+            LOG(ERR) << "Leak sensor fault in " << s->m_description;
             break;
         }
     }
@@ -57,17 +65,79 @@ bool LeakSensor::Poll()
     return alarm;
 }
 
+LeakGuard::LeakGuard(HWState* hw, HWConfig* cfg)
+    : Worker(cfg->GetWorkerName("leak-guard"), cfg->m_LeakGuardInterval), m_Bus(cfg->GetBus()),
+      m_Confirm(cfg->m_LeakGuardConfirm), m_Priority(cfg->m_LeakGuardPriority),
+      m_Started(false)
+{
+    for (Zone* zone : hw->GetZones()) {
+        for (Switch* sw : cfg->GetLeakDetectors()) {
+            if (zone->Owns(sw)) {
+                m_Sensors.push_back(sw);
+                m_Zones.push_back(zone);
+            }
+        }
+    }
+
+    m_OnCount.resize(m_Sensors.size(), 0);
+}
+
+void LeakGuard::Run()
+{
+    if (!m_Started) {
+#ifdef __linux__
+        if (m_Priority) {
+            struct sched_param param = {};
+            int err;
+
+            param.sched_priority = m_Priority;
+            err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+            if (err) {
+                LOG(WARN) << "Failed to set leak guard priority: " << strerror(err);
+            }
+        }
+#endif
+        m_Started = true;
+    }
+
+    for (size_t i = 0; i < m_Sensors.size(); i++) {
+        if (m_Sensors[i]->Sample() != Switch::On) {
+            m_OnCount[i] = 0;
+            continue;
+        }
+
+        // Act once per leak, a persisting one has been handled already
+        if (++m_OnCount[i] != m_Confirm) {
+            continue;
+        }
+
+        auto detected = std::chrono::steady_clock::now();
+
+        if (!m_Zones[i]->EmergencyClose()) {
+            continue;
+        }
+
+        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - detected).count();
+
+        LOG(WARN) << "Leak detected in " << m_Sensors[i]->m_description
+                  << ", valves closed in " << latency << " us";
+        m_Bus->SendEvent("LeakGuard/latency", (int)latency);
+    }
+}
+
 // TODO: This is configurable
 static const int WashDelay   = 20;
 static const int RefillDelay = 2;
 
-HeaterController::HeaterController(HWState* hw, HWConfig* cfg)
-    : m_HW(hw), m_State(OK), m_washStep(None)
+HeaterController::HeaterController(Zone* zone, const ZoneConfig& cfg, EventBus* bus,
+                                   const std::string& topicPrefix)
+    : m_Zone(zone), m_Bus(bus), m_Topic(topicPrefix + "Heater/state"), m_State(OK), m_washStep(None)
 {
-    m_Heater      = cfg->GetHardware<Relay>("HR");
-    m_Drain       = cfg->GetHardware<Relay>("HD");
-    m_Pressure    = cfg->GetHardware<Switch>("HP");
-    m_Temperature = cfg->GetHardware<Thermometer>("HT");
+    m_Heater      = cfg.heater;
+    m_Drain       = cfg.drain;
+    m_Pressure    = cfg.pressure;
+    m_Temperature = cfg.temperature;
 
     // We know functions, so we know descriptions
     m_Heater->m_description      = "Heater relay";
@@ -101,7 +171,7 @@ void HeaterController::ApplyState(int state)
         break;
 
     case Pressurize:
-        if (m_HW->GetState() == HWState::Heater) {
+        if (m_Zone->GetState() == HWState::Heater) {
             SetState(Wash);
         }
     };
@@ -127,17 +197,21 @@ void HeaterController::Control(bool on)
     }
 }
 
-void HeaterController::Poll(int s_HI)
+void HeaterController::PollTemperature()
 {
-    int s_HP = m_Pressure->poll();
-
     // Currently we don't do anything with heater temperature, it's just
     // for the user, but someone has to poll it, do it here
     m_Temperature->GetValue();
+}
+
+void HeaterController::Poll(int s_HI)
+{
+    TRACE_SPAN("HeaterController::Poll");
+    int s_HP = m_Pressure->poll();
 
     if (s_HP == Switch::Fault) {
         if (m_State != Fault) {
-            Log(Log::ERR) << "Heater pressure monitor fault";
+            LOG(ERR) << "Heater pressure monitor fault";
             ApplyState(Fault);
         }
     }
@@ -159,7 +233,7 @@ void HeaterController::Poll(int s_HI)
                 RefillAndEndWash();
             }
         } else if ((s_HI != Valve::Opening) && (m_washStep != WashStep::Refill)) {
-            Log(Log::WARN) << "Heater wash aborted";
+            LOG(WARN) << "Heater wash aborted";
             RefillAndEndWash();
         }
 
@@ -169,7 +243,7 @@ void HeaterController::Poll(int s_HI)
             {
             case Switch::Off:
                 if (GetMonotonicTime() > m_washTimer) {
-                    Log(Log::WARN) << "Heater failed to re-pressurize";
+                    LOG(WARN) << "Heater failed to re-pressurize";
                     ApplyState(Protection);
                 }
                 break;
@@ -185,12 +259,12 @@ void HeaterController::Poll(int s_HI)
     {
         if ((s_HP == Switch::Off) && (m_State != Protection))
         {
-            Log(Log::WARN) << "Heater pressure lost";
+            LOG(WARN) << "Heater pressure lost";
             ApplyState(Protection);
         }
         else if ((s_HP == Switch::On) && (m_State == Protection))
         {
-            Log(Log::INFO) << "Heater pressure restored";
+            LOG(INFO) << "Heater pressure restored";
             ApplyState(Pressurize);
         }
     }
@@ -198,9 +272,9 @@ void HeaterController::Poll(int s_HI)
 
 void HeaterController::StartWash()
 {
-    if (m_HW->InFinalState())
+    if (m_Zone->InFinalState())
     {
-        m_HW->HeaterWash(true);
+        m_Zone->HeaterWash(true);
         ReportState(Wash);
         m_washStep = Fill;
     }
@@ -219,7 +293,7 @@ void HeaterController::EndWash()
         m_Drain->SetState(false);
         // After this HWState will call Control() if needed, so we don't have
         // to mess with heater relay here
-        m_HW->HeaterWash(false);
+        m_Zone->HeaterWash(false);
         m_washStep = None;
     }
 }
@@ -243,44 +317,110 @@ static const char *stateStrings[] =
     "Maintenance"
 };
 
-HWState::HWState(HWConfig* cfg, Valve *CS, Valve *HS, Valve *HI, Valve *HO, Thermometer *HST,
-                 time_t recoverDelay)
-    : m_Cfg(cfg), m_CS(CS), m_HS(HS), m_HI(HI), m_HO(HO), m_HST(HST),
-      m_state(Maintenance), m_mode(Manual),
-      // If hot water is OK at startup, we'll switch immediately.
-      m_RecoverTime(~0), m_RecoverDelay(recoverDelay)
+#ifdef _WIN32
+static const char *stateDir = "C:\\aquarius\\";
+#else
+// /var/run is tmpfs on OrangePI
+static const char *stateDir = "/var/";
+#endif
+
+HWState::HWState(HWConfig* cfg, const std::vector<ZoneConfig>& zones)
+    : m_Cfg(cfg),
+      // Every site keeps its own state
+      m_StatePath(std::string(stateDir) + (cfg->GetSiteName().empty() ? "aquarius" :
+                                           "aquarius." + cfg->GetSiteName())),
+      m_mode(Manual)
 {
-    // We know functions, so we know descriptions
-    m_CS->m_description = "Cold supply";
-    m_HS->m_description = "Hot supply";
-    m_HI->m_description = "Heater input";
-    m_HO->m_description = "Heater output";
+    for (const ZoneConfig& z : zones) {
+        Zone* parent = nullptr;
+
+        // Parents must be defined first, this rules out cycles
+        if (!z.id.empty()) {
+            parent = GetZone(z.parent);
+            if (!parent) {
+                LOG(ERR) << "Unknown parent zone \"" << z.parent << "\" of zone " << z.id
+                         << ", assuming the main one";
+                parent = m_Zones[0];
+            }
+        }
 
-    m_LeakSensor = new LeakSensor(cfg);
-    m_Heater     = new HeaterController(this, cfg);
+        m_Zones.push_back(new Zone(this, z, parent, m_Zones.size()));
+    }
+
+    // In trace replay mode and state come from the trace
+    if (HwTrace::IsReplaying()) {
+        LOG(INFO) << "Replaying hardware trace";
+    } else {
+        std::vector<SavedState> saved(m_Zones.size());
+        std::vector<bool> restore(m_Zones.size());
+
+        // Mode is kept by the main zone
+        if (LoadState(m_Zones[0], saved[0])) {
+            ReportMode(saved[0].Mode);
+            restore[0] = true;
+        } else {
+            LOG(ERR) << "Could not read saved status; fall back to default!";
+        }
 
-    if (!LoadState()) {
-        Log(Log::ERR) << "Could not read saved status; fall back to default!";
+        for (size_t i = 1; i < m_Zones.size(); i++)
+            restore[i] = LoadState(m_Zones[i], saved[i]);
+
+        // In auto mode we'll deduce the state to set, and
+        // in Maintenance mode we only do what operator is telling
+        if (m_mode == Manual) {
+            // After we exit relays stay in their original states, but configuring
+            // I/O hardware switches all of them off. Wait 0.5 sec before
+            // turning back on some of them; quickly pulsing them isn't good for
+            // electronics
+            msleep(500);
+
+            for (size_t i = 0; i < m_Zones.size(); i++) {
+                if (restore[i])
+                    m_Zones[i]->RestoreState(saved[i].State);
+            }
+        }
+    }
+
+    if (cfg->m_LeakGuardInterval && !cfg->GetLeakDetectors().empty()) {
+        m_Guard = new LeakGuard(this, cfg);
+        m_Guard->Start();
+    } else {
+        m_Guard = nullptr;
     }
 }
 
 HWState::~HWState()
 {
-    delete m_LeakSensor;
-    delete m_Heater;
+    delete m_Guard;
+
+    for (Zone* zone : m_Zones)
+        delete zone;
 }
 
-#ifdef _WIN32
-static const char *stateFile = "C:\\aquarius\\aquarius.state";
-#else
-// /var/run is tmpfs on OrangePI
-static const char *stateFile = "/var/aquarius.state";
-#endif
+Zone* HWState::GetZone(const std::string& id) const
+{
+    for (Zone* zone : m_Zones) {
+        if (zone->m_Id == id)
+            return zone;
+    }
 
-bool HWState::LoadState()
+    return nullptr;
+}
+
+Zone* HWState::GetOwner(const Hardware* hw) const
 {
-    struct SavedState st;
-    int fd = open(stateFile, O_RDONLY|O_BINARY);
+    for (Zone* zone : m_Zones) {
+        if (zone->Owns(hw))
+            return zone;
+    }
+
+    return m_Zones[0];
+}
+
+bool HWState::LoadState(Zone* zone, SavedState& st)
+{
+    std::string path = m_StatePath + (zone->m_Id.empty() ? "" : '.' + zone->m_Id) + ".state";
+    int fd = open(path.c_str(), O_RDONLY|O_BINARY);
 
     // The file must exist and be readable
     if (fd == -1) {
@@ -308,33 +448,24 @@ bool HWState::LoadState()
         return false;
     }
 
-    ReportMode(st.Mode);
-    if (m_mode == Manual) {
-        // After we exit relays stay in their original states, but configuring
-        // I/O hardware switches all of them off. Wait 0.5 sec before
-        // turning back on some of them; quickly pulsing them isn't good for
-        // electronics
-        msleep(500);
-        // In auto mode we'll deduce the state to set, and 
-        // in Maintenance mode we only do what operator is telling
-        Log(Log::INFO) << "Bringing back manual control state: "
-                       << stateStrings[st.State];
-        ApplyState(st.State);
-    }
-
     return true;
 }
 
-bool HWState::SaveState(state_t state, ctlmode_t mode)
+bool HWState::SaveState(Zone* zone, state_t state, ctlmode_t mode)
 {
     struct SavedState st;
     bool ok;
 
+    // Don't disturb the real system, the trace may be replayed on it
+    if (HwTrace::IsReplaying())
+        return true;
+
     st.State = state;
     st.Mode  = mode;
     st.Check = st.CalcCheck();
 
-    int fd = open(stateFile, O_CREAT|O_TRUNC|O_WRONLY|O_BINARY, 0600);
+    std::string path = m_StatePath + (zone->m_Id.empty() ? "" : '.' + zone->m_Id) + ".state";
+    int fd = open(path.c_str(), O_CREAT|O_TRUNC|O_WRONLY|O_BINARY, 0600);
 
     if (fd == -1) {
         ok = false;
@@ -353,7 +484,7 @@ bool HWState::SaveState(state_t state, ctlmode_t mode)
     }
 
     if (!ok) {
-        Log(Log::ERR) << "Unable to save status file";
+        LOG(ERR) << "Unable to save status file";
     }
 
     return ok;
@@ -361,12 +492,270 @@ bool HWState::SaveState(state_t state, ctlmode_t mode)
 
 void HWState::Poll()
 {
+    TRACE_SPAN("HWState::Poll");
+
+    PollLeaks();
+    PollValves();
+    PollSupply();
+}
+
+void HWState::PollLeaks()
+{
+    TRACE_SPAN("HWState::PollLeaks");
+    m_Cfg->NextPollCycle();
+
+    for (Zone* zone : m_Zones)
+        zone->PollLeaks();
+}
+
+void HWState::PollValves()
+{
+    TRACE_SPAN("HWState::PollValves");
+    m_Cfg->NextPollCycle();
+
+    for (Zone* zone : m_Zones)
+        zone->PollValves();
+}
+
+void HWState::PollSupply()
+{
+    TRACE_SPAN("HWState::PollSupply");
+
+    for (Zone* zone : m_Zones)
+        zone->PollSupply();
+}
+
+HWState::state_t HWState::GetState()
+{
+    return m_Zones[0]->GetState();
+}
+
+LeakSensor::status_t HWState::GetLeakState()
+{
+    return m_Zones[0]->GetLeakState();
+}
+
+int HWState::GetHeaterState()
+{
+    return m_Zones[0]->GetHeaterState();
+}
+
+int HWState::SetState(state_t state, const std::string &user, const std::string& id)
+{
+    Zone* zone = GetZone(id);
+
+    return zone ? zone->SetState(state, user) : ENOENT;
+}
+
+int HWState::SetLeakState(LeakSensor::status_t state, const std::string &user, const std::string& id)
+{
+    Zone* zone = GetZone(id);
+
+    return zone ? zone->SetLeakState(state, user) : ENOENT;
+}
+
+int HWState::SetHeaterState(int state, const std::string &user, const std::string& id)
+{
+    Zone* zone = GetZone(id);
+
+    return zone ? zone->SetHeaterState(state, user) : ENOENT;
+}
+
+void HWState::SetMode(ctlmode_t mode, const std::string &user)
+{
+    LOG(INFO) << user << " Requested control mode: " << modeStrings[mode];
+
     m_Lock.lock();
 
+    SaveState(m_Zones[0], m_Zones[0]->GetState(), mode);
+    ReportMode(mode);
+
+    m_Lock.unlock();
+}
+
+bool HWState::IsFinalState(state_t state)
+{
+    // Returns true for non-transient states
+    return (state == Closed) || (state == Central) ||
+           (state == Heater) || (state == Maintenance);
+}
+
+int HWState::ValveControl(const char* id, int& state, const std::string& user)
+{
+    Valve* hw = m_Cfg->GetHardware<Valve>(id);
+    int reqState = state;
+    int ret;
+
+    if (!hw) {
+        LOG(ERR) << user << " Valve " << id << " not found";
+        return ENOENT;
+    }
+
+    Zone* zone = GetOwner(hw);
+
+    zone->m_Lock.lock();
+
+    if (m_mode != FullManual) {
+        ret = EPERM;
+    } else if (hw->SetState(state, true)) {
+        zone->ReportState(Maintenance);
+        state = hw->GetState();
+        ret = 0;
+    } else {
+        // Invalid input
+        ret = EINVAL;
+    }
+
+    zone->m_Lock.unlock();
+
+    switch (ret) {
+    case 0:
+        LOG(INFO) << user << ' ' << hw->m_description << " manual "
+			           << Valve::statusStrings[reqState];
+        break;
+    case EPERM:
+        LOG(ERR) << user << ' ' << hw->m_description << " manual "
+			          << Valve::statusStrings[reqState] << " denied: not in maintenance mode";
+        break;
+    }
+
+    return ret;
+}
+
+int HWState::RelayControl(const char* id, bool &state, const std::string& user)
+{
+    Relay* hw = m_Cfg->GetHardware<Relay>(id);
+    bool reqState = state;
+    int ret;
+
+    if (!hw) {
+        LOG(ERR) << user << " Relay " << id << " not found";
+        return ENOENT;
+    }
+
+    Zone* zone = GetOwner(hw);
+
+    zone->m_Lock.lock();
+
+    if (m_mode != FullManual) {
+        ret = EPERM;
+    } else {
+        hw->SetState(state);
+        zone->ReportState(Maintenance);
+        state = hw->GetState();
+        ret = 0;
+    }
+
+    zone->m_Lock.unlock();
+
+    switch (ret) {
+    case 0:
+        LOG(INFO) << user << ' ' << hw->m_description << " manual "
+			           << Relay::statusStrings[reqState];
+        break;
+    case EPERM:
+        LOG(ERR) << user << ' ' << hw->m_description << " manual "
+			          << Relay::statusStrings[reqState] << " denied: not in maintenance mode";
+        break;
+    }
+
+    return ret;
+}
+
+Zone::Zone(HWState* hw, const ZoneConfig& cfg, Zone* parent, unsigned int index)
+    : m_Id(cfg.id), m_Index(index), m_Parent(parent), m_HW(hw), m_Bus(hw->m_Cfg->GetBus()),
+      m_Topic(cfg.id.empty() ? "" : "Zone/" + cfg.id + '/'),
+      m_CS(cfg.CS), m_HS(cfg.HS), m_HI(cfg.HI), m_HO(cfg.HO), m_HST(cfg.HST),
+      m_state(HWState::Maintenance),
+      // If hot water is OK at startup, we'll switch immediately.
+      m_RecoverTime(~0), m_RecoverDelay(cfg.recoveryDelay)
+{
+    // We know functions, so we know descriptions
+    std::string zone = m_Id.empty() ? "" : m_Id + ": ";
+
+    m_CS->m_description = zone + "Cold supply";
+    m_HS->m_description = zone + "Hot supply";
+    m_HI->m_description = zone + "Heater input";
+    m_HO->m_description = zone + "Heater output";
+
+    m_LeakSensor = new LeakSensor(m_Bus, m_Topic, cfg.leakSensors);
+    m_Heater     = new HeaterController(this, cfg, m_Bus, m_Topic);
+
+    if (parent)
+        parent->m_Children.push_back(this);
+}
+
+Zone::~Zone()
+{
+    delete m_LeakSensor;
+    delete m_Heater;
+}
+
+bool Zone::Owns(const Hardware* hw) const
+{
+    return hw == m_CS || hw == m_HS || hw == m_HI || hw == m_HO || m_Heater->Owns(hw) ||
+           std::find(m_LeakSensor->GetSensors().begin(), m_LeakSensor->GetSensors().end(), hw) !=
+               m_LeakSensor->GetSensors().end();
+}
+
+void Zone::RestoreState(state_t state)
+{
+    std::lock_guard lock(m_Lock);
+    OutputBatch batch;
+
+    LOG(INFO) << "Bringing back manual control state: " << stateStrings[state];
+    HwTrace::Command(HWTRACE_STATE, state, m_Index);
+    ApplyState(state);
+}
+
+bool Zone::SupplyLeak() const
+{
+    for (Zone* z = m_Parent; z; z = z->m_Parent) {
+        if (z->m_LeakSensor->GetState() == LeakSensor::Alarm)
+            return true;
+    }
+
+    return false;
+}
+
+void Zone::CloseChildren()
+{
+    for (Zone* child : m_Children) {
+        std::lock_guard lock(child->m_Lock);
+
+        LOG(WARN) << "Zone " << child->m_Id << " closed: no supply";
+        child->ApplyState(HWState::Closed);
+        child->CloseChildren();
+    }
+}
+
+std::unique_lock<std::mutex> Zone::Lock()
+{
+    TRACE_SPAN("Zone lock wait", m_Id);
+
+    return std::unique_lock(m_Lock);
+}
+
+void Zone::PollLeaks()
+{
+    auto lock = Lock();
+    OutputBatch batch;
+
     if (m_LeakSensor->Poll()) {
-        ApplyState(Closed);
+        ApplyState(HWState::Closed);
+        CloseChildren();
     }
 
+    batch.Flush();
+}
+
+void Zone::PollValves()
+{
+    m_Heater->PollTemperature();
+
+    auto lock = Lock();
+    OutputBatch batch;
+
     m_CS->Poll();
     m_HS->Poll();
     m_HI->Poll();
@@ -380,21 +769,21 @@ void HWState::Poll()
     if (s_CS == Valve::Fault || s_HS == Valve::Fault ||
         s_HI == Valve::Fault || s_HO == Valve::Fault)
     {
-        ReportState(Fault);
+        ReportState(HWState::Fault);
         m_Heater->Control(false);
     }
     else
     {
         switch (m_state)
         {
-        case Closing:
+        case HWState::Closing:
             if (s_CS == Valve::Closed && s_HS == Valve::Closed &&
                 s_HI == Valve::Closed && s_HO == Valve::Closed) {
-                ReportState(Closed);
+                ReportState(HWState::Closed);
             }
             break;
 
-        case SwitchToCentral:
+        case HWState::SwitchToCentral:
             if (s_HI == Valve::Closed && s_HO == Valve::Closed) {
                 if (m_step == 0) {
                     m_CS->SetState(Valve::Open);
@@ -405,13 +794,13 @@ void HWState::Poll()
                 }
                 if (m_step == 1) {
                     if (s_CS == Valve::Open && s_HS == Valve::Open) {
-                        ReportState(Central);
+                        ReportState(HWState::Central);
                     }
                 }
             }
             break;
 
-        case SwitchToHeater:
+        case HWState::SwitchToHeater:
             if (s_HS == Valve::Closed) {
                 if (m_step == 0) {
                     m_HI->SetState(Valve::Open);
@@ -426,7 +815,7 @@ void HWState::Poll()
                     if (s_HI == Valve::Open && s_HO == Valve::Open &&
                         s_CS == Valve::Open) {
                         m_Heater->Control(true);
-                        ReportState(Heater);
+                        ReportState(HWState::Heater);
                     }
                 }
             }
@@ -455,7 +844,17 @@ void HWState::Poll()
         m_Heater->Poll(heaterInState);
     }
 
-    m_HST->GetValue(); // This updates the thermometer state
+    batch.Flush();
+}
+
+void Zone::PollSupply()
+{
+    // This updates the thermometer state. With sample_interval="0" it's
+    // a slow 1-wire read, which must not delay EmergencyClose().
+    m_HST->GetValue();
+
+    auto lock = Lock();
+    OutputBatch batch;
     int hstState = m_HST->GetState();
 
     switch (hstState)
@@ -469,10 +868,11 @@ void HWState::Poll()
     case Thermometer::Cold:
         m_RecoverTime = 0;
         if (AutoModeOK() &&
-            ((m_state == Central) || (m_state == Closed) || (m_state == Maintenance)))
+            ((m_state == HWState::Central) || (m_state == HWState::Closed) ||
+             (m_state == HWState::Maintenance)))
         {
-            Log(Log::WARN) << "Hot water temperature dropped, switching to heater";
-            ApplyState(Heater);
+            LOG(WARN) << "Hot water temperature dropped, switching to heater";
+            ApplyState(HWState::Heater);
         }
         break;
 
@@ -480,23 +880,27 @@ void HWState::Poll()
         if (m_RecoverTime == 0) {
             m_RecoverTime = GetMonotonicTime() + m_RecoverDelay;
         } else if ((GetMonotonicTime() >= m_RecoverTime) && AutoModeOK() &&
-                   ((m_state == Heater) || (m_state == Closed) || (m_state == Maintenance)))
+                   ((m_state == HWState::Heater) || (m_state == HWState::Closed) ||
+                    (m_state == HWState::Maintenance)))
         {
-            Log(Log::INFO) << "Hot water temperature restored, switching to central supply";
-            ApplyState(Central);
+            LOG(INFO) << "Hot water temperature restored, switching to central supply";
+            ApplyState(HWState::Central);
         }
      
         break;
     }
 
-    m_Lock.unlock();
+    batch.Flush();
 }
 
-void HWState::ApplyState(state_t state)
+void Zone::ApplyState(state_t state)
 {
+    // Move all the valves simultaneously
+    OutputBatch batch;
+
     switch (state)
     {
-    case Closed:
+    case HWState::Closed:
         m_Heater->Control(false);
 
         // This can be emergency, force-close
@@ -504,20 +908,20 @@ void HWState::ApplyState(state_t state)
         m_HS->SetState(Valve::Closed, true);
         m_HI->SetState(Valve::Closed, true);
         m_HO->SetState(Valve::Closed, true);
-        ReportState(Closing);
+        ReportState(HWState::Closing);
         break;
 
-    case Central:
+    case HWState::Central:
         m_Heater->Control(false);
 
         m_HI->SetState(Valve::Closed);
         m_HO->SetState(Valve::Closed);
-        ReportState(SwitchToCentral);
+        ReportState(HWState::SwitchToCentral);
         break;
 
-    case Heater:
+    case HWState::Heater:
         m_HS->SetState(Valve::Closed);
-        ReportState(SwitchToHeater);
+        ReportState(HWState::SwitchToHeater);
         break;
 
     default:
@@ -528,8 +932,10 @@ void HWState::ApplyState(state_t state)
     m_step = 0;
 }
 
-void HWState::HeaterWash(bool on)
+void Zone::HeaterWash(bool on)
 {
+    OutputBatch batch;
+
     if (on) {
         m_CS->SetState(Valve::Open);
         m_HI->SetState(Valve::Open);
@@ -538,14 +944,25 @@ void HWState::HeaterWash(bool on)
     }
 }
 
-bool HWState::IsFinalState(state_t state)
+bool Zone::EmergencyClose()
 {
-    // Returns true for non-transient states
-    return (state == Closed) || (state == Central) ||
-           (state == Heater) || (state == Maintenance);
+    bool ret = false;
+
+    // Nobody holds the lock for long: thermometers are read outside of it
+    // and I/O is batched
+    std::lock_guard lock(m_Lock);
+
+    if (m_LeakSensor->GetState() == LeakSensor::Enabled) {
+        m_LeakSensor->SetState(LeakSensor::Alarm);
+        ApplyState(HWState::Closed);
+        CloseChildren();
+        ret = true;
+    }
+
+    return ret;
 }
 
-int HWState::SetState(state_t state, const std::string &user)
+int Zone::SetState(state_t state, const std::string &user)
 {
     int ret;
 	const char *action;
@@ -553,13 +970,13 @@ int HWState::SetState(state_t state, const std::string &user)
 
 	switch (state)
 	{
-	case Closed:
+	case HWState::Closed:
 		action = "Manual close all";
 		break;
-	case Central:
+	case HWState::Central:
 		action = "Manual switch to central";
 		break;
-	case Heater:
+	case HWState::Heater:
 		action = "Manual switch to heater";
 		break;
 	default:
@@ -572,8 +989,12 @@ int HWState::SetState(state_t state, const std::string &user)
     if (m_LeakSensor->GetState() == LeakSensor::Alarm) {
         ret = EPERM;
         reason = "leak detected";
-    } else if (m_mode != Auto) {
-        SaveState(state, m_mode);
+    } else if (SupplyLeak()) {
+        ret = EPERM;
+        reason = "leak detected in the supplying zone";
+    } else if (m_HW->GetMode() != HWState::Auto) {
+        HwTrace::Command(HWTRACE_STATE, state, m_Index);
+        m_HW->SaveState(this, state, m_HW->GetMode());
         ret = 0;
         ApplyState(state);
     } else {
@@ -586,30 +1007,18 @@ int HWState::SetState(state_t state, const std::string &user)
 	switch (ret)
 	{
 	case 0:
-		Log(Log::INFO) << user << ' ' << action;
+		LOG(INFO) << user << ' ' << action;
 		break;
 
 	case EPERM:
-        Log(Log::ERR) << user << " Manual system control denied: " << reason;
+        LOG(ERR) << user << " Manual system control denied: " << reason;
 		break;
     }
 
     return ret;
 }
 
-void HWState::SetMode(ctlmode_t mode, const std::string &user)
-{
-    Log(Log::INFO) << user << " Requested control mode: " << modeStrings[mode];
-
-    m_Lock.lock();
-
-    SaveState(m_state, mode);
-    ReportMode(mode);
-
-    m_Lock.unlock();
-}
-
-int HWState::SetLeakState(LeakSensor::status_t state, const std::string &user)
+int Zone::SetLeakState(LeakSensor::status_t state, const std::string &user)
 {
     if (state != LeakSensor::Enabled && state != LeakSensor::Disabled)
         return EINVAL;
@@ -618,13 +1027,13 @@ int HWState::SetLeakState(LeakSensor::status_t state, const std::string &user)
     m_LeakSensor->SetState(state);
     m_Lock.unlock();
 
-    Log(Log::INFO) << user << " Leak sensor "
+    LOG(INFO) << user << " Leak sensor "
 		           << (state == LeakSensor::Enabled ? "enabled" : "disabled");
 
     return 0;
 }
 
-int HWState::SetHeaterState(int state, const std::string &user)
+int Zone::SetHeaterState(int state, const std::string &user)
 {
     int ret;
 
@@ -645,91 +1054,13 @@ int HWState::SetHeaterState(int state, const std::string &user)
 	switch (ret)
 	{
 	case 0:
-		Log(Log::INFO) << user << " Manual heater wash request";
+		LOG(INFO) << user << " Manual heater wash request";
 		break;
 
 	case EPERM:
-        Log(Log::ERR) << user << " Manual heater control denied: leak detected";
+        LOG(ERR) << user << " Manual heater control denied: leak detected";
 		break;
     }
 
 	return ret;
 }
-
-int HWState::ValveControl(const char* id, int& state, const std::string& user)
-{
-    Valve* hw = m_Cfg->GetHardware<Valve>(id);
-    int reqState = state;
-    int ret;
-
-    if (!hw) {
-        Log(Log::ERR) << user << " Valve " << id << " not found";
-        return ENOENT;
-    }
-
-    m_Lock.lock();
-
-    if (m_mode != FullManual) {
-        ret = EPERM;
-    } else if (hw->SetState(state, true)) {
-        ReportState(Maintenance);
-        state = hw->GetState();
-        ret = 0;
-    } else {
-        // Invalid input
-        ret = EINVAL;
-    }
-
-    m_Lock.unlock();
-
-    switch (ret) {
-    case 0:
-        Log(Log::INFO) << user << ' ' << hw->m_description << " manual "
-			           << Valve::statusStrings[reqState];
-        break;
-    case EPERM:
-        Log(Log::ERR) << user << ' ' << hw->m_description << " manual "
-			          << Valve::statusStrings[reqState] << " denied: not in maintenance mode";
-        break;
-    }
-
-    return ret;
-}
-
-int HWState::RelayControl(const char* id, bool &state, const std::string& user)
-{
-    Relay* hw = m_Cfg->GetHardware<Relay>(id);
-    bool reqState = state;
-    int ret;
-
-    if (!hw) {
-        Log(Log::ERR) << user << " Relay " << id << " not found";
-        return ENOENT;
-    }
-
-    m_Lock.lock();
-
-    if (m_mode != FullManual) {
-        ret = EPERM;
-    } else {
-        hw->SetState(state);
-        ReportState(Maintenance);
-        state = hw->GetState();
-        ret = 0;
-    }
-
-    m_Lock.unlock();
-
-    switch (ret) {
-    case 0:
-        Log(Log::INFO) << user << ' ' << hw->m_description << " manual "
-			           << Relay::statusStrings[reqState];
-        break;
-    case EPERM:
-        Log(Log::ERR) << user << ' ' << hw->m_description << " manual "
-			          << Relay::statusStrings[reqState] << " denied: not in maintenance mode";
-        break;
-    }
-
-    return ret;
-}
@@ -1,3 +1,7 @@
+#ifndef HWSTATE_H
+#define HWSTATE_H
+
+#include <atomic>
 #include <mutex>
 #include <string>
 #include <vector>
@@ -5,6 +9,7 @@
 #include "hwconfig.h"
 #include "event_bus.h"
 #include "userdb.h"
+#include "worker.h"
 
 class LeakSensor
 {
@@ -17,7 +22,7 @@ public:
         Alarm
     } status_t;
 
-    LeakSensor(HWConfig* cfg);
+    LeakSensor(EventBus* bus, const std::string& topicPrefix, const std::vector<Switch*>& sensors);
     ~LeakSensor()
     {
         delete[] m_SensorState;
@@ -31,19 +36,49 @@ public:
 
     bool Poll();
 
+    const std::vector<Switch*>& GetSensors() const
+    {
+        return m_Sensors;
+    }
+
 private:
     void ReportState(status_t state)
     {
         m_state = state;
-        SendEvent("LeakDetector/state", state);
+        m_Bus->SendEvent(m_Topic, state);
     }
 
+    EventBus*            m_Bus;
+    std::string          m_Topic;
     std::vector<Switch*> m_Sensors;
     int*                 m_SensorState;
     status_t             m_state;
 };
 
 class HWState;
+class Zone;
+
+// Fast path from a leak to closed valves. Samples leak sensors in its own
+// thread, at a much higher rate than the control loop, and force-closes the
+// valves as soon as a leak is seen. The control loop then picks up the
+// alarm as usual.
+class LeakGuard : public Worker
+{
+public:
+    LeakGuard(HWState* hw, HWConfig* cfg);
+
+protected:
+    void Run() override;
+
+private:
+    EventBus*                 m_Bus;
+    std::vector<Switch*>      m_Sensors;
+    std::vector<Zone*>        m_Zones;    // Zone of every sensor
+    std::vector<unsigned int> m_OnCount;  // Consecutive samples, reading a leak
+    unsigned int              m_Confirm;  // This many are needed to act
+    int                       m_Priority; // SCHED_FIFO priority, 0 = don't change
+    bool                      m_Started;
+};
 
 class HeaterController
 {
@@ -57,14 +92,22 @@ public:
         Pressurize,
     };
 
-    HeaterController(HWState* hw, HWConfig* cfg);
+    HeaterController(Zone* zone, const ZoneConfig& cfg, EventBus* bus, const std::string& topicPrefix);
 
     void SetState(int state);
     int GetState();
 
     void Poll(int s_HI);
+    // Synchronous thermometers may take long, so this one is called
+    // without the zone lock
+    void PollTemperature();
     void Control(bool on);
 
+    bool Owns(const Hardware* hw) const
+    {
+        return hw == m_Heater || hw == m_Drain;
+    }
+
 private:
     typedef enum
     {
@@ -83,10 +126,12 @@ private:
     void ReportState(int state)
     {
         m_State = state;
-        SendEvent("Heater/state", state);
+        m_Bus->SendEvent(m_Topic, state);
     }
 
-    HWState* m_HW;
+    Zone*       m_Zone;
+    EventBus*   m_Bus;
+    std::string m_Topic;
 
     Relay *      m_Heater;
     Relay *      m_Drain;
@@ -121,38 +166,49 @@ public:
         FullManual // Maintenance
     } ctlmode_t;
 
-    HWState(HWConfig* cfg, Valve *CS, Valve *HS, Valve *HI, Valve *HO, Thermometer *HST,
-            time_t recoverDelay);
+    HWState(HWConfig* cfg, const std::vector<ZoneConfig>& zones);
     ~HWState();
 
+    // Full control cycle
     void Poll();
-
-    state_t GetState()
+    // Parts of it, which the main loop schedules with their own periods.
+    // Zones are polled one after another, every one under its own lock.
+    void PollLeaks();
+    void PollValves();
+    void PollSupply();
+
+    // The main zone goes first
+    const std::vector<Zone*>& GetZones() const
     {
-        return m_state;
+        return m_Zones;
     }
 
-    int       SetState(state_t state, const std::string &user);
+    // Empty id means the main zone; nullptr if there's no such zone
+    Zone* GetZone(const std::string& id) const;
+
+    // Getters and setters without zone id refer to the main zone
+    state_t GetState();
+    int     SetState(state_t state, const std::string &user, const std::string& zone = "");
+
+    // Mode is common for all the zones
     ctlmode_t GetMode() {return m_mode; }
     void      SetMode(ctlmode_t mode, const std::string &user);
 
-    LeakSensor::status_t GetLeakState() {return m_LeakSensor->GetState();}
-    int                  SetLeakState(LeakSensor::status_t, const std::string &user);
-    int                  GetHeaterState() {return m_Heater->GetState();}
-    int                  SetHeaterState(int state, const std::string &user);
+    LeakSensor::status_t GetLeakState();
+    int                  SetLeakState(LeakSensor::status_t, const std::string &user,
+                                      const std::string& zone = "");
+    int                  GetHeaterState();
+    int                  SetHeaterState(int state, const std::string &user,
+                                        const std::string& zone = "");
 
-    void HeaterWash(bool on);
     static bool IsFinalState(state_t);
 
-    bool InFinalState()
-    {
-        return IsFinalState(m_state);
-    }
-
     int ValveControl(const char* id, int& state, const std::string& user);
     int RelayControl(const char* id, bool& state, const std::string& user);
 
 private:
+    friend class Zone;
+
     struct SavedState
     {
         int CalcCheck()
@@ -165,29 +221,117 @@ private:
         int       Check;
     };
 
-    bool LoadState();
-    bool SaveState(state_t state, ctlmode_t mode);
-    void ApplyState(state_t state);
+    // Zone, the device belongs to; the main one for shared devices
+    Zone* GetOwner(const Hardware* hw) const;
 
-    void ReportState(state_t state)
-    {
-        m_state = state;
-        SendEvent("ValveController/state", state);
-    }
+    bool LoadState(Zone* zone, SavedState& st);
+    bool SaveState(Zone* zone, state_t state, ctlmode_t mode);
 
     void ReportMode(ctlmode_t mode)
     {
+        HwTrace::Command(HWTRACE_MODE, mode);
         m_mode = mode;
-        SendEvent("ValveController/mode", mode);
+        m_Cfg->GetBus()->SendEvent("ValveController/mode", mode);
+    }
+
+    HWConfig*   m_Cfg;
+    std::string m_StatePath; // Without ".state" suffix
+
+    std::vector<Zone*> m_Zones;
+    LeakGuard*         m_Guard;
+
+    std::atomic<ctlmode_t> m_mode;
+    std::mutex             m_Lock; // Serializes mode changes
+};
+
+/*
+ * A zone is a part of the water supply graph with its own set of valves,
+ * hot supply thermometer, heater and leak sensors, e.g. a riser. Every zone
+ * runs its own transition state machine under its own lock, so a slow
+ * transition or a fault in one zone doesn't affect others. Zones form a
+ * tree: a leak in a zone closes all the zones, it supplies, because they
+ * can't get water anyway and their heaters must not run dry.
+ */
+class Zone
+{
+public:
+    typedef HWState::state_t state_t;
+
+    Zone(HWState* hw, const ZoneConfig& cfg, Zone* parent, unsigned int index);
+    ~Zone();
+
+    const std::string  m_Id;    // Empty for the main zone
+    const unsigned int m_Index; // Position in HWState::GetZones()
+    Zone* const        m_Parent;
+
+    void PollLeaks();
+    void PollValves();
+    void PollSupply();
+
+    state_t GetState()
+    {
+        return m_state;
+    }
+
+    LeakSensor::status_t GetLeakState()
+    {
+        return m_LeakSensor->GetState();
+    }
+
+    int GetHeaterState()
+    {
+        return m_Heater->GetState();
+    }
+
+    int SetState(state_t state, const std::string &user);
+    int SetLeakState(LeakSensor::status_t state, const std::string &user);
+    int SetHeaterState(int state, const std::string &user);
+
+    // Restore state, saved before restart; called on startup in manual mode
+    void RestoreState(state_t state);
+
+    // Is the device a part of this zone ?
+    bool Owns(const Hardware* hw) const;
+
+    void HeaterWash(bool on);
+
+    bool InFinalState()
+    {
+        return HWState::IsFinalState(m_state);
+    }
+
+    // Raise leak alarm and close everything right now, whatever transition
+    // is in progress. Returns false if leak detection is disabled or the
+    // alarm is already raised.
+    bool EmergencyClose();
+
+private:
+    friend class HWState;
+
+    // Waits for the lock, the wait shows up in timing traces
+    std::unique_lock<std::mutex> Lock();
+    void ApplyState(state_t state);
+    // Close all the zones, supplied by this one. Called with our lock held.
+    void CloseChildren();
+    // Leak alarm in a zone, which supplies us
+    bool SupplyLeak() const;
+
+    void ReportState(state_t state)
+    {
+        m_state = state;
+        m_Bus->SendEvent(m_Topic + "ValveController/state", state);
     }
 
     // Check whether automatic operation is permitted
     bool AutoModeOK()
     {
-        return ((m_mode == Auto) && (m_LeakSensor->GetState() != LeakSensor::Alarm));
+        return ((m_HW->GetMode() == HWState::Auto) &&
+                (m_LeakSensor->GetState() != LeakSensor::Alarm) && !SupplyLeak());
     }
 
-    HWConfig* m_Cfg;
+    HWState*    m_HW;
+    EventBus*   m_Bus;
+    std::string m_Topic; // Event topic prefix, "Zone/<id>/"
 
     Valve* m_CS;
     Valve* m_HS;
@@ -197,12 +341,14 @@ private:
 
     LeakSensor      * m_LeakSensor;
     HeaterController* m_Heater;
+    std::vector<Zone*> m_Children;
 
     state_t           m_state;
     unsigned int      m_step;      // State transition step
-    ctlmode_t         m_mode;
     time_t            m_RecoverTime;  // Time of cental supply recovery
     time_t            m_RecoverDelay; // Delay before accepting the recovery
 
     std::mutex        m_Lock;
 };
+
+#endif
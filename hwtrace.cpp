@@ -0,0 +1,410 @@
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "hardware.h"
+#include "hwconfig.h"
+#include "hwtrace.h"
+#include "logging.h"
+#include "utils.h"
+
+// Replayed outputs may lag or lead recorded ones by this many ms
+static const uint64_t ReplayTolerance = 2000;
+// Sanity limits for sizes, read from a possibly damaged trace
+static const uint32_t MaxConfigSize = 16 * 1024 * 1024;
+static const int32_t  MaxPathSize = 4096;
+
+typedef std::vector<std::pair<uint64_t, int32_t>> SampleList;
+
+struct TraceDevice
+{
+    std::string path;
+    uint8_t     type;
+
+    // Recording: only changes are written
+    bool        haveLast;
+    int32_t     last;
+
+    // Replay: recorded samples, position in them and outputs, produced by us
+    SampleList  samples;
+    size_t      cursor;
+    SampleList  replayed;
+};
+
+std::atomic<int> HwTrace::g_Mode(HwTrace::Off);
+
+static std::mutex               g_Lock;
+static FILE*                    g_File;
+static std::vector<TraceDevice> g_Devices;
+static std::map<std::string, uint16_t> g_Paths;
+static std::string              g_Config;
+static uint64_t                 g_Start;
+static uint64_t                 g_RealStart;
+static uint64_t                 g_End;
+static bool                     g_Finished;
+static std::vector<HwTraceRecord> g_Commands;
+static size_t                   g_NextCommand;
+
+static void writeRecord(uint16_t device, uint8_t kind, uint8_t type, int32_t value)
+{
+    HwTraceRecord r;
+
+    r.time    = GetMonotonicTimeMs() - g_Start;
+    r.device  = device;
+    r.kind    = kind;
+    r.type    = type;
+    r.value.i = value;
+
+    fwrite(&r, sizeof(r), 1, g_File);
+}
+
+bool HwTrace::Record(const char* path)
+{
+    g_File = fopen(path, "wb");
+
+    if (!g_File) {
+        LOG(ERR) << "Failed to create trace " << path << ": " << strerror(errno);
+        return false;
+    }
+
+    g_Start = GetMonotonicTimeMs();
+    g_Mode = Recording;
+    return true;
+}
+
+void HwTrace::SaveConfig(xmlDoc* doc)
+{
+    xmlChar* text;
+    int size;
+    HwTraceHeader hdr;
+
+    xmlDocDumpMemory(doc, &text, &size);
+
+    hdr.magic      = HWTRACE_MAGIC;
+    hdr.version    = HWTRACE_VERSION;
+    hdr.configSize = size;
+
+    std::lock_guard lock(g_Lock);
+
+    fwrite(&hdr, sizeof(hdr), 1, g_File);
+    fwrite(text, size, 1, g_File);
+    xmlFree(text);
+}
+
+void HwTrace::AddDevice(Hardware* dev, xmlNode* node)
+{
+    uint8_t type;
+
+    if (dynamic_cast<Switch*>(dev))
+        type = HWTRACE_SWITCH;
+    else if (dynamic_cast<Thermometer*>(dev))
+        type = HWTRACE_THERMOMETER;
+    else if (dynamic_cast<Relay*>(dev))
+        type = HWTRACE_RELAY;
+    else
+        return; // Buses etc, their I/O is seen via devices on them
+
+    xmlChar* path = xmlGetNodePath(node);
+    size_t len = strlen((const char*)path);
+    std::lock_guard lock(g_Lock);
+
+    dev->m_TraceId = g_Devices.size();
+    g_Devices.push_back({(const char*)path, type, false, 0, {}, 0, {}});
+
+    writeRecord(dev->m_TraceId, HWTRACE_DEVICE, type, len);
+    fwrite(path, len, 1, g_File);
+    xmlFree(path);
+}
+
+void HwTrace::Put(const Hardware* dev, uint8_t kind, int32_t value)
+{
+    if (dev->m_TraceId < 0)
+        return;
+
+    std::lock_guard lock(g_Lock);
+    TraceDevice& d = g_Devices[dev->m_TraceId];
+
+    if (g_Mode == Replaying) {
+        if (d.replayed.empty() || d.replayed.back().second != value)
+            d.replayed.push_back({GetMonotonicTimeMs() - g_Start, value});
+        return;
+    }
+
+    // Samplers may still be running after Close(), IsRecording() was
+    // checked without the lock
+    if (!g_File || (d.haveLast && d.last == value))
+        return;
+
+    d.haveLast = true;
+    d.last     = value;
+
+    writeRecord(dev->m_TraceId, kind, 0, value);
+}
+
+void HwTrace::PutCommand(uint8_t kind, int32_t value, uint8_t zone)
+{
+    std::lock_guard lock(g_Lock);
+
+    if (g_File)
+        writeRecord(HWTRACE_CONTROL, kind, zone, value);
+}
+
+void HwTrace::Flush()
+{
+    std::lock_guard lock(g_Lock);
+
+    if (g_File)
+        fflush(g_File);
+}
+
+bool HwTrace::Replay(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    HwTraceHeader hdr;
+
+    if (!f) {
+        LOG(ERR) << "Failed to open trace " << path << ": " << strerror(errno);
+        return false;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != HWTRACE_MAGIC || hdr.version != HWTRACE_VERSION) {
+        LOG(ERR) << path << " is not a hardware trace or has unsupported version";
+        fclose(f);
+        return false;
+    }
+
+    HwTraceRecord r;
+
+    if (hdr.configSize == 0 || hdr.configSize > MaxConfigSize) {
+        LOG(ERR) << path << " is damaged: bad configuration size " << hdr.configSize;
+        fclose(f);
+        return false;
+    }
+
+    g_Config.resize(hdr.configSize);
+    if (fread(&g_Config[0], hdr.configSize, 1, f) != 1) {
+        LOG(ERR) << "Truncated trace " << path;
+        fclose(f);
+        return false;
+    }
+
+    // A trace, cut short by a crash, is still good up to the last full record
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        if (r.kind == HWTRACE_DEVICE) {
+            if (r.value.i <= 0 || r.value.i > MaxPathSize || r.device != g_Devices.size()) {
+                LOG(WARN) << path << " is damaged, replaying it up to " << r.time / 1000.0 << " s";
+                break;
+            }
+
+            std::string devPath(r.value.i, 0);
+
+            if (fread(&devPath[0], r.value.i, 1, f) != 1)
+                break;
+
+            g_Paths[devPath] = r.device;
+            g_Devices.push_back({devPath, r.type, false, 0, {}, 0, {}});
+        } else if (r.device == HWTRACE_CONTROL) {
+            g_Commands.push_back(r);
+            g_End = r.time;
+        } else if (r.device < g_Devices.size()) {
+            g_Devices[r.device].samples.push_back({r.time, r.value.i});
+            g_End = r.time;
+        }
+    }
+
+    fclose(f);
+
+    // Run as fast as we can
+    StartVirtualClock();
+    g_Start     = GetMonotonicTimeMs();
+    g_RealStart = RealMonotonicTimeMs();
+    g_Mode      = Replaying;
+
+    return true;
+}
+
+const std::string& HwTrace::GetConfig()
+{
+    return g_Config;
+}
+
+bool HwTrace::NextCommand(uint8_t& kind, int& value, uint8_t& zone)
+{
+    std::lock_guard lock(g_Lock);
+
+    if (g_NextCommand == g_Commands.size() ||
+        g_Commands[g_NextCommand].time > GetMonotonicTimeMs() - g_Start)
+        return false;
+
+    kind  = g_Commands[g_NextCommand].kind;
+    value = g_Commands[g_NextCommand].value.i;
+    zone  = g_Commands[g_NextCommand].type;
+    g_NextCommand++;
+
+    return true;
+}
+
+// Returns the latest recorded sample, or defVal if there's none yet
+static int32_t replaySample(int id, int32_t defVal)
+{
+    std::lock_guard lock(g_Lock);
+    TraceDevice& d = g_Devices[id];
+    uint64_t now = GetMonotonicTimeMs() - g_Start;
+
+    if (!g_Finished && now > g_End + ReplayTolerance) {
+        // Normal shutdown, results are reported by Close()
+        g_Finished = true;
+        raise(SIGTERM);
+    }
+
+    while (d.cursor + 1 < d.samples.size() && d.samples[d.cursor + 1].first <= now)
+        d.cursor++;
+
+    if (d.samples.empty() || d.samples[d.cursor].first > now)
+        return defVal;
+
+    return d.samples[d.cursor].second;
+}
+
+class ReplaySwitch : public Switch
+{
+public:
+    ReplaySwitch() : Switch(false)
+    {}
+
+    virtual int GetState() override
+    {
+        return replaySample(m_TraceId, Fault);
+    }
+};
+
+class ReplayThermometer : public Thermometer
+{
+public:
+    ReplayThermometer(float thresh) : Thermometer(thresh)
+    {}
+
+    void Start() override
+    {
+        // Background sampling would run in real time, while the trace runs
+        // on the virtual clock
+        SetSampling(0, 0);
+        Thermometer::Start();
+    }
+
+protected:
+    virtual float Measure() override
+    {
+        int32_t v = replaySample(m_TraceId, 0x7FC00000); // NaN
+        float f;
+
+        memcpy(&f, &v, sizeof(f));
+        return f;
+    }
+};
+
+class ReplayRelay : public Relay
+{
+public:
+    ReplayRelay() : Relay(false)
+    {}
+
+protected:
+    // Commands are collected by HwTrace::Output()
+    virtual void ApplyState(bool) override
+    {}
+};
+
+Hardware* HwTrace::CreateReplayDevice(xmlNode* node)
+{
+    xmlChar* path = xmlGetNodePath(node);
+    auto it = g_Paths.find((const char*)path);
+    Hardware* dev = nullptr;
+
+    xmlFree(path);
+
+    if (it == g_Paths.end())
+        return nullptr;
+
+    switch (g_Devices[it->second].type)
+    {
+    case HWTRACE_SWITCH:
+        dev = new ReplaySwitch();
+        break;
+    case HWTRACE_THERMOMETER:
+        dev = new ReplayThermometer(GetFloatProp(node, "threshold"));
+        break;
+    case HWTRACE_RELAY:
+        dev = new ReplayRelay();
+        break;
+    default:
+        return nullptr;
+    }
+
+    dev->m_TraceId = it->second;
+    return dev;
+}
+
+static const char* describe(const std::pair<uint64_t, int32_t>& s, char* buf, size_t size)
+{
+    snprintf(buf, size, "%s at %.3f s", s.second ? "on" : "off", s.first / 1000.0);
+    return buf;
+}
+
+bool HwTrace::Close()
+{
+    std::lock_guard lock(g_Lock);
+
+    if (g_Mode == Recording) {
+        fclose(g_File);
+        g_File = nullptr;
+        g_Mode = Off;
+        return true;
+    }
+
+    if (g_Mode != Replaying)
+        return true;
+
+    unsigned int matched = 0;
+    unsigned int differ = 0;
+
+    for (const TraceDevice& d : g_Devices) {
+        if (d.type != HWTRACE_RELAY)
+            continue;
+
+        const SampleList& rec = d.samples;
+        const SampleList& rep = d.replayed;
+        char b1[64], b2[64];
+
+        for (size_t i = 0; i < std::max(rec.size(), rep.size()); i++) {
+            if (i >= rec.size()) {
+                LOG(WARN) << d.path << ": extra " << describe(rep[i], b1, sizeof(b1));
+            } else if (i >= rep.size()) {
+                LOG(WARN) << d.path << ": missing " << describe(rec[i], b1, sizeof(b1));
+            } else if (rec[i].second != rep[i].second ||
+                       std::max(rec[i].first, rep[i].first) - std::min(rec[i].first, rep[i].first) > ReplayTolerance) {
+                LOG(WARN) << d.path << ": recorded " << describe(rec[i], b1, sizeof(b1))
+                          << ", replayed " << describe(rep[i], b2, sizeof(b2));
+            } else {
+                matched++;
+                continue;
+            }
+            differ++;
+        }
+    }
+
+    LOG(INFO) << "Replayed " << g_End / 1000.0 << " s of trace in "
+              << (RealMonotonicTimeMs() - g_RealStart) / 1000.0 << " s: "
+              << matched << " outputs match, " << differ << " differ";
+
+    g_Mode = Off;
+    return !differ;
+}
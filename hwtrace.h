@@ -0,0 +1,142 @@
+/*
+ * Hardware trace: raw input samples and output commands of all devices with
+ * timestamps, written into a compact binary file. Only changes are recorded.
+ * The configuration is stored in the trace too, so a trace, recorded in the
+ * field, can be replayed on any machine: inputs are fed from the trace to
+ * the unmodified control logic, running on the virtual clock, and outputs it
+ * produces are compared with recorded ones.
+ *
+ * File layout: header, configuration text, then records. A device is
+ * defined by a record, followed by its configuration node path, before its
+ * first sample.
+ */
+#ifndef HWTRACE_H
+#define HWTRACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+
+#include <libxml/tree.h>
+
+#define HWTRACE_MAGIC   0x43525448 // "HTRC"
+#define HWTRACE_VERSION 2
+
+class Hardware;
+
+enum HwTraceKind
+{
+    HWTRACE_DEVICE,      // value: node path length; the path follows
+    HWTRACE_SWITCH,      // value: raw switch state
+    HWTRACE_THERMOMETER, // value: raw temperature, float
+    HWTRACE_RELAY,       // value: commanded state
+    HWTRACE_MODE,        // value: control mode, set by operator
+    HWTRACE_STATE        // value: system state, set by operator
+};
+
+// Device number of operator commands
+#define HWTRACE_CONTROL 0xFFFF
+
+struct HwTraceHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t configSize;
+};
+
+struct HwTraceRecord
+{
+    uint64_t time; // ms since the start of recording
+    uint16_t device;
+    uint8_t  kind;
+    uint8_t  type;   // HWTRACE_DEVICE: kind of the device's samples;
+                     // HWTRACE_CONTROL: zone index
+    union
+    {
+        int32_t i;
+        float   f;
+    } value;
+};
+
+static_assert(sizeof(HwTraceRecord) == 16, "Trace record size is part of the file format");
+
+class HwTrace
+{
+public:
+    // Both must be called before the configuration is loaded
+    static bool Record(const char* path);
+    static bool Replay(const char* path);
+
+    static bool IsRecording()
+    {
+        return g_Mode == Recording;
+    }
+
+    static bool IsReplaying()
+    {
+        return g_Mode == Replaying;
+    }
+
+    // Recording: store the configuration and devices, created from it
+    static void SaveConfig(xmlDoc* doc);
+    static void AddDevice(Hardware* dev, xmlNode* node);
+
+    // Replay: the recorded configuration and stand-ins for its devices.
+    // Returns nullptr for nodes, which have no recorded I/O.
+    static const std::string& GetConfig();
+    static Hardware* CreateReplayDevice(xmlNode* node);
+
+    static void Input(const Hardware* dev, int value)
+    {
+        if (IsRecording())
+            Put(dev, HWTRACE_SWITCH, value);
+    }
+
+    static void Input(const Hardware* dev, float value)
+    {
+        if (IsRecording()) {
+            int32_t v;
+
+            memcpy(&v, &value, sizeof(v));
+            Put(dev, HWTRACE_THERMOMETER, v);
+        }
+    }
+
+    static void Output(const Hardware* dev, bool value)
+    {
+        if (g_Mode != Off)
+            Put(dev, HWTRACE_RELAY, value);
+    }
+
+    // Operator commands are inputs too
+    static void Command(uint8_t kind, int value, uint8_t zone = 0)
+    {
+        if (IsRecording())
+            PutCommand(kind, value, zone);
+    }
+
+    // Replay: fetch the next due command; false if there's none
+    static bool NextCommand(uint8_t& kind, int& value, uint8_t& zone);
+
+    static void Flush();
+    // Finishes recording, or reports replay results. Returns false if the
+    // replay has produced different outputs.
+    static bool Close();
+
+private:
+    enum Mode
+    {
+        Off,
+        Recording,
+        Replaying
+    };
+
+    static void Put(const Hardware* dev, uint8_t kind, int32_t value);
+    static void PutCommand(uint8_t kind, int32_t value, uint8_t zone);
+
+    static std::atomic<int> g_Mode;
+};
+
+#endif
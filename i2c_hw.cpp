@@ -1,96 +1,621 @@
+#include <stdio.h>
+
+#include <algorithm>
+
+#ifdef __linux__
+#include "gpio_hw.h"
+#endif
 #include "hwconfig.h"
 #include "i2c_hw.h"
 #include "logging.h"
 #include "utils.h"
 
+static const char* const classNames[I2C_NCLASSES] = {"leak", "valve", "relay", "diag"};
+
+// Retry delay doubles with every attempt, up to this many ms
+static const unsigned int MaxRetryDelay = 16;
+
+static std::mutex             g_QueuesLock;
+static std::vector<I2CQueue*> g_Queues;
+
+I2CQueue::I2CQueue(I2CBus* bus)
+    : m_Bus(bus), m_Retries(2), m_RetryDelay(1), m_Deadline(100), m_Busy(false), m_Waiting()
+{
+    std::lock_guard lock(g_QueuesLock);
+    g_Queues.push_back(this);
+}
+
+I2CQueue::~I2CQueue()
+{
+    {
+        std::lock_guard lock(g_QueuesLock);
+        g_Queues.erase(std::find(g_Queues.begin(), g_Queues.end(), this));
+    }
+
+    for (Stats* dev : m_Devices)
+        delete dev;
+}
+
+void I2CQueue::Configure(xmlNode* node)
+{
+    int retries = GetIntProp(node, "retries", m_Retries);
+    int retryDelay = GetIntProp(node, "retry_delay", m_RetryDelay);
+    int deadline = GetIntProp(node, "deadline", m_Deadline);
+
+    if (retries < 0 || retryDelay < 0 || deadline <= 0) {
+        LOG(ERR) << "Malformed I2C queue parameters " << *node;
+        return;
+    }
+
+    m_Retries    = retries;
+    m_RetryDelay = retryDelay;
+    m_Deadline   = deadline;
+}
+
+I2CQueue::Stats* I2CQueue::AddDevice(const std::string& name)
+{
+    std::lock_guard lock(m_Lock);
+    Stats* dev = new Stats();
+
+    dev->name = name;
+    m_Devices.push_back(dev);
+    return dev;
+}
+
+bool I2CQueue::acquire(I2CClass cls, time_point deadline)
+{
+    TRACE_SPAN("I2C wait");
+    std::unique_lock lock(m_Lock);
+
+    m_Waiting[cls]++;
+
+    bool ok = m_Cond.wait_until(lock, deadline, [this, cls] {
+        if (m_Busy)
+            return false;
+        for (int c = 0; c < cls; c++) {
+            if (m_Waiting[c])
+                return false;
+        }
+        return true;
+    });
+
+    m_Waiting[cls]--;
+
+    if (ok) {
+        m_Busy = true;
+    } else {
+        // Less urgent transactions may have been waiting for us
+        m_Cond.notify_all();
+    }
+
+    return ok;
+}
+
+void I2CQueue::release()
+{
+    m_Lock.lock();
+    m_Busy = false;
+    m_Lock.unlock();
+
+    m_Cond.notify_all();
+}
+
+bool I2CQueue::Run(Stats* dev, I2CClass cls, const std::function<bool()>& op)
+{
+    time_point start = std::chrono::steady_clock::now();
+    time_point deadline = start + std::chrono::milliseconds(m_Deadline);
+    unsigned int delay = m_RetryDelay;
+    unsigned int retries = 0;
+    bool timeout = false;
+    bool ok = false;
+
+    for (;;) {
+        if (!acquire(cls, deadline)) {
+            timeout = true;
+            break;
+        }
+
+        {
+            TRACE_SPAN("I2C", dev->name);
+            ok = op();
+        }
+        release();
+
+        if (ok || retries == m_Retries)
+            break;
+
+        // Don't start an attempt, which has no chance to complete in time
+        if (std::chrono::steady_clock::now() + std::chrono::milliseconds(delay) >= deadline) {
+            timeout = true;
+            break;
+        }
+
+        msleep(delay);
+        delay = std::min(delay * 2, MaxRetryDelay);
+        retries++;
+    }
+
+    uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    std::lock_guard lock(m_Lock);
+
+    dev->count++;
+    dev->retries += retries;
+    dev->totalUs += latency;
+    dev->maxUs = std::max(dev->maxUs, latency);
+    if (!ok) {
+        dev->errors++;
+        if (timeout)
+            dev->timeouts++;
+    }
+
+    return ok;
+}
+
+void I2CQueue::ReportStats()
+{
+    std::lock_guard lock(g_QueuesLock);
+
+    for (I2CQueue* q : g_Queues) {
+        std::string prefix = "I2C/" + (q->m_Bus->m_name.empty() ? "i2c" : q->m_Bus->m_name) + '/';
+        std::lock_guard qLock(q->m_Lock);
+
+        for (Stats* dev : q->m_Devices) {
+            std::string topic = prefix + dev->name + '/';
+            float avg = dev->count ? dev->totalUs / 1000.0f / dev->count : 0;
+
+            LOG(DEBUG) << topic << ": " << dev->count << " transactions, " << dev->errors
+                       << " errors, " << dev->retries << " retries, " << dev->timeouts
+                       << " timeouts, latency " << avg << " ms avg, " << dev->maxUs / 1000.0f << " ms max";
+            q->m_Bus->m_Bus->SendEvent(topic + "transactions", (int)dev->count);
+            q->m_Bus->m_Bus->SendEvent(topic + "errors", (int)dev->errors);
+            q->m_Bus->m_Bus->SendEvent(topic + "retries", (int)dev->retries);
+            q->m_Bus->m_Bus->SendEvent(topic + "timeouts", (int)dev->timeouts);
+            q->m_Bus->m_Bus->SendEvent(topic + "latency", avg);
+            q->m_Bus->m_Bus->SendEvent(topic + "max_latency", dev->maxUs / 1000.0f);
+
+            std::string name = dev->name;
+
+            *dev = Stats();
+            dev->name = name;
+        }
+    }
+}
+
 I2CPort* I2CBus::CreatePort(xmlNode *node)
 {
     int addr = GetIntProp(node, "address");
+    const char* id = GetStrProp(node, "id");
+    const char* priority = GetStrProp(node, "priority");
+    I2CClass cls = I2C_VALVE;
 
     if (addr == -1) {
-        Log(Log::ERR) << "Malformed I2C address in config";
+        LOG(ERR) << "Malformed I2C address in config";
         return nullptr;
-    } else {
-        return CreatePort(addr);
     }
+
+    if (priority) {
+        int c;
+
+        for (c = 0; c < I2C_NCLASSES; c++) {
+            if (!strcmp(priority, classNames[c]))
+                break;
+        }
+
+        if (c == I2C_NCLASSES) {
+            LOG(ERR) << "Unknown I2C priority \"" << priority << "\", assuming \"valve\"";
+        } else {
+            cls = (I2CClass)c;
+        }
+    }
+
+    I2CPort* port = CreatePort(addr);
+
+    if (!port)
+        return nullptr;
+
+    char addrStr[8];
+
+    snprintf(addrStr, sizeof(addrStr), "0x%02x", addr);
+
+    return new QueuedI2CPort(&m_Queue, port, m_Queue.AddDevice(id ? id : addrStr), cls);
 }
 
-PCF857x::PCF857x(I2CPort* port, unsigned int nBits) : m_Port(port), m_DataSize(nBits / 8)
+IOExpander::IOExpander(I2CPort* port, int maxAge, GpioEvent* intLine)
+    : SnapshotInput(maxAge), m_Port(port), m_Int(intLine), m_State(0)
+{}
+
+IOExpander::~IOExpander()
 {
-    unsigned int buf = 0;
+#ifdef __linux__
+    delete m_Int;
+#endif
+    delete m_Port;
+}
 
-    m_Port->Read(&buf, m_DataSize);
-    m_State = le32toh(buf);
+int IOExpander::GetEventFd() const
+{
+#ifdef __linux__
+    return m_Int ? m_Int->GetFd() : -1;
+#else
+    return -1;
+#endif
 }
 
-PCF857x::~PCF857x()
+void IOExpander::HandleEvent()
 {
-    delete m_Port;
+#ifdef __linux__
+    // Reading the port releases INT, this will happen on the next poll
+    if (m_Int->Consume()) {
+        InvalidateInput();
+    }
+#endif
 }
 
-int PCF857x::ReadBit(int bit, bool activeLow)
+static int decodeBit(uint64_t input, int bit, bool activeLow)
 {
-    unsigned int buf = 0;
+    int val = input & (1U << bit);
 
-    if (m_Port->Read(&buf, m_DataSize)) {
-        int val = le32toh(buf) & (1U << bit);
+    if (activeLow)
+        val = !val;
 
-        if (activeLow)
-            val = !val;
+    return val ? Switch::On : Switch::Off;
+}
 
-        return val ? Switch::On : Switch::Off;
+int IOExpander::ReadBit(int bit, bool activeLow)
+{
+    uint64_t input;
+
+    if (GetInput(input, GetPollCycle())) {
+        return decodeBit(input, bit, activeLow);
     } else {
         return Switch::Fault;
     }
 }
 
-void PCF857x::WriteBit(int bit, bool state)
+int IOExpander::SampleBit(int bit, bool activeLow)
+{
+    uint64_t input;
+
+    if (SampleInput(input)) {
+        return decodeBit(input, bit, activeLow);
+    } else {
+        return Switch::Fault;
+    }
+}
+
+void IOExpander::WriteBit(int bit, bool state)
 {
     unsigned int mask = 1U << bit;
-    unsigned int buf;
 
+    m_OutputLock.lock();
     if (state)
         m_State |= mask;
     else
         m_State &= ~mask;
+    m_OutputLock.unlock();
+
+    if (!OutputBatch::Defer(this))
+        FlushOutput();
+}
+
+PCF857x::PCF857x(I2CPort* port, unsigned int nBits, int maxAge, GpioEvent* intLine)
+    : IOExpander(port, maxAge, intLine), m_DataSize(nBits / 8)
+{
+    unsigned int buf = 0;
+
+    m_Port->Read(&buf, m_DataSize);
+    m_State = le32toh(buf);
+}
+
+bool PCF857x::ReadInput(uint64_t& value)
+{
+    unsigned int buf = 0;
+    bool ok = m_Port->Read(&buf, m_DataSize);
+
+    value = le32toh(buf);
+    return ok;
+}
+
+void PCF857x::FlushOutput()
+{
+    std::lock_guard lock(m_OutputLock);
+    unsigned int buf = htole32(m_State);
+
+    m_Port->Write(&buf, m_DataSize);
 
-    buf = htole32(m_State);
-    m_Port->Write(&buf, 2);
+    // Pins, driven low, read back as zeroes, so the snapshot is no longer valid
+    InvalidateInput();
+}
+
+// MCP23017 registers, IOCON.BANK = 0 (power-on default). A register pair
+// for ports A and B is accessed as a 16-bit little endian word.
+enum
+{
+    MCP_IODIR   = 0x00,
+    MCP_IPOL    = 0x02,
+    MCP_GPINTEN = 0x04,
+    MCP_INTCON  = 0x08,
+    MCP_IOCON   = 0x0A,
+    MCP_GPPU    = 0x0C,
+    MCP_INTF    = 0x0E, // INTF, INTCAP and GPIO follow each other
+    MCP_INTCAP  = 0x10,
+    MCP_GPIO    = 0x12,
+    MCP_OLAT    = 0x14
+};
+
+// INTA and INTB are internally connected, open drain. The line can be
+// shared with other chips, like PCF857x INT.
+static const uint8_t MCP_IOCON_MIRROR = 0x40;
+static const uint8_t MCP_IOCON_ODR    = 0x04;
+
+MCP23017::MCP23017(I2CPort* port, int maxAge, GpioEvent* intLine)
+    : IOExpander(port, maxAge, intLine), m_Dir(0xFFFF), m_Inputs(0), m_PullUp(0), m_Started(false),
+      m_PendingMask(0), m_PendingValue(0)
+{
+    uint8_t reg = MCP_OLAT;
+    uint8_t buf[2] = {0, 0};
+
+    // Keep outputs as they are until relays are configured
+    m_Port->WriteRead(&reg, 1, buf, 2);
+    m_State = m_Written = buf[0] | (buf[1] << 8);
+}
+
+bool MCP23017::writeReg(uint8_t reg, uint16_t value)
+{
+    uint8_t buf[3] = {reg, (uint8_t)value, (uint8_t)(value >> 8)};
+
+    return m_Port->Write(buf, sizeof(buf));
+}
+
+void MCP23017::SetInput(int bit, bool pullUp)
+{
+    uint16_t mask = 1U << bit;
+
+    m_Dir    |= mask;
+    m_Inputs |= mask;
+    if (pullUp)
+        m_PullUp |= mask;
+    else
+        m_PullUp &= ~mask;
+
+    if (m_Started)
+        Start();
+}
+
+void MCP23017::SetOutput(int bit)
+{
+    m_Dir    &= ~(1U << bit);
+    m_Inputs &= ~(1U << bit);
+
+    if (m_Started)
+        Start();
+}
+
+void MCP23017::Start()
+{
+    std::lock_guard lock(m_OutputLock);
+    uint8_t iocon = MCP_IOCON_MIRROR | MCP_IOCON_ODR;
+    bool ok;
+
+    // Compare every input with its previous value, interrupt on any change.
+    // Unused pins stay floating inputs, they must not raise interrupts.
+    // Outputs are latched before they're enabled, so they don't glitch.
+    ok = writeReg(MCP_IOCON, iocon | (iocon << 8)) &&
+         writeReg(MCP_IPOL, 0) &&
+         writeReg(MCP_INTCON, 0) &&
+         writeReg(MCP_GPPU, m_PullUp) &&
+         writeReg(MCP_OLAT, m_State) &&
+         writeReg(MCP_IODIR, m_Dir) &&
+         writeReg(MCP_GPINTEN, m_Inputs);
+
+    if (!ok) {
+        LOG(ERR) << "Failed to configure MCP23017 " << m_name;
+    }
+
+    m_Written = m_State;
+    m_Started = true;
+    InvalidateInput();
+}
+
+bool MCP23017::readPins(uint16_t& pins, uint16_t& changed, uint16_t& captured)
+{
+    uint8_t reg = MCP_INTF;
+    uint8_t buf[6];
+
+    // This also releases INT
+    if (!m_Port->WriteRead(&reg, 1, buf, sizeof(buf)))
+        return false;
+
+    changed  = buf[0] | (buf[1] << 8);
+    captured = buf[2] | (buf[3] << 8);
+    pins     = buf[4] | (buf[5] << 8);
+
+    return true;
+}
+
+bool MCP23017::ReadInput(uint64_t& value)
+{
+    uint16_t pins, changed, captured;
+
+    if (!readPins(pins, changed, captured))
+        return false;
+
+    pins = (pins & ~changed) | (captured & changed);
+
+    std::lock_guard lock(m_CaptureLock);
+
+    // Changes, captured by SampleInput() since the last snapshot, came first
+    value = (pins & ~m_PendingMask) | (m_PendingValue & m_PendingMask);
+    m_PendingMask = 0;
+
+    return true;
+}
+
+bool MCP23017::SampleInput(uint64_t& value)
+{
+    uint16_t pins, changed, captured;
+
+    if (!readPins(pins, changed, captured))
+        return false;
+
+    value = (pins & ~changed) | (captured & changed);
+
+    // Our read has cleared the capture, keep it for the snapshot
+    std::lock_guard lock(m_CaptureLock);
+    uint16_t newBits = changed & ~m_PendingMask;
+
+    m_PendingValue = (m_PendingValue & ~newBits) | (captured & newBits);
+    m_PendingMask |= newBits;
+
+    return true;
+}
+
+void MCP23017::FlushOutput()
+{
+    std::lock_guard lock(m_OutputLock);
+
+    if (m_State == m_Written)
+        return;
+
+    if (writeReg(MCP_OLAT, m_State))
+        m_Written = m_State;
 }
 
 //*** XML deserializers begin here ***
 
+// Input snapshot lifetime in milliseconds; -1, i. e. once per poll cycle,
+// if not given. GetIntProp() would treat the -1 default as mandatory.
+static int getMaxAge(xmlNode *node)
+{
+    return GetStrProp(node, "max_age") ? GetIntProp(node, "max_age") : -1;
+}
+
+// Optional INT line. The chip is then read only when it signals a change,
+// polling every max_age ms (10 seconds by default) is kept as a safety net.
+static GpioEvent* openIntLine(xmlNode *node, int& maxAge, const char* type)
+{
+    GpioEvent* intLine = nullptr;
+
+#ifdef __linux__
+    const char* intGpio = GetStrProp(node, "int_gpio");
+    const char* intFifo = GetStrProp(node, "int_fifo");
+
+    if (intGpio) {
+        intLine = GpioEvent::Open(intGpio);
+    } else if (intFifo) {
+        intLine = GpioEvent::OpenFifo(intFifo);
+    }
+
+    if (intLine) {
+        if (maxAge == -1) {
+            maxAge = 10000;
+        }
+    } else if (intGpio || intFifo) {
+        LOG(WARN) << type << " INT line is not available, falling back to polling";
+    }
+#endif
+
+    return intLine;
+}
+
 REGISTER_DEVICE_TYPE(PCF857x)(xmlNode *node, HWConfig *cfg)
 {
     I2CBus *bus = dynamic_cast<I2CBus *>(cfg->GetParentHW());
 
     if (!bus) {
-        Log(Log::ERR) << "Incorrect bus type for PCF857x config";
+        LOG(ERR) << "Incorrect bus type for PCF857x config";
         return nullptr;
     }
 
     I2CPort *port = bus->CreatePort(node);
     int pincnt = GetIntProp(node, "pincount");
+    int maxAge = getMaxAge(node);
 
     if (pincnt == -1) {
-        Log(Log::ERR) << "Malformed PCF857x definition in config";
+        LOG(ERR) << "Malformed PCF857x definition in config";
         delete port;
         return nullptr;
     }
 
-    return new PCF857x(port, pincnt);
+    GpioEvent* intLine = openIntLine(node, maxAge, "PCF857x");
+
+    return new PCF857x(port, pincnt, maxAge, intLine);
 }
 
-REGISTER_DEVICE_TYPE(PCFSwitch)(xmlNode *node, HWConfig *cfg)
+REGISTER_DEVICE_TYPE(MCP23017)(xmlNode *node, HWConfig *cfg)
 {
-    PCF857x *device = dynamic_cast<PCF857x *>(cfg->GetDeviceProp(node, "device"));
+    I2CBus *bus = dynamic_cast<I2CBus *>(cfg->GetParentHW());
+
+    if (!bus) {
+        LOG(ERR) << "Incorrect bus type for MCP23017 config";
+        return nullptr;
+    }
+
+    I2CPort *port = bus->CreatePort(node);
+    int maxAge = getMaxAge(node);
+
+    if (!port) {
+        return nullptr;
+    }
+
+    GpioEvent* intLine = openIntLine(node, maxAge, "MCP23017");
+
+    return new MCP23017(port, maxAge, intLine);
+}
+
+static Hardware* createExpanderSwitch(xmlNode *node, HWConfig *cfg, const char* type)
+{
+    IOExpander *device = dynamic_cast<IOExpander *>(cfg->GetDeviceProp(node, "device"));
     int pin = GetIntProp(node, "pin");
     int inverted = GetIntProp(node, "inverted", 0);
+    // Internal pull-up, where the chip has a switchable one
+    int pullUp = GetIntProp(node, "pullup", 1);
 
-    if ((!device) || (pin == -1) || (inverted == -1)) {
-        Log(Log::ERR) << "Malformed PCFSwitch definition";
+    if ((!device) || (pin == -1) || (inverted == -1) || (pullUp == -1)) {
+        LOG(ERR) << "Malformed " << type << " definition";
+        return nullptr;
+    } else if ((unsigned int)pin >= device->GetPinCount()) {
+        LOG(ERR) << type << " pin " << pin << " is out of range";
+        return nullptr;
+    } else {
+        return new ExpanderSwitch(device, pin, inverted, pullUp);
+    }
+}
+
+static Hardware* createExpanderRelay(xmlNode *node, HWConfig *cfg, const char* type)
+{
+    IOExpander *device = dynamic_cast<IOExpander *>(cfg->GetDeviceProp(node, "device"));
+    int pin = GetIntProp(node, "pin");
+    int inactive = GetIntProp(node, "inactive");
+
+    if ((!device) || (pin == -1) || (inactive == -1)) {
+        LOG(ERR) << "Malformed " << type << " definition";
+        return nullptr;
+    } else if ((unsigned int)pin >= device->GetPinCount()) {
+        LOG(ERR) << type << " pin " << pin << " is out of range";
         return nullptr;
     } else {
-        return new PCFSwitch(device, pin, inverted);
+        return new ExpanderRelay(device, pin, inactive);
     }
 }
+
+REGISTER_DEVICE_TYPE(PCFSwitch)(xmlNode *node, HWConfig *cfg)
+{
+    return createExpanderSwitch(node, cfg, "PCFSwitch");
+}
+
+REGISTER_DEVICE_TYPE(PCFRelay)(xmlNode *node, HWConfig *cfg)
+{
+    return createExpanderRelay(node, cfg, "PCFRelay");
+}
+
+REGISTER_DEVICE_TYPE(MCPSwitch)(xmlNode *node, HWConfig *cfg)
+{
+    return createExpanderSwitch(node, cfg, "MCPSwitch");
+}
+
+REGISTER_DEVICE_TYPE(MCPRelay)(xmlNode *node, HWConfig *cfg)
+{
+    return createExpanderRelay(node, cfg, "MCPRelay");
+}
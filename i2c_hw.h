@@ -1,44 +1,294 @@
 #ifndef I2C_HW_H
 #define I2C_HW_H
 
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
 #include "hardware.h"
 #include "hwconfig.h"
 
+// One part of a combined transaction, see I2CBus::Transfer()
+struct I2CMessage
+{
+    unsigned int addr;
+    bool         read;
+    void*        data;
+    unsigned int size;
+};
+
 class I2CPort
 {
 public:
+    virtual ~I2CPort() {}
+
     virtual bool Read(void* data, unsigned int size) = 0;
     virtual bool Write(void* data, unsigned int size) = 0;
+
+    // Write, then read back with repeated start, like register reads do.
+    // Buses, which can't do it in one go, fall back to two transfers.
+    virtual bool WriteRead(const void* wdata, unsigned int wsize, void* rdata, unsigned int rsize)
+    {
+        return Write((void *)wdata, wsize) && Read(rdata, rsize);
+    }
+};
+
+// Transaction classes, most urgent first
+enum I2CClass
+{
+    I2C_LEAK,   // Leak sensor inputs
+    I2C_VALVE,  // Valve end switches and other inputs
+    I2C_RELAY,  // Outputs
+    I2C_DIAG,   // Diagnostics, anything else, which can wait
+    I2C_NCLASSES
+};
+
+class I2CBus;
+
+/*
+ * Serializes all transactions on a bus, from all threads. Waiting
+ * transactions are served in order of their class. A failed transaction
+ * is retried with a growing delay, letting others go in between; a
+ * transaction, which can't be completed before its deadline, fails. So a
+ * glitch doesn't fault an input, and a hung bus fails its users in bounded
+ * time instead of stalling them.
+ */
+class I2CQueue
+{
+public:
+    struct Stats
+    {
+        std::string  name;
+        unsigned int count    = 0;
+        unsigned int errors   = 0; // Failed after all retries
+        unsigned int retries  = 0;
+        unsigned int timeouts = 0; // Deadline expired
+        uint64_t     totalUs  = 0; // Latency, including the wait
+        uint64_t     maxUs    = 0;
+    };
+
+    I2CQueue(I2CBus* bus);
+    ~I2CQueue();
+
+    // <bus retries="2" retry_delay="1" deadline="100"/>, delays in ms
+    void Configure(xmlNode* node);
+
+    Stats* AddDevice(const std::string& name);
+    bool Run(Stats* dev, I2CClass cls, const std::function<bool()>& op);
+
+    // Publishes I2C/<bus>/<device>/{transactions,errors,retries,timeouts}
+    // and average and maximum latency (ms) since the previous call for
+    // every bus
+    static void ReportStats();
+
+private:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    bool acquire(I2CClass cls, time_point deadline);
+    void release();
+
+    I2CBus*                 m_Bus;
+    unsigned int            m_Retries;
+    unsigned int            m_RetryDelay;
+    unsigned int            m_Deadline;
+
+    std::mutex              m_Lock;
+    std::condition_variable m_Cond;
+    bool                    m_Busy;
+    unsigned int            m_Waiting[I2C_NCLASSES];
+    std::vector<Stats*>     m_Devices;
+};
+
+// A device's access to the bus via its queue
+class QueuedI2CPort : public I2CPort
+{
+public:
+    QueuedI2CPort(I2CQueue* queue, I2CPort* port, I2CQueue::Stats* stats, I2CClass readClass)
+        : m_Queue(queue), m_Port(port), m_Stats(stats), m_ReadClass(readClass),
+          m_WriteClass(readClass == I2C_DIAG ? I2C_DIAG : I2C_RELAY)
+    {}
+
+    ~QueuedI2CPort()
+    {
+        delete m_Port;
+    }
+
+    bool Read(void* data, unsigned int size) override
+    {
+        return m_Queue->Run(m_Stats, m_ReadClass, [=] { return m_Port->Read(data, size); });
+    }
+
+    bool Write(void* data, unsigned int size) override
+    {
+        return m_Queue->Run(m_Stats, m_WriteClass, [=] { return m_Port->Write(data, size); });
+    }
+
+    // Register reads are inputs
+    bool WriteRead(const void* wdata, unsigned int wsize, void* rdata, unsigned int rsize) override
+    {
+        return m_Queue->Run(m_Stats, m_ReadClass,
+                            [=] { return m_Port->WriteRead(wdata, wsize, rdata, rsize); });
+    }
+
+private:
+    I2CQueue*        m_Queue;
+    I2CPort*         m_Port;
+    I2CQueue::Stats* m_Stats;
+    I2CClass         m_ReadClass;
+    I2CClass         m_WriteClass;
 };
 
 class I2CBus : public Hardware
 {
 public:
+    I2CBus() : m_Queue(this)
+    {}
+
     virtual I2CPort *CreatePort(unsigned int addr) = 0;
+    // Port of a device, defined by the node, going via the bus queue.
+    // priority="leak|valve|relay|diag" gives class of its reads.
     I2CPort *CreatePort(xmlNode *node);
+
+    void ConfigureQueue(xmlNode *node)
+    {
+        m_Queue.Configure(node);
+    }
+
+    // Run several messages, possibly to different devices, as a single
+    // transaction. Returns false on failure or if the bus can't do it.
+    virtual bool Transfer(I2CMessage*, unsigned int)
+    {
+        return false;
+    }
+
+private:
+    I2CQueue m_Queue;
 };
 
-class PCF857x : public Hardware
+class GpioEvent;
+
+// I/O expander chip. Inputs are decoded from a snapshot of all the pins,
+// outputs are written from a shadow register. Switches and relays may share
+// a chip.
+class IOExpander : public Hardware, public SnapshotInput, public BatchedOutput
 {
 public:
-    PCF857x(I2CPort* port, unsigned int nBits);
-    ~PCF857x();
+    IOExpander(I2CPort* port, int maxAge, GpioEvent* intLine);
+    ~IOExpander();
+
     int ReadBit(int bit, bool activeLow);
+    // Reads the chip right now, leaving the snapshot alone
+    int SampleBit(int bit, bool activeLow);
     void WriteBit(int bit, bool state);
 
+    // Pin direction, called by switches and relays on creation
+    virtual void SetInput(int bit, bool pullUp) = 0;
+    virtual void SetOutput(int bit) = 0;
+    virtual unsigned int GetPinCount() const = 0;
+
+    int GetEventFd() const override;
+    void HandleEvent() override;
+
+protected:
+    // Same as ReadInput(), but may be called from any thread
+    virtual bool SampleInput(uint64_t& value) = 0;
+
+    I2CPort*     m_Port;
+    GpioEvent*   m_Int;
+    unsigned int m_State; // Output shadow register
+};
+
+class PCF857x : public IOExpander
+{
+public:
+    PCF857x(I2CPort* port, unsigned int nBits, int maxAge = -1, GpioEvent* intLine = nullptr);
+
+    // Quasi-bidirectional pins: an input is an output, driven high
+    void SetInput(int bit, bool) override
+    {
+        WriteBit(bit, true);
+    }
+
+    void SetOutput(int) override
+    {}
+
+    unsigned int GetPinCount() const override
+    {
+        return m_DataSize * 8;
+    }
+
+    void FlushOutput() override;
+
+protected:
+    // With INT line connected the input snapshot is also invalidated
+    // by the interrupt
+    bool ReadInput(uint64_t& value) override;
+
+    bool SampleInput(uint64_t& value) override
+    {
+        return ReadInput(value);
+    }
+
 private:
-    I2CPort* m_Port;
     unsigned int m_DataSize;
-    unsigned int m_State;
 };
 
-class PCFSwitch : public Switch
+/*
+ * MCP23017: 16 pins with real direction registers and interrupt-on-change.
+ * Flags, captured values and pins are read in a single sequential burst.
+ * A pin, which has changed since the previous read, is reported with its
+ * captured value, so a pulse shorter than the poll period is still seen once.
+ */
+class MCP23017 : public IOExpander
+{
+public:
+    MCP23017(I2CPort* port, int maxAge = -1, GpioEvent* intLine = nullptr);
+
+    void SetInput(int bit, bool pullUp) override;
+    void SetOutput(int bit) override;
+
+    unsigned int GetPinCount() const override
+    {
+        return 16;
+    }
+
+    // Programs directions, pull-ups and interrupts of configured pins
+    void Start() override;
+    void FlushOutput() override;
+
+protected:
+    bool ReadInput(uint64_t& value) override;
+    bool SampleInput(uint64_t& value) override;
+
+private:
+    bool readPins(uint16_t& pins, uint16_t& changed, uint16_t& captured);
+    bool writeReg(uint8_t reg, uint16_t value);
+
+    uint16_t   m_Dir;     // IODIR shadow, 1 = input
+    uint16_t   m_Inputs;  // Pins, used by switches; only these interrupt
+    uint16_t   m_PullUp;
+    uint16_t   m_Written; // Last OLAT written
+    bool       m_Started;
+
+    // Captures, consumed by SampleInput(), for the next ReadInput()
+    std::mutex m_CaptureLock;
+    uint16_t   m_PendingMask;
+    uint16_t   m_PendingValue;
+};
+
+// Switch or relay on any expander
+class ExpanderSwitch : public Switch
 {
 public:
-    PCFSwitch(PCF857x* dev, int bit, bool activeLow)
+    ExpanderSwitch(IOExpander* dev, int bit, bool activeLow, bool pullUp)
         : Switch(activeLow), m_Dev(dev), m_Bit(bit)
     {
-        dev->WriteBit(bit, true);
+        dev->SetInput(bit, pullUp);
     }
 
     virtual int GetState()
@@ -46,8 +296,34 @@ public:
         return m_Dev->ReadBit(m_Bit, m_activeLow);
     }
 
+    virtual int Sample() override
+    {
+        return m_Dev->SampleBit(m_Bit, m_activeLow);
+    }
+
+private:
+    IOExpander* m_Dev;
+    int m_Bit;
+};
+
+class ExpanderRelay : public Relay
+{
+public:
+    ExpanderRelay(IOExpander* dev, int bit, bool resetState)
+        : Relay(resetState), m_Dev(dev), m_Bit(bit)
+    {
+        dev->WriteBit(bit, resetState);
+        dev->SetOutput(bit);
+    }
+
+protected:
+    virtual void ApplyState(bool on) override
+    {
+        m_Dev->WriteBit(m_Bit, on);
+    }
+
 private:
-    PCF857x* m_Dev;
+    IOExpander* m_Dev;
     int m_Bit;
 };
 
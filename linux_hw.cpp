@@ -1,31 +1,370 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+#include "hwconfig.h"
 #include "linux_hw.h"
+#include "logging.h"
+
+LinuxI2CBus::LinuxI2CBus(int fd, const std::string& path)
+    : m_fd(fd), m_Path(path), m_Funcs(0)
+{
+    if (ioctl(m_fd, I2C_FUNCS, &m_Funcs) < 0) {
+        LOG(WARN) << "Failed to query " << m_Path << " capabilities: " << strerror(errno);
+    }
+
+    if (!(m_Funcs & I2C_FUNC_I2C)) {
+        // SMBus-only adapters can't do arbitrary transactions, only the
+        // common register access patterns are mapped
+        LOG(WARN) << m_Path << " does not support plain I2C transfers, using SMBus commands";
+    }
+}
+
+LinuxI2CBus::~LinuxI2CBus()
+{
+    close(m_fd);
+}
+
+LinuxI2CBus* LinuxI2CBus::Open(const char* path)
+{
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+
+    if (fd == -1) {
+        LOG(ERR) << "Failed to open " << path << ": " << strerror(errno);
+        return nullptr;
+    }
+
+    return new LinuxI2CBus(fd, path);
+}
+
+I2CPort* LinuxI2CBus::CreatePort(unsigned int addr)
+{
+    return new LinuxI2CPort(this, addr);
+}
 
-LinuxI2C::LinuxI2C(const char* port, int addr)
+bool LinuxI2CBus::Transfer(I2CMessage* msgs, unsigned int count)
 {
-    m_fd = open (device, O_RDWR);
+    if (!(m_Funcs & I2C_FUNC_I2C)) {
+        return TransferSMBus(msgs, count);
+    }
+
+    struct i2c_msg m[I2C_RDWR_IOCTL_MAX_MSGS];
+    struct i2c_rdwr_ioctl_data data;
+
+    if (count > I2C_RDWR_IOCTL_MAX_MSGS) {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        m[i].addr  = msgs[i].addr;
+        m[i].flags = msgs[i].read ? I2C_M_RD : 0;
+        m[i].len   = msgs[i].size;
+        m[i].buf   = (__u8 *)msgs[i].data;
+    }
+
+    data.msgs  = m;
+    data.nmsgs = count;
+
+    // The whole thing is a single transaction with repeated starts, the
+    // kernel serializes it against all other users of the adapter
+    if (ioctl(m_fd, I2C_RDWR, &data) != (int)count) {
+        LOG(DEBUG) << m_Path << " transfer failed: " << strerror(errno);
+        return false;
+    }
 
-    if (m_fd == -1)
-        return;
+    return true;
+}
+
+bool LinuxI2CBus::SMBusCall(unsigned int addr, char rw, unsigned char cmd, int size, i2c_smbus_data* data)
+{
+    struct i2c_smbus_ioctl_data args = { (__u8)rw, cmd, (__u32)size, data };
+
+    if (ioctl(m_fd, I2C_SLAVE, addr) < 0 || ioctl(m_fd, I2C_SMBUS, &args) < 0) {
+        LOG(DEBUG) << m_Path << " SMBus transfer failed: " << strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * SMBus adapters only know a fixed set of transaction shapes. Map those,
+ * which our devices use: plain byte read/write, register write, and
+ * register read via a write of the register number followed by a read.
+ */
+bool LinuxI2CBus::TransferSMBus(I2CMessage* msgs, unsigned int count)
+{
+    if (!count) {
+        return true;
+    }
+
+    std::lock_guard lock(m_Lock);
+    union i2c_smbus_data data;
+    unsigned char* buf = (unsigned char *)msgs[0].data;
+
+    if (count == 2 && !msgs[0].read && msgs[1].read && msgs[0].size == 1 &&
+        msgs[0].addr == msgs[1].addr) {
+        unsigned char* rbuf = (unsigned char *)msgs[1].data;
+        unsigned int rsize = msgs[1].size;
+
+        if (rsize == 1 && (m_Funcs & I2C_FUNC_SMBUS_READ_BYTE_DATA)) {
+            if (!SMBusCall(msgs[0].addr, I2C_SMBUS_READ, buf[0], I2C_SMBUS_BYTE_DATA, &data)) {
+                return false;
+            }
+            rbuf[0] = data.byte;
+            return true;
+        }
+        if (rsize == 2 && (m_Funcs & I2C_FUNC_SMBUS_READ_WORD_DATA)) {
+            if (!SMBusCall(msgs[0].addr, I2C_SMBUS_READ, buf[0], I2C_SMBUS_WORD_DATA, &data)) {
+                return false;
+            }
+            // SMBus words go over the wire low byte first
+            rbuf[0] = data.word & 0xFF;
+            rbuf[1] = data.word >> 8;
+            return true;
+        }
+        if (rsize <= I2C_SMBUS_BLOCK_MAX && (m_Funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK)) {
+            data.block[0] = rsize;
+            if (!SMBusCall(msgs[0].addr, I2C_SMBUS_READ, buf[0], I2C_SMBUS_I2C_BLOCK_DATA, &data) ||
+                data.block[0] != rsize) {
+                return false;
+            }
+            memcpy(rbuf, &data.block[1], rsize);
+            return true;
+        }
+    } else if (count == 1 && msgs[0].read) {
+        if (msgs[0].size == 1 && (m_Funcs & I2C_FUNC_SMBUS_READ_BYTE)) {
+            if (!SMBusCall(msgs[0].addr, I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &data)) {
+                return false;
+            }
+            buf[0] = data.byte;
+            return true;
+        }
+    } else if (count == 1) {
+        unsigned int size = msgs[0].size;
+
+        if (size == 1 && (m_Funcs & I2C_FUNC_SMBUS_WRITE_BYTE)) {
+            return SMBusCall(msgs[0].addr, I2C_SMBUS_WRITE, buf[0], I2C_SMBUS_BYTE, nullptr);
+        }
+        if (size == 2 && (m_Funcs & I2C_FUNC_SMBUS_WRITE_BYTE_DATA)) {
+            data.byte = buf[1];
+            return SMBusCall(msgs[0].addr, I2C_SMBUS_WRITE, buf[0], I2C_SMBUS_BYTE_DATA, &data);
+        }
+        if (size == 3 && (m_Funcs & I2C_FUNC_SMBUS_WRITE_WORD_DATA)) {
+            data.word = buf[1] | (buf[2] << 8);
+            return SMBusCall(msgs[0].addr, I2C_SMBUS_WRITE, buf[0], I2C_SMBUS_WORD_DATA, &data);
+        }
+        if (size >= 2 && size - 1 <= I2C_SMBUS_BLOCK_MAX && (m_Funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) {
+            data.block[0] = size - 1;
+            memcpy(&data.block[1], &buf[1], size - 1);
+            return SMBusCall(msgs[0].addr, I2C_SMBUS_WRITE, buf[0], I2C_SMBUS_I2C_BLOCK_DATA, &data);
+        }
+    }
+
+    LOG(DEBUG) << m_Path << ": transfer of " << count << " messages can't be done with SMBus";
+    return false;
+}
+
+bool LinuxI2CPort::Read(void* data, unsigned int size)
+{
+    I2CMessage msg = { m_Addr, true, data, size };
+
+    return m_Bus->Transfer(&msg, 1);
+}
+
+bool LinuxI2CPort::Write(void* data, unsigned int size)
+{
+    I2CMessage msg = { m_Addr, false, data, size };
+
+    return m_Bus->Transfer(&msg, 1);
+}
+
+bool LinuxI2CPort::WriteRead(const void* wdata, unsigned int wsize, void* rdata, unsigned int rsize)
+{
+    I2CMessage msgs[2] =
+    {
+        { m_Addr, false, (void *)wdata, wsize },
+        { m_Addr, true,  rdata,         rsize }
+    };
+
+    return m_Bus->Transfer(msgs, 2);
+}
 
-    if (ioctl (fd, I2C_SLAVE, devId) < 0) {
+W1Bus::W1Bus(const std::string& name, const std::string& root, const char* master,
+             unsigned int period, unsigned int delay)
+    : Worker(name, period), m_Root(root), m_Delay(delay)
+{
+    std::string path = m_Root + '/' + master + "/therm_bulk_read";
+
+    m_BulkRead = open(path.c_str(), O_RDWR | O_CLOEXEC);
+
+    if (m_BulkRead == -1) {
+        // Old kernels; sensors will be converted one by one
+        LOG(WARN) << "Bulk conversion is not available on " << master << ": " << strerror(errno);
+    }
+}
+
+W1Bus::~W1Bus()
+{
+    Worker::Stop();
+
+    if (m_BulkRead != -1) {
+        close(m_BulkRead);
+    }
+}
+
+void W1Bus::Start()
+{
+    if (!m_Sensors.empty()) {
+        Worker::Start();
+    }
+}
+
+void W1Bus::Stop()
+{
+    Worker::Stop();
+}
+
+void W1Bus::Run()
+{
+    if (m_BulkRead != -1) {
+        static const char trigger[] = "trigger\n";
+
+        if (pwrite(m_BulkRead, trigger, sizeof(trigger) - 1, 0) == -1) {
+            LOG(ERR) << "Failed to start bulk conversion: " << strerror(errno);
+        } else {
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_Delay);
+
+            // Reads -1 while conversion is in progress. Don't wait more than
+            // the conversion time though, sensors will report errors if any.
+            while (std::chrono::steady_clock::now() < deadline) {
+                char buf[16];
+                ssize_t l = pread(m_BulkRead, buf, sizeof(buf) - 1, 0);
+
+                if (l <= 0) {
+                    break;
+                }
+                buf[l] = 0;
+                if (atoi(buf) != -1) {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+    }
+
+    for (W1Thermometer* t : m_Sensors) {
+        t->PutSample(t->Read());
+    }
+}
+
+W1Thermometer::W1Thermometer(W1Bus* bus, const char* sensor, float thresh)
+    : Thermometer(thresh), m_Path(bus->GetRoot() + '/' + sensor + "/temperature")
+{
+    m_fd = open(m_Path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (m_fd == -1) {
+        LOG(ERR) << "Failed to open " << m_Path << ": " << strerror(errno);
+    }
+
+    bus->AddSensor(this);
+}
+
+W1Thermometer::~W1Thermometer()
+{
+    if (m_fd != -1) {
         close(m_fd);
-        m_fd = -1;
     }
 }
 
-LinuxI2C::~LinuxI2C()
+float W1Thermometer::Read()
 {
-    close(m_fd);
+    char buf[32];
+    char* end;
+
+    if (m_fd == -1) {
+        return NAN;
+    }
+
+    // sysfs regenerates the contents on every read from offset 0. The driver
+    // fails the read with EIO if the scratchpad CRC doesn't match.
+    ssize_t l = pread(m_fd, buf, sizeof(buf) - 1, 0);
+
+    if (l <= 0) {
+        LOG(DEBUG) << m_Path << " read failed: " << strerror(errno);
+        return NAN;
+    }
+
+    buf[l] = 0;
+    long val = strtol(buf, &end, 10);
+
+    if (end == buf) {
+        return NAN;
+    }
+
+    // Millidegrees
+    return val / 1000.0f;
 }
 
-unsigned int LinuxI2C::Read()
+// *** XML deserializers begin here ***
+
+// <bus type="LinuxI2CBus" device="/dev/i2c-0">
+REGISTER_DEVICE_TYPE(LinuxI2CBus)(xmlNode *node, HWConfig *)
+{
+    const char* device = GetStrProp(node, "device");
+
+    if (!device) {
+        LOG(ERR) << "Malformed LinuxI2CBus description";
+        return nullptr;
+    }
+
+    LinuxI2CBus* bus = LinuxI2CBus::Open(device);
+
+    if (bus)
+        bus->ConfigureQueue(node);
+
+    return bus;
+}
+
+// <bus type="W1Bus" id="W1" master="w1_bus_master1" sample_interval="1000"/>
+// root is there for testing with a fake sysfs tree
+REGISTER_DEVICE_TYPE(W1Bus)(xmlNode *node, HWConfig *cfg)
 {
-    unsigned int ret = wiringPiI2CRead(m_fd);
+    const char* root = GetStrProp(node, "root");
+    const char* master = GetStrProp(node, "master");
+    int period = GetIntProp(node, "sample_interval", 1000);
+    // 12-bit conversion takes 750 ms
+    int delay = GetIntProp(node, "delay", 750);
+
+    if (!master || period <= 0 || delay < 0) {
+        LOG(ERR) << "Malformed W1Bus description";
+        return nullptr;
+    }
 
-    return ret;
+    return new W1Bus(cfg->GetWorkerName(master),
+                     root ? root : "/sys/bus/w1/devices", master, period, delay);
 }
 
-void LinuxI2C::Write(unsigned int data)
+// <hot_supply_temp type="W1Thermometer" device="W1" sensor="28-01131be9099c" threshold="45"/>
+REGISTER_DEVICE_TYPE(W1Thermometer)(xmlNode *node, HWConfig *cfg)
 {
-    wiringPiI2CWrite(m_fd, data);
+    W1Bus *bus = dynamic_cast<W1Bus *>(cfg->GetDeviceProp(node, "device"));
+    const char *sensor = GetStrProp(node, "sensor");
+    float threshold = GetFloatProp(node, "threshold");
+
+    if ((!bus) || (!sensor) || isnan(threshold)) {
+        LOG(ERR) << "Malformed W1Thermometer description";
+        return nullptr;
+    }
+
+    return new W1Thermometer(bus, sensor, threshold);
 }
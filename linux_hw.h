@@ -1,14 +1,114 @@
+#ifndef LINUX_HW_H
+#define LINUX_HW_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
 #include "hardware.h"
 #include "i2c_hw.h"
+#include "worker.h"
+
+union i2c_smbus_data;
+
+// I2C bus via Linux i2c-dev, no third party libraries needed
+class LinuxI2CBus : public I2CBus
+{
+public:
+    LinuxI2CBus(int fd, const std::string& path);
+    virtual ~LinuxI2CBus();
+
+    static LinuxI2CBus* Open(const char* path);
+
+    virtual I2CPort *CreatePort(unsigned int addr) override;
+    virtual bool Transfer(I2CMessage* msgs, unsigned int count) override;
+
+private:
+    bool TransferSMBus(I2CMessage* msgs, unsigned int count);
+    bool SMBusCall(unsigned int addr, char rw, unsigned char cmd, int size, i2c_smbus_data* data);
+
+    int           m_fd;
+    std::string   m_Path;
+    unsigned long m_Funcs;
+    std::mutex    m_Lock; // Only for SMBus-only adapters, I2C_SLAVE is per fd
+};
+
+class LinuxI2CPort : public I2CPort
+{
+public:
+    LinuxI2CPort(LinuxI2CBus* bus, unsigned int addr) : m_Bus(bus), m_Addr(addr)
+    {}
+
+    virtual bool Read(void* data, unsigned int size) override;
+    virtual bool Write(void* data, unsigned int size) override;
+    virtual bool WriteRead(const void* wdata, unsigned int wsize, void* rdata, unsigned int rsize) override;
+
+private:
+    LinuxI2CBus* m_Bus;
+    unsigned int m_Addr;
+};
+
+class W1Thermometer;
 
-class LinuxI2C : public I2CPort
+/*
+ * 1-wire bus master of the kernel w1 subsystem, no owfs and FUSE needed.
+ * Triggers conversion on all the sensors at once via therm_bulk_read, then
+ * reads results. All sysfs files are kept open.
+ */
+class W1Bus : public Hardware, public Worker
 {
 public:
-    LinuxI2C(const char* dev, int addr);
-    virtual ~LinuxI2C();
-    virtual unsigned int Read();
-    virtual void Write(unsigned int data);
+    // name is the one of the sampling thread
+    W1Bus(const std::string& name, const std::string& root, const char* master,
+          unsigned int period, unsigned int delay);
+    ~W1Bus();
+
+    void AddSensor(W1Thermometer* t)
+    {
+        m_Sensors.push_back(t);
+    }
+
+    const std::string& GetRoot() const
+    {
+        return m_Root;
+    }
+
+    void Start() override;
+    void Stop() override;
+
+protected:
+    void Run() override;
 
 private:
-    int m_fd;
+    std::string  m_Root;
+    int          m_BulkRead; // -1 if the master doesn't support it
+    unsigned int m_Delay;
+    std::vector<W1Thermometer*> m_Sensors;
 };
+
+class W1Thermometer : public Thermometer
+{
+public:
+    W1Thermometer(W1Bus* bus, const char* sensor, float thresh);
+    ~W1Thermometer();
+
+    // Sampling is done by the bus, till its first round we're in Fault
+    void Start() override {}
+    void Stop() override {}
+
+    // Without bulk conversion this converts only this sensor
+    float Read();
+
+protected:
+    // Used only if background sampling is turned off
+    virtual float Measure() override
+    {
+        return Read();
+    }
+
+private:
+    std::string m_Path;
+    int         m_fd;
+};
+
+#endif
@@ -1,20 +1,48 @@
-#include <fstream>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define O_CLOEXEC 0
+#endif
+
+#include <chrono>
 #include <iostream>
 #include <mutex>
 #include <string>
 #include <vector>
 
+#include "event_bus.h"
 #include "hwconfig.h"
 #include "logging.h"
+#include "trace.h"
 #include "utils.h"
 
 static std::vector<LogListener *> g_Listeners;
 static std::mutex g_Lock;
 
+std::atomic<int> Log::g_MaxLevel(-1);
+
+// Must be called with g_Lock held
+static void updateMaxLevel()
+{
+    int level = -1;
+
+    for (LogListener* l : g_Listeners) {
+        if (l->GetLevel() > level) {
+            level = l->GetLevel();
+        }
+    }
+
+    Log::g_MaxLevel = level;
+}
+
 void AddLogListener(LogListener *l)
 {
 	g_Lock.lock();
 	g_Listeners.push_back(l);
+	updateMaxLevel();
 	g_Lock.unlock();
 }
 
@@ -29,6 +57,7 @@ void RemoveLogListener(LogListener *l)
 		}
 	}
 
+	updateMaxLevel();
 	g_Lock.unlock();
 }
 
@@ -41,29 +70,217 @@ static const char* logTags[] =
     NULL
 };
 
-Log::~Log()
+void Log::Emit(Level level, const std::string& body)
 {
+    // Formatting time is relatively expensive, and most of our lines come
+    // in bursts within the same second
+    thread_local time_t lastTime;
+    thread_local char ts[128];
     time_t t = time(nullptr);
-    struct tm pt;
-    char ts[128];
 
-    localtime_r(&t, &pt);
-    strftime(ts, sizeof(ts), "%d.%m.%Y %H:%M:%S", &pt);
+    if (t != lastTime) {
+        struct tm pt;
 
-    std::string text = std::string("[") + logTags[m_Level] + "] " + ts + ' ' + m_Stream.str();
+        localtime_r(&t, &pt);
+        strftime(ts, sizeof(ts), "%d.%m.%Y %H:%M:%S", &pt);
+        lastTime = t;
+    }
+
+    std::string text = std::string("[") + logTags[level] + "] " + ts + ' ' + body;
 
     g_Lock.lock();
 
     for (LogListener* l : g_Listeners) {
-        l->Write(m_Level, text);
+        l->Write(level, text);
+        if (level == ERR) {
+            l->Flush();
+        }
     }
 
     g_Lock.unlock();
 }
 
-static Log::Level getLogLevel(xmlNode* node)
+thread_local const std::string* LogContext::g_Current;
+
+Log::~Log()
+{
+    TRACE_SPAN("Log");
+    const std::string* site = LogContext::Get();
+    // Prefixed before folding, so that sites don't swallow each other's lines
+    std::string body = site ? *site + ": " + m_Stream.str() : m_Stream.str();
+
+    if (m_Site && !m_Site->Fold(m_Level, body)) {
+        return;
+    }
+
+    Emit(m_Level, body);
+}
+
+static LogLimits g_Limits = { 20, 100, 60, 60 };
+static std::atomic<unsigned int> g_Suppressed;
+
+// All LogSites are static and live forever, so a simple list will do
+static LogSite*   g_Sites;
+static std::mutex g_SitesLock;
+
+void SetLogLimits(const LogLimits& limits)
+{
+    g_Limits = limits;
+}
+
+unsigned int GetLogSuppressed()
+{
+    return g_Suppressed;
+}
+
+LogSite::LogSite()
+    : m_Level(Log::INFO), m_LastTime(0), m_Repeats(0)
+{
+    std::lock_guard lock(g_SitesLock);
+
+    m_Next = g_Sites;
+    g_Sites = this;
+}
+
+// Must be called with m_Lock held
+LogSite::Budget& LogSite::GetBudget()
+{
+    const std::string* site = LogContext::Get();
+
+    return m_Budgets[site ? *site : std::string()];
+}
+
+// Faults tend to come in floods too, but losing one is worse, so they get
+// more room
+static unsigned int getBurst(Log::Level level)
+{
+    return level <= Log::WARN ? g_Limits.errorBurst : g_Limits.burst;
+}
+
+bool LogSite::Allow(Log::Level level)
+{
+    unsigned int burst = getBurst(level);
+
+    if (!burst) {
+        return true;
+    }
+
+    std::lock_guard lock(m_Lock);
+    Budget& b = GetBudget();
+    time_t now = GetMonotonicTime();
+
+    if (now - b.windowStart >= (time_t)g_Limits.interval) {
+        b.windowStart = now;
+        b.count = 0;
+    }
+
+    if (b.count < burst) {
+        b.count++;
+        return true;
+    }
+
+    b.suppressed++;
+    g_Suppressed++;
+    return false;
+}
+
+// Must be called with m_Lock held
+void LogSite::Summarize()
+{
+    if (m_Repeats) {
+        LogContext logContext(m_LastSite.empty() ? nullptr : &m_LastSite);
+
+        Log::Emit(m_Level, "Last message repeated " + std::to_string(m_Repeats) + " times in " +
+                           std::to_string(GetMonotonicTime() - m_LastTime) + " s: " + m_LastText);
+        m_Repeats = 0;
+    }
+    for (auto& it : m_Budgets) {
+        Budget& b = it.second;
+
+        if (b.suppressed) {
+            // Goes to the same listeners as the lines, it stands for
+            LogContext logContext(it.first.empty() ? nullptr : &it.first);
+
+            Log::Emit(m_Level, std::to_string(b.suppressed) + " messages like this suppressed: " + b.lastText);
+            b.suppressed = 0;
+        }
+    }
+}
+
+bool LogSite::Fold(Log::Level level, const std::string& text)
+{
+    std::lock_guard lock(m_Lock);
+    time_t now = GetMonotonicTime();
+
+    if (g_Limits.repeatWindow && m_LastText == text && m_Level == level &&
+        now - m_LastTime < (time_t)g_Limits.repeatWindow) {
+        m_Repeats++;
+        g_Suppressed++;
+        return false;
+    }
+
+    Summarize();
+
+    m_Level    = level;
+    m_LastText = text;
+    m_LastTime = now;
+
+    const std::string* site = LogContext::Get();
+
+    m_LastSite = site ? *site : std::string();
+    if (getBurst(level)) {
+        m_Budgets[m_LastSite].lastText = text;
+    }
+
+    return true;
+}
+
+void LogSite::Expire(time_t now)
 {
-    const char *level = GetStrProp(node, "level");
+    std::lock_guard lock(m_Lock);
+    bool refilled = false;
+
+    for (const auto& it : m_Budgets) {
+        if (it.second.suppressed && now - it.second.windowStart >= (time_t)g_Limits.interval) {
+            refilled = true;
+        }
+    }
+
+    // Report repeats when the folding window is over, and rate limiting
+    // when the budget gets refilled
+    if ((m_Repeats && now - m_LastTime >= (time_t)g_Limits.repeatWindow) || refilled) {
+        Summarize();
+        // Next identical line starts a new folding window
+        m_LastText.clear();
+    }
+}
+
+void FlushLogSuppression()
+{
+    static unsigned int lastReported;
+    time_t now = GetMonotonicTime();
+    LogSite* site;
+
+    g_SitesLock.lock();
+    site = g_Sites;
+    g_SitesLock.unlock();
+
+    // Sites are only ever prepended, so walking the list without the lock is safe
+    for (; site; site = site->m_Next) {
+        site->Expire(now);
+    }
+
+    unsigned int suppressed = g_Suppressed;
+
+    if (suppressed != lastReported) {
+        lastReported = suppressed;
+        SendEvent("Log/suppressed", (int)suppressed);
+    }
+}
+
+Log::Level GetLogLevel(xmlNode* node, const char* name, Log::Level defLevel)
+{
+    const char *level = GetStrProp(node, name);
 
     if (level) {
 	for (int i = 0; logTags[i]; i++) {
@@ -75,25 +292,214 @@ static Log::Level getLogLevel(xmlNode* node)
 	std::cerr << "Invalid log level " << level << std::endl;
     }
 
-    return Log::Level::INFO;
+    return defLevel;
 }
 
 REGISTER_LOGGER_TYPE(console)(xmlNode* node, HWConfig*)
 {
-    return new ConsoleLog(getLogLevel(node));
+    return new ConsoleLog(GetLogLevel(node));
 }
 
 REGISTER_LOGGER_TYPE(file)(xmlNode* node, HWConfig*)
 {
     const char* path = GetStrProp(node, "path");
 
-    return new FileLog(getLogLevel(node), path);
+    return new FileLog(GetLogLevel(node), path);
+}
+
+// How often the background writer wakes up on its own
+static const auto LogFlushInterval = std::chrono::milliseconds(500);
+static const unsigned int LogQueueSize = 1024;
+
+static std::atomic<unsigned int> g_LogGeneration;
+
+void ReopenLogs()
+{
+    g_LogGeneration++;
+}
+
+/*
+ * Bounded multi-producer queue (Dmitry Vyukov's design). Every cell has
+ * a sequence number, telling whether it's free for the producer with the
+ * given ticket or holds data for the consumer. Producers never wait for
+ * each other, and there's only one consumer: the writer thread.
+ */
+class LogQueue
+{
+public:
+    LogQueue(unsigned int size) : m_Cells(size), m_Mask(size - 1), m_Head(0), m_Tail(0)
+    {
+        for (unsigned int i = 0; i < size; i++) {
+            m_Cells[i].seq = i;
+        }
+    }
+
+    bool Push(const std::string& line)
+    {
+        unsigned int pos = m_Head.load(std::memory_order_relaxed);
+        Cell* c;
+
+        for (;;) {
+            c = &m_Cells[pos & m_Mask];
+            int diff = (int)(c->seq.load(std::memory_order_acquire) - pos);
+
+            if (diff == 0) {
+                if (m_Head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Full
+                return false;
+            } else {
+                pos = m_Head.load(std::memory_order_relaxed);
+            }
+        }
+
+        c->line = line;
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(std::string& out)
+    {
+        Cell* c = &m_Cells[m_Tail & m_Mask];
+
+        if (c->seq.load(std::memory_order_acquire) != m_Tail + 1) {
+            return false;
+        }
+
+        out += c->line;
+        c->seq.store(m_Tail + m_Mask + 1, std::memory_order_release);
+        m_Tail++;
+
+        return true;
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<unsigned int> seq;
+        std::string               line;
+    };
+
+    std::vector<Cell>         m_Cells;
+    unsigned int              m_Mask;
+    std::atomic<unsigned int> m_Head;
+    unsigned int              m_Tail; // Only used by the consumer
+};
+
+FileLog::FileLog(Log::Level level, const char* path)
+    : LogListener(level), m_Path(path), m_fd(-1), m_Generation(g_LogGeneration),
+      m_Queue(new LogQueue(LogQueueSize)), m_Dropped(0), m_Quit(false), m_FlushNow(false)
+{
+    Open();
+    m_Thread = std::thread(&FileLog::Run, this);
+}
+
+FileLog::~FileLog()
+{
+    // The thread writes out everything, which is left, before exiting
+    m_Quit = true;
+    Flush();
+    m_Thread.join();
+
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+    delete m_Queue;
+}
+
+bool FileLog::Open()
+{
+    m_fd = open(m_Path.c_str(), O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+
+    if (m_fd == -1) {
+        // Can't use Log() here, we would be logging into ourselves
+        std::cerr << "Failed to open log file " << m_Path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    return true;
 }
 
 void FileLog::Write(const std::string& line)
 {
-    std::fstream f(m_Path, std::fstream::out | std::fstream::app);
+    if (!m_Queue->Push(line)) {
+        m_Dropped++;
+    }
+}
+
+void FileLog::Flush()
+{
+    {
+        // Set under the lock, or the writer may check the flag and go to
+        // sleep just before the notification and miss it
+        std::lock_guard lock(m_WakeLock);
+        m_FlushNow = true;
+    }
+    m_Wake.notify_one();
+}
+
+void FileLog::WriteOut(const std::string& data)
+{
+    const char* p = data.data();
+    size_t size = data.size();
+
+    while (size) {
+        ssize_t l = write(m_fd, p, size);
+
+        if (l == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Nothing better to do than to lose the data
+            return;
+        }
+
+        p += l;
+        size -= l;
+    }
+}
+
+void FileLog::Run()
+{
+    std::string buffer;
+    bool quit;
+
+    do {
+        {
+            std::unique_lock lock(m_WakeLock);
+            m_Wake.wait_for(lock, LogFlushInterval, [this] { return m_FlushNow.load(); });
+            m_FlushNow = false;
+        }
+
+        // Read the flag before draining, so that the final batch includes
+        // everything, which was logged before the destructor was called
+        quit = m_Quit;
+
+        if (m_Generation != g_LogGeneration) {
+            // logrotate has moved our file away
+            m_Generation = g_LogGeneration;
+            if (m_fd != -1) {
+                close(m_fd);
+            }
+            Open();
+        }
+
+        while (m_Queue->Pop(buffer)) {
+            buffer += '\n';
+        }
+
+        unsigned int dropped = m_Dropped.exchange(0);
+
+        if (dropped) {
+            buffer += "[WARNING] " + std::to_string(dropped) + " log lines lost due to overflow\n";
+        }
+
+        if (!buffer.empty() && m_fd != -1) {
+            WriteOut(buffer);
+        }
 
-    f << line << std::endl;
-    f.close();
+        buffer.clear();
+    } while (!quit);
 }
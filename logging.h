@@ -1,11 +1,25 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <time.h>
+
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 extern unsigned int logMask;
 
+// Messages above this level are compiled out. Release builds set it to INFO.
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL DEBUG
+#endif
+
+class LogSite;
+
 class Log
 {
 public:
@@ -17,10 +31,22 @@ public:
         DEBUG
     } Level;
 
-    Log(Level kind) : m_Level(kind)
+    Log(Level kind, LogSite* site = nullptr) : m_Level(kind), m_Site(site)
     {}
     ~Log();
 
+    // Is there anyone, who wants to see messages of this level ?
+    static bool Enabled(Level level)
+    {
+        return (level <= Log::LOG_MAX_LEVEL) && (level <= g_MaxLevel.load(std::memory_order_relaxed));
+    }
+
+    // Timestamp the line and send it to all listeners
+    static void Emit(Level level, const std::string& text);
+
+    // Highest level, accepted by registered listeners; -1 if there are none
+    static std::atomic<int> g_MaxLevel;
+
     template <typename T>
     std::stringstream& operator<<(T val)
     {
@@ -30,9 +56,116 @@ public:
 
 private:
     Level m_Level;
+    LogSite* m_Site;
     std::stringstream m_Stream;
 };
 
+/*
+ * Flood protection state of a single LOG() statement. Every site may emit
+ * a limited number of lines per time interval (per installation in
+ * multi-site mode); excess lines are dropped before being formatted.
+ * Errors and warnings have a separate, larger budget. Identical consecutive lines are folded into
+ * a "repeated N times" summary.
+ */
+class LogSite
+{
+public:
+    LogSite();
+
+    // Rate limit check, done before the message is formatted
+    bool Allow(Log::Level level);
+    // Repeat check, done after formatting. Returns false if the line should
+    // be swallowed.
+    bool Fold(Log::Level level, const std::string& text);
+    // Emit pending summaries, if their time has come
+    void Expire(time_t now);
+
+private:
+    void Summarize();
+
+    // Rate limit state. In multi-site mode every site has its own, so that
+    // a flood on one site doesn't silence the others.
+    struct Budget
+    {
+        time_t       windowStart = 0; // Start of rate limiting interval
+        unsigned int count = 0;       // Lines emitted within the interval
+        unsigned int suppressed = 0;  // Lines dropped by the rate limit
+        std::string  lastText;        // Last line, which got through
+    };
+
+    std::mutex   m_Lock;
+    Log::Level   m_Level;
+    std::string  m_LastText;
+    std::string  m_LastSite;    // Site name of m_LastText
+    time_t       m_LastTime;    // When m_LastText was emitted
+    unsigned int m_Repeats;     // Folded copies of m_LastText
+    // By site name, empty outside multi-site mode
+    std::map<std::string, Budget> m_Budgets;
+
+    Budget& GetBudget();
+
+    LogSite*     m_Next;
+
+    friend void FlushLogSuppression();
+};
+
+struct LogLimits
+{
+    unsigned int burst;        // Lines per interval per site, 0 = unlimited
+    unsigned int errorBurst;   // Same for ERR and WARN lines
+    unsigned int interval;     // Seconds
+    unsigned int repeatWindow; // Seconds, 0 disables folding
+};
+
+void SetLogLimits(const LogLimits& limits);
+
+/*
+ * In multi-site mode lines, logged by the current thread while this object
+ * exists, are prefixed with the site name.
+ */
+class LogContext
+{
+public:
+    LogContext(const std::string* site) : m_Prev(g_Current)
+    {
+        g_Current = site;
+    }
+
+    ~LogContext()
+    {
+        g_Current = m_Prev;
+    }
+
+    // Site of the current thread, nullptr if none
+    static const std::string* Get()
+    {
+        return g_Current;
+    }
+
+private:
+    const std::string* m_Prev;
+
+    static thread_local const std::string* g_Current;
+};
+// Print summaries for floods, which have ended, and report counters.
+// Expected to be called periodically.
+void FlushLogSuppression();
+// Total number of lines dropped by rate limiting and folded as repeats
+unsigned int GetLogSuppressed();
+
+/*
+ * Use this instead of constructing Log object directly. If the message is
+ * not going to be seen by anyone, the whole statement, including evaluation
+ * of arguments, is skipped at the cost of a single comparison.
+ * Every LOG() statement gets its own static LogSite, created by the lambda.
+ * Usage: LOG(INFO) << "Hello";
+ */
+#define LOG(level)                                                      \
+    if (!Log::Enabled(Log::level)) {}                                   \
+    else if (LogSite& _log_site = []() -> LogSite& { static LogSite s; return s; }(); \
+             !_log_site.Allow(Log::level)) {}                          \
+    else Log(Log::level, &_log_site)
+
 void fatal(const char *fmt, ...);
 
 class LogListener
@@ -48,6 +181,16 @@ public:
         }
     }
 
+    // Called after an error has been logged. Buffering loggers should
+    // push the data out now, because we may be about to crash.
+    virtual void Flush()
+    {}
+
+    Log::Level GetLevel() const
+    {
+        return m_Level;
+    }
+
 protected:
     LogListener(Log::Level level = Log::Level::INFO) : m_Level(level) {}
 
@@ -60,16 +203,45 @@ private:
 void AddLogListener(LogListener *);
 void RemoveLogListener(LogListener *);
 
+// Ask file loggers to reopen their files. Async signal safe, to be used
+// from SIGHUP handler after logrotate.
+void ReopenLogs();
+
+class LogQueue;
+
+/*
+ * File logger never touches the disk on the caller's thread. Lines are
+ * put into a lock-free queue and written out in batches by a background
+ * thread, which keeps the file open.
+ */
 class FileLog : public LogListener
 {
 public:
-    FileLog(Log::Level level, const char* path) : LogListener(level), m_Path(path)
-    {}
+    FileLog(Log::Level level, const char* path);
+    ~FileLog();
+
+    virtual void Flush() override;
 
 private:
     virtual void Write(const std::string& line) override;
 
+    void Run();
+    bool Open();
+    void WriteOut(const std::string& data);
+
     std::string m_Path;
+    int         m_fd;
+    unsigned int m_Generation;
+    LogQueue*   m_Queue;
+
+    // Lines, lost because the queue was full
+    std::atomic<unsigned int> m_Dropped;
+
+    std::atomic<bool>       m_Quit;
+    std::atomic<bool>       m_FlushNow;
+    std::mutex              m_WakeLock;
+    std::condition_variable m_Wake;
+    std::thread             m_Thread;
 };
 
 class ConsoleLog : public LogListener
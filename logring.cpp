@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <mutex>
+
+#include "hwconfig.h"
+#include "logring.h"
+
+std::atomic<int> LogRing::g_Level(-1);
+
+static LogRingHeader* g_Header;
+static char*          g_Formats;
+static LogRingRecord* g_Records;
+static std::mutex     g_FormatLock;
+
+bool LogRing::Open(const char* path, unsigned int records, Log::Level level)
+{
+    size_t size = LogRingFileSize(records);
+
+    if (g_Header) {
+        std::cerr << "Only one log ring per process is supported, " << path << " ignored" << std::endl;
+        return false;
+    }
+
+    int fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+
+    if (fd == -1) {
+        std::cerr << "Failed to open log ring " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    bool reuse = !fstat(fd, &st) && (size_t)st.st_size == size;
+
+    if (!reuse && ftruncate(fd, size)) {
+        std::cerr << "Failed to allocate log ring " << path << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return false;
+    }
+
+    // Populate all pages now, we don't want the first write to a page to
+    // wait for the SD card
+    void* mem = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, 0);
+
+    close(fd);
+
+    if (mem == MAP_FAILED) {
+        std::cerr << "Failed to map log ring " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    g_Header  = (LogRingHeader *)mem;
+    g_Formats = (char *)mem + LogRingHeaderSize;
+    g_Records = (LogRingRecord *)(g_Formats + LogRingFormats * LogRingFormatSize);
+
+    if (!reuse || g_Header->magic != LOGRING_MAGIC || g_Header->version != LOGRING_VERSION ||
+        g_Header->recordCount != records || g_Header->formatCount != LogRingFormats) {
+        // Continue the existing ring if possible, this is what we're here for.
+        // Otherwise start from scratch.
+        memset(mem, 0, size);
+        g_Header->version     = LOGRING_VERSION;
+        g_Header->recordCount = records;
+        g_Header->formatCount = LogRingFormats;
+        g_Header->magic       = LOGRING_MAGIC;
+    }
+
+    g_Level = level;
+    return true;
+}
+
+uint16_t LogRing::Format(const char* fmt)
+{
+    std::lock_guard lock(g_FormatLock);
+    unsigned int n = g_Header->nFormats;
+
+    // Previous runs have registered the same formats, reuse them, so that
+    // their records still decode correctly
+    for (unsigned int i = 0; i < n; i++) {
+        if (!strncmp(g_Formats + i * LogRingFormatSize, fmt, LogRingFormatSize - 1)) {
+            return i;
+        }
+    }
+
+    if (n == LogRingFormats) {
+        // Records will be dumped without formatting
+        return LogRingText - 1;
+    }
+
+    strncpy(g_Formats + n * LogRingFormatSize, fmt, LogRingFormatSize - 1);
+    g_Header->nFormats = n + 1;
+
+    return n;
+}
+
+void LogRing::Commit(LogRingRecord& r)
+{
+    struct timespec ts;
+
+    // This is vDSO, not a real syscall
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r.time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    uint64_t n = g_Header->head.fetch_add(1, std::memory_order_relaxed);
+    LogRingRecord* slot = &g_Records[n % g_Header->recordCount];
+
+    // Invalidate the slot while it's being written, so that a crash in the
+    // middle doesn't leave a garbled record
+    slot->seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy((char *)slot + sizeof(slot->seq), (char *)&r + sizeof(r.seq),
+           offsetof(LogRingRecord, data) - sizeof(r.seq) + r.size);
+    slot->seq.store(n + 1, std::memory_order_release);
+}
+
+void LogRing::Text(const std::string& line)
+{
+    LogRingRecord r;
+    const char* s = line.c_str();
+    int spaces = 0;
+
+    // Strip "[LEVEL] date time " prefix, the record has its own level and time
+    switch (s[1])
+    {
+    case 'E':
+        r.level = Log::ERR;
+        break;
+    case 'W':
+        r.level = Log::WARN;
+        break;
+    case 'I':
+        r.level = Log::INFO;
+        break;
+    default:
+        r.level = Log::DEBUG;
+        break;
+    }
+
+    while (*s && spaces < 3) {
+        if (*s++ == ' ') {
+            spaces++;
+        }
+    }
+
+    r.format = LogRingText;
+    r.nArgs  = 0;
+    r.size   = strnlen(s, sizeof(r.data));
+    memcpy(r.data, s, r.size);
+
+    Commit(r);
+}
+
+class RingLog : public LogListener
+{
+public:
+    RingLog(Log::Level level) : LogListener(level)
+    {}
+
+private:
+    virtual void Write(const std::string& line) override
+    {
+        LogRing::Text(line);
+    }
+};
+
+// Default size is 8192 records, 1 MB
+REGISTER_LOGGER_TYPE(ring)(xmlNode* node, HWConfig*)
+{
+    const char* path = GetStrProp(node, "path");
+    int records = GetIntProp(node, "records", 8192);
+    Log::Level level = GetLogLevel(node, "level");
+    Log::Level traceLevel = GetLogLevel(node, "trace_level", Log::DEBUG);
+
+    if (!path || records <= 0) {
+        std::cerr << "Malformed ring logger definition" << *node << std::endl;
+        return nullptr;
+    }
+
+    if (!LogRing::Open(path, records, traceLevel)) {
+        return nullptr;
+    }
+
+    return new RingLog(level);
+}
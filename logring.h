@@ -0,0 +1,185 @@
+/*
+ * Crash-surviving binary log. Records are written into a fixed-size ring,
+ * living in a memory-mapped file, so they survive the death of the process
+ * and (with some luck, depending on kernel writeback) of the whole board.
+ * Writing a record costs a memcpy and two atomic operations; no syscalls and
+ * no formatting, so it's cheap enough to have DEBUG recording always on.
+ * Formatting is done after the fact by aquarius-logdump.
+ *
+ * The file consists of a header, a table of format strings and the ring of
+ * fixed-size records. Format strings are registered once per call site and
+ * referred to by index.
+ */
+#ifndef LOGRING_H
+#define LOGRING_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+
+#include "logging.h"
+
+#define LOGRING_MAGIC   0x474F4C41 // "ALOG"
+#define LOGRING_VERSION 1
+
+static const unsigned int LogRingHeaderSize = 4096;
+static const unsigned int LogRingFormatSize = 128;
+static const unsigned int LogRingFormats    = 256;
+
+// Format index of plain text records, mirrored from normal logging
+static const uint16_t LogRingText = 0xFFFF;
+
+enum LogRingArg
+{
+    LOGRING_INT,   // int64_t
+    LOGRING_FLOAT, // double
+    LOGRING_STR    // uint8_t length, then characters
+};
+
+struct LogRingHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordCount;
+    uint32_t formatCount;
+    std::atomic<uint32_t> nFormats;
+    std::atomic<uint64_t> head; // Number of records ever written
+};
+
+struct LogRingRecord
+{
+    std::atomic<uint64_t> seq; // Record number + 1; 0 while being written
+    uint64_t time;             // CLOCK_REALTIME in nanoseconds
+    uint8_t  level;
+    uint8_t  nArgs;
+    uint16_t format;
+    uint32_t size;             // Payload length
+    uint8_t  data[104];
+};
+
+static_assert(sizeof(LogRingRecord) == 128, "Log ring record size is part of the file format");
+
+static inline size_t LogRingFileSize(unsigned int records)
+{
+    return LogRingHeaderSize + LogRingFormats * LogRingFormatSize +
+           (size_t)records * sizeof(LogRingRecord);
+}
+
+#ifndef _WIN32
+
+class LogRing
+{
+public:
+    static bool Open(const char* path, unsigned int records, Log::Level level);
+
+    static bool Enabled(Log::Level level)
+    {
+        return (level <= Log::LOG_MAX_LEVEL) && (level <= g_Level.load(std::memory_order_relaxed));
+    }
+
+    // Returns index of the format string. Call once per call site.
+    static uint16_t Format(const char* fmt);
+
+    template <typename... Args>
+    static void Record(Log::Level level, uint16_t fmt, const Args&... args)
+    {
+        LogRingRecord r;
+        Encoder e = { r.data, r.data + sizeof(r.data), 0 };
+
+        (e.Add(args), ...);
+
+        r.level  = level;
+        r.format = fmt;
+        r.nArgs  = e.count;
+        r.size   = e.p - r.data;
+
+        Commit(r);
+    }
+
+    static void Text(const std::string& line);
+
+private:
+    // Arguments, which don't fit, are dropped
+    struct Encoder
+    {
+        uint8_t* p;
+        uint8_t* end;
+        uint8_t  count;
+
+        void AddNumber(uint8_t type, const void* v)
+        {
+            if (end - p >= 9) {
+                *p++ = type;
+                memcpy(p, v, 8);
+                p += 8;
+                count++;
+            }
+        }
+
+        void Add(long long v)
+        {
+            int64_t i = v;
+            AddNumber(LOGRING_INT, &i);
+        }
+
+        void Add(int v)           { Add((long long)v); }
+        void Add(unsigned int v)  { Add((long long)v); }
+        void Add(long v)          { Add((long long)v); }
+        void Add(unsigned long v) { Add((long long)v); }
+        void Add(bool v)          { Add((long long)v); }
+
+        void Add(double v)
+        {
+            AddNumber(LOGRING_FLOAT, &v);
+        }
+
+        void Add(float v)         { Add((double)v); }
+
+        void Add(const char* s)
+        {
+            if (end - p >= 2) {
+                size_t l = strlen(s);
+
+                if (l > (size_t)(end - p - 2)) {
+                    l = end - p - 2;
+                }
+
+                *p++ = LOGRING_STR;
+                *p++ = l;
+                memcpy(p, s, l);
+                p += l;
+                count++;
+            }
+        }
+
+        void Add(const std::string& s) { Add(s.c_str()); }
+    };
+
+    static void Commit(LogRingRecord& r);
+
+    static std::atomic<int> g_Level;
+};
+
+/*
+ * Usage: RLOG(DEBUG, "%s = %d", name.c_str(), value);
+ * Arguments may be integers, floating point numbers and strings. The record
+ * has room for about a hundred bytes of arguments, anything beyond that is cut.
+ */
+#define RLOG(level, fmt, ...)                                           \
+    do {                                                                \
+        if (LogRing::Enabled(Log::level)) {                             \
+            static const uint16_t _rlog_fmt = LogRing::Format(fmt);     \
+            LogRing::Record(Log::level, _rlog_fmt, ##__VA_ARGS__);      \
+        }                                                               \
+    } while (0)
+
+#else
+
+// mmap() is not implemented for Windows
+#define RLOG(level, fmt, ...) do {} while (0)
+
+#endif
+
+#endif
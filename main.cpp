@@ -1,12 +1,24 @@
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fstream>
 #include <iostream>
 
+#ifndef _WIN32
+#include "ctl_server.h"
+#endif
 #include "httpd.h"
+#include "i2c_hw.h"
+#include "hwstate.h"
+#include "hwtrace.h"
 #include "logging.h"
+#include "scheduler.h"
+#include "site.h"
+#include "trace.h"
 #include "userdb.h"
 #include "utils.h"
+#include "worker.h"
 
 void fatal(const char *fmt, ...)
 {
@@ -19,32 +31,170 @@ void fatal(const char *fmt, ...)
     exit(255);
 }
 
-int main(void)
+static volatile sig_atomic_t g_Quit;
+
+static void onTerminate(int)
+{
+    g_Quit = 1;
+}
+
+#ifdef SIGHUP
+static void onHangup(int)
+{
+    ReopenLogs();
+}
+#endif
+
+#ifdef SIGUSR2
+// The first signal enables timing trace, next ones dump it
+static const char* traceDumpPath = "/var/aquarius.trace.json";
+
+static void onDumpTrace(int)
+{
+    Trace::RequestDump();
+}
+#endif
+
+// Feeds recorded operator commands to the control logic
+static void replayCommands(HWState* hw)
+{
+    uint8_t kind;
+    int value;
+    uint8_t zone;
+
+    while (HwTrace::NextCommand(kind, value, zone)) {
+        if (kind == HWTRACE_MODE)
+            hw->SetMode((HWState::ctlmode_t)value, "trace");
+        else if (zone < hw->GetZones().size())
+            hw->SetState((HWState::state_t)value, "trace", hw->GetZones()[zone]->m_Id);
+    }
+}
+
+// Multi-site mode, see site.h
+static int runSites(const char* path)
+{
+    InitUserDB();
+
+    SiteList* sites = new SiteList(path);
+    std::map<std::string, HTTPSite> httpSites;
+
+    for (Site* site : sites->GetSites())
+        httpSites[site->m_Name] = {site->m_Config, site->m_HWState};
+
+    HTTPServer *theServer = new HTTPServer(httpSites);
+    Scheduler sched;
+
+    sites->Start();
+
+    LOG(INFO) << "System started";
+
+    // Control loops run in their own threads, only housekeeping is left here
+    sched.Add("sessions", 1000, CheckSessions);
+    sched.Add("log", 1000, FlushLogSuppression);
+    sched.Add("workers", 10000, Worker::ReportStats);
+    sched.Add("i2c", 10000, I2CQueue::ReportStats);
+#ifdef SIGUSR2
+    sched.Add("spans", 1000, [] { Trace::Poll(traceDumpPath); });
+#endif
+    sched.Add("sites", 10000, [sites] { sites->ReportStats(); });
+
+    while (!g_Quit) {
+        msleep(sched.RunDue());
+    }
+
+    LOG(INFO) << "System stopped";
+
+    delete theServer;
+    delete sites;
+
+    return 0;
+}
+
+static int usage()
+{
+    fprintf(stderr, "Usage: aquarius [--record <trace file> | --replay <trace file> | --sites <site list>]\n");
+    return 2;
+}
+
+int main(int argc, char** argv)
 {
+    // Let destructors run on shutdown, so that buffered logs get written
+    signal(SIGTERM, onTerminate);
+    signal(SIGINT, onTerminate);
+#ifdef SIGHUP
+    signal(SIGHUP, onHangup);
+#endif
+#ifdef SIGUSR2
+    signal(SIGUSR2, onDumpTrace);
+#endif
+
+    if (argc == 3 && !strcmp(argv[1], "--record")) {
+        if (!HwTrace::Record(argv[2]))
+            return 1;
+    } else if (argc == 3 && !strcmp(argv[1], "--replay")) {
+        if (!HwTrace::Replay(argv[2]))
+            return 1;
+    } else if (argc == 3 && !strcmp(argv[1], "--sites")) {
+        return runSites(argv[2]);
+    } else if (argc != 1) {
+        return usage();
+    }
+
+    bool replay = HwTrace::IsReplaying();
+
     InitUserDB();
 
     HWConfig* theConfig = new HWConfig();
-    HTTPServer *theServer = new HTTPServer(theConfig, theConfig->m_HWState);
-    bool freshStart = true;
+    // Replay is an offline run, nobody is supposed to control it
+    HTTPServer *theServer = replay ? nullptr : new HTTPServer(theConfig, theConfig->m_HWState);
+#ifndef _WIN32
+    CtlServer *ctlServer = replay ? nullptr : new CtlServer(theConfig, theConfig->m_HWState);
+#endif
+    HWState* hw = theConfig->m_HWState;
+    Scheduler sched;
 
-    Log(Log::INFO) << "System started";
+    // We've just booted up and initialized, report state for all the hardware units
+    // We need to do it only once, actuators will report changes when they happen
+    hw->Poll();
+    theConfig->ReportCurrentState();
 
-    for (;;) {
-        CheckSessions();
-        theConfig->m_HWState->Poll();
+    LOG(INFO) << "System started";
 
-        if (freshStart) {
-            // We've just booted up and initialized, report state for all the hardware units
-            // We need to do it only once, actuators will report changes when they happen
-            theConfig->ReportCurrentState();
-            freshStart = false;
-        }
+    int leaks = AddControlTasks(sched, theConfig);
+    sched.Add("sessions", 1000, CheckSessions);
+    sched.Add("log", 1000, FlushLogSuppression);
+    sched.Add("workers", 10000, Worker::ReportStats);
+    sched.Add("i2c", 10000, I2CQueue::ReportStats);
+#ifdef SIGUSR2
+    sched.Add("spans", 1000, [] { Trace::Poll(traceDumpPath); });
+#endif
+
+    if (HwTrace::IsRecording())
+        sched.Add("trace", 1000, HwTrace::Flush);
+    else if (replay)
+        sched.Add("trace", 100, [hw] { replayCommands(hw); });
 
-        sleep(1);
+    while (!g_Quit) {
+        unsigned int timeout = sched.RunDue();
+
+        // Input changes, signalled by hardware, are handled immediately.
+        // Currently only leak sensors are that urgent.
+        if (theConfig->WaitForEvents(timeout)) {
+            sched.Trigger(leaks);
+        }
     }
 
+    LOG(INFO) << "System stopped";
+
+#ifndef _WIN32
+    delete ctlServer;
+#endif
     delete theServer;
+
+    // Replay results go to the log, which we're about to close
+    bool traceOk = HwTrace::Close();
+
     delete theConfig;
 
-    return 0;
+    return traceOk ? 0 : 1;
 }
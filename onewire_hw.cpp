@@ -0,0 +1,98 @@
+#include <math.h>
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "hwconfig.h"
+#include "logging.h"
+#include "onewire_hw.h"
+
+static float readValue(const std::string& path)
+{
+    std::ifstream f(path);
+    float val;
+
+    if (!(f >> val)) {
+        val = NAN;
+    }
+
+    return val;
+}
+
+void OwfsBus::Start()
+{
+    if (!m_Sensors.empty()) {
+        Worker::Start();
+    }
+}
+
+void OwfsBus::Stop()
+{
+    Worker::Stop();
+}
+
+void OwfsBus::Run()
+{
+    std::ofstream trigger(m_Root + "/simultaneous/temperature");
+
+    // Start conversion on all the sensors at once, then collect results
+    if (!(trigger << '1' << std::flush)) {
+        LOG(ERR) << "Failed to start conversion on " << m_Root;
+        // Individual sensors still report stale values, and eventually fault
+        return;
+    }
+    trigger.close();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(m_Delay));
+
+    for (OwfsThermometer* t : m_Sensors) {
+        t->PutSample(t->ReadLatest());
+    }
+}
+
+float OwfsThermometer::ReadLatest()
+{
+    return readValue(m_Path + "latesttemp");
+}
+
+float OwfsThermometer::Measure()
+{
+    return readValue(m_Path + "temperature");
+}
+
+// *** XML deserializers begin here ***
+
+// <bus type="OwfsBus" id="OW0" path="/mnt/1wire" sample_interval="1000" delay="750"/>
+REGISTER_DEVICE_TYPE(OwfsBus)(xmlNode *node, HWConfig *cfg)
+{
+    const char *id = GetStrProp(node, "id");
+    const char *path = GetStrProp(node, "path");
+    int period = GetIntProp(node, "sample_interval", 1000);
+    // 12-bit conversion takes 750 ms
+    int delay = GetIntProp(node, "delay", 750);
+
+    if (!path || period <= 0 || delay < 0) {
+        LOG(ERR) << "Malformed OwfsBus description";
+        return nullptr;
+    }
+
+    // Several buses may be mounted, so tell their threads apart
+    return new OwfsBus(cfg->GetWorkerName(std::string("owfs-") + (id ? id : path)), path, period, delay);
+}
+
+// <hot_supply_temp type="OwfsThermometer" device="OW0" sensor="28.9C09E91B1301" threshold="45"/>
+REGISTER_DEVICE_TYPE(OwfsThermometer)(xmlNode *node, HWConfig *cfg)
+{
+    OwfsBus *bus = dynamic_cast<OwfsBus *>(cfg->GetDeviceProp(node, "device"));
+    const char *sensor = GetStrProp(node, "sensor");
+    float threshold = GetFloatProp(node, "threshold");
+
+    if ((!bus) || (!sensor) || isnan(threshold)) {
+        LOG(ERR) << "Malformed OwfsThermometer description";
+        return nullptr;
+    }
+
+    return new OwfsThermometer(bus, sensor, threshold);
+}
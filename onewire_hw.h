@@ -0,0 +1,73 @@
+/*
+ * 1-wire thermometers via owfs. All sensors on the bus are converted at once
+ * using owfs "simultaneous" directory, so sampling time doesn't depend on the
+ * number of sensors.
+ */
+#ifndef ONEWIRE_HW_H
+#define ONEWIRE_HW_H
+
+#include <string>
+#include <vector>
+
+#include "hardware.h"
+#include "worker.h"
+
+class OwfsThermometer;
+
+class OwfsBus : public Hardware, public Worker
+{
+public:
+    // Period and conversion delay are in milliseconds; name is the one of
+    // the sampling thread
+    OwfsBus(const std::string& name, const char* root, unsigned int period, unsigned int delay)
+        : Worker(name, period), m_Root(root), m_Delay(delay)
+    {}
+
+    void AddSensor(OwfsThermometer* t)
+    {
+        m_Sensors.push_back(t);
+    }
+
+    const std::string& GetRoot() const
+    {
+        return m_Root;
+    }
+
+    void Start() override;
+    void Stop() override;
+
+protected:
+    void Run() override;
+
+private:
+    std::string  m_Root;
+    unsigned int m_Delay;
+    std::vector<OwfsThermometer*> m_Sensors;
+};
+
+class OwfsThermometer : public Thermometer
+{
+public:
+    OwfsThermometer(OwfsBus* bus, const char* sensor, float thresh)
+        : Thermometer(thresh), m_Bus(bus), m_Path(bus->GetRoot() + '/' + sensor + '/')
+    {
+        bus->AddSensor(this);
+    }
+
+    // Sampling is done by the bus, till its first round we're in Fault
+    void Start() override {}
+    void Stop() override {}
+
+    // Read the result of the last simultaneous conversion
+    float ReadLatest();
+
+protected:
+    // Used only if background sampling is turned off; converts on its own
+    virtual float Measure() override;
+
+private:
+    OwfsBus*    m_Bus;
+    std::string m_Path;
+};
+
+#endif
@@ -0,0 +1,66 @@
+#include <algorithm>
+
+#include "event_bus.h"
+#include "logging.h"
+#include "scheduler.h"
+#include "utils.h"
+
+Scheduler::Scheduler() : m_Bus(&EventBus::getInstance())
+{}
+
+int Scheduler::Add(const std::string& name, unsigned int period, std::function<void()> func)
+{
+    int id = m_Tasks.size();
+    auto later = [this](int a, int b) { return Later(a, b); };
+
+    m_Tasks.push_back({name, period, func, GetMonotonicTimeMs(), 0});
+    m_Heap.push_back(id);
+    std::push_heap(m_Heap.begin(), m_Heap.end(), later);
+
+    return id;
+}
+
+void Scheduler::Trigger(int id)
+{
+    m_Tasks[id].func();
+}
+
+unsigned int Scheduler::RunDue()
+{
+    auto later = [this](int a, int b) { return Later(a, b); };
+
+    while (!m_Heap.empty()) {
+        uint64_t now = GetMonotonicTimeMs();
+        int id = m_Heap.front();
+        Task& t = m_Tasks[id];
+
+        if (t.due > now) {
+            return t.due - now;
+        }
+
+        std::pop_heap(m_Heap.begin(), m_Heap.end(), later);
+
+        t.func();
+
+        // Anchor to the deadline, not to the actual run time. If we're
+        // late by more than a period, skip the missed runs rather than
+        // run them in a burst.
+        t.due += t.period;
+
+        now = GetMonotonicTimeMs();
+        if (t.due <= now) {
+            unsigned int missed = (now - t.due) / t.period + 1;
+
+            t.missed += missed;
+            t.due += (uint64_t)missed * t.period;
+
+            LOG(WARN) << "Task " << t.name << " missed " << missed << " deadline(s)";
+            m_Bus->SendEvent("Scheduler/" + t.name + "/missed", (int)t.missed);
+        }
+
+        std::push_heap(m_Heap.begin(), m_Heap.end(), later);
+    }
+
+    // No tasks at all
+    return 1000;
+}
@@ -0,0 +1,66 @@
+/*
+ * Deadline scheduler for periodic tasks of the main loop. Every task has its
+ * own period; deadlines are absolute, so that periods don't drift because of
+ * time spent in the tasks themselves.
+ */
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+class EventBus;
+
+class Scheduler
+{
+public:
+    Scheduler();
+
+    // Bus for missed deadline counters; every site has its own
+    void SetBus(EventBus* bus)
+    {
+        m_Bus = bus;
+    }
+
+    // Period is in milliseconds. Returns task id. The first run is due
+    // immediately.
+    int Add(const std::string& name, unsigned int period, std::function<void()> func);
+
+    // Run the task right now, out of schedule. Its deadlines are not affected.
+    void Trigger(int id);
+
+    // Run all the tasks, which are due, returns time in ms until the next one
+    unsigned int RunDue();
+
+    // Runs, which had to be skipped because the task was late by more than
+    // its period
+    unsigned int GetMissed(int id) const
+    {
+        return m_Tasks[id].missed;
+    }
+
+private:
+    struct Task
+    {
+        std::string           name;
+        unsigned int          period;
+        std::function<void()> func;
+        uint64_t              due;
+        unsigned int          missed;
+    };
+
+    // Min-heap of task ids, ordered by due time
+    bool Later(int a, int b) const
+    {
+        return m_Tasks[a].due > m_Tasks[b].due;
+    }
+
+    std::vector<Task> m_Tasks;
+    std::vector<int>  m_Heap;
+    EventBus*         m_Bus;
+};
+
+#endif
@@ -0,0 +1,538 @@
+/*
+ * Simulated plant: valves with travel time and limit switches, the water
+ * heater with its pressure and temperature, hot supply temperature, following
+ * a profile, and leaks, injected on schedule. Together with the virtual clock
+ * this allows to run the controller for weeks in seconds, for benchmarking
+ * and soak testing.
+ *
+ * The plant is a bus, relays, switches and thermometers on it refer to its
+ * signals by name:
+ *   SimRelay:       <valve>.open, <valve>.close, heater, drain
+ *   SimSwitch:      <valve>.opened, <valve>.closed, pressure, leak
+ *   SimThermometer: supply, heater_temp
+ * Valves are known by arbitrary names, e.g. ids of the valve controller parts.
+ */
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "hardware.h"
+#include "hwconfig.h"
+#include "logging.h"
+#include "utils.h"
+
+// List of "start:length" intervals in seconds
+typedef std::vector<std::pair<uint64_t, uint64_t>> Schedule;
+
+class SimPlant : public Hardware
+{
+public:
+    enum SignalType
+    {
+        ValveOpen,
+        ValveClose,
+        ValveOpened,
+        ValveClosed,
+        HeaterPower,
+        HeaterDrain,
+        HeaterPressure,
+        Leak,
+        SupplyTemp,
+        HeaterTemp
+    };
+
+    struct SimValve
+    {
+        double position; // 0 is closed, 1 is open
+        bool   open;
+        bool   close;
+    };
+
+    struct Signal
+    {
+        SignalType type;
+        SimValve*  valve;
+    };
+
+    SimPlant(xmlNode* node);
+
+    bool ParseSignal(const char* spec, Signal& sig);
+
+    void SetOutput(const Signal& sig, bool on);
+    int GetInput(const Signal& sig, const Schedule& leaks);
+    float GetTemperature(const Signal& sig);
+
+    void Start() override;
+
+private:
+    void Update();
+    void Report(uint64_t elapsed);
+    float SupplyTemperature(uint64_t elapsed);
+
+    std::mutex m_Lock;
+
+    std::map<std::string, SimValve> m_Valves;
+    unsigned int m_Travel;     // ms
+    std::string  m_ColdValve;  // Feeds the heater together with...
+    std::string  m_InputValve; // ...heater input valve
+
+    bool   m_HeaterOn;
+    bool   m_DrainOn;
+    double m_Pressure;   // 0..1, the switch is on above 0.5
+    double m_HeaterTemp;
+    float  m_HeatRate;   // Degrees per minute
+    float  m_HeaterMax;
+    float  m_Ambient;
+    float  m_ColdTemp;
+    float  m_CoolTime;   // Cooling time constant, minutes
+
+    std::vector<std::pair<uint64_t, float>> m_Profile; // Supply temperature by time
+    float m_Noise;
+    std::minstd_rand m_Random;
+
+    uint64_t m_Start;       // Virtual ms
+    uint64_t m_Last;
+    uint64_t m_RealStart;
+    unsigned int m_Duration;       // Seconds of simulated time, 0 = forever
+    unsigned int m_ReportInterval; // Seconds
+    uint64_t m_NextReport;
+};
+
+static float getFloat(xmlNode* node, const char* name, float defVal)
+{
+    float v = GetFloatProp(node, name);
+
+    return isnan(v) ? defVal : v;
+}
+
+static const char* getStr(xmlNode* node, const char* name, const char* defVal)
+{
+    const char* v = GetStrProp(node, name);
+
+    return v ? v : defVal;
+}
+
+// "time:value,time:value,...", time in seconds
+template <typename T>
+static bool parsePairs(const char* str, std::vector<std::pair<uint64_t, T>>& out)
+{
+    while (str && *str) {
+        char* end;
+        uint64_t t = strtoull(str, &end, 10);
+
+        if (*end != ':')
+            return false;
+
+        double v = strtod(end + 1, &end);
+
+        if (*end && *end != ',')
+            return false;
+
+        out.push_back({t, (T)v});
+        str = *end ? end + 1 : end;
+    }
+
+    return true;
+}
+
+SimPlant::SimPlant(xmlNode* node)
+    : m_Travel(GetIntProp(node, "travel", 8000)),
+      m_ColdValve(getStr(node, "cold_valve", "CS")), m_InputValve(getStr(node, "heater_valve", "HI")),
+      m_HeaterOn(false), m_DrainOn(false), m_Pressure(1),
+      m_HeatRate(getFloat(node, "heat_rate", 1)), m_HeaterMax(getFloat(node, "heater_max", 75)),
+      m_Ambient(getFloat(node, "ambient", 20)), m_ColdTemp(getFloat(node, "cold_temp", 10)),
+      m_CoolTime(getFloat(node, "cool_time", 600)),
+      m_Noise(getFloat(node, "noise", 0)), m_Random(GetIntProp(node, "seed", 1)),
+      m_Start(GetMonotonicTimeMs()), m_Last(m_Start), m_RealStart(RealMonotonicTimeMs()),
+      m_Duration(GetIntProp(node, "duration", 0)), m_ReportInterval(GetIntProp(node, "report_interval", 3600)),
+      m_NextReport(m_ReportInterval)
+{
+    // By default hot water is always there
+    if (!parsePairs(GetStrProp(node, "supply_profile"), m_Profile) || m_Profile.empty()) {
+        m_Profile = { {0, 55} };
+    }
+
+    m_HeaterTemp = m_Ambient;
+}
+
+bool SimPlant::ParseSignal(const char* spec, Signal& sig)
+{
+    static const struct
+    {
+        const char* name;
+        SignalType  type;
+    } plantSignals[] =
+    {
+        {"heater",   HeaterPower},
+        {"drain",    HeaterDrain},
+        {"pressure", HeaterPressure},
+        {"leak",     Leak},
+        {"supply",   SupplyTemp},
+        {"heater_temp", HeaterTemp}
+    }, valveSignals[] =
+    {
+        {"open",   ValveOpen},
+        {"close",  ValveClose},
+        {"opened", ValveOpened},
+        {"closed", ValveClosed}
+    };
+
+    if (!spec)
+        return false;
+
+    const char* dot = strrchr(spec, '.');
+
+    if (!dot) {
+        for (const auto& s : plantSignals) {
+            if (!strcmp(spec, s.name)) {
+                sig.type  = s.type;
+                sig.valve = nullptr;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    for (const auto& s : valveSignals) {
+        if (!strcmp(dot + 1, s.name)) {
+            std::lock_guard lock(m_Lock);
+            // Valves start fully closed
+            auto v = m_Valves.insert({std::string(spec, dot - spec), {0, false, false}});
+
+            sig.type  = s.type;
+            sig.valve = &v.first->second;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void SimPlant::Start()
+{
+    m_Start = m_Last = GetMonotonicTimeMs();
+    m_RealStart = RealMonotonicTimeMs();
+
+    LOG(INFO) << "Plant simulation started" << (g_VirtualClock ? " with virtual clock" : "");
+}
+
+void SimPlant::Update()
+{
+    uint64_t now = GetMonotonicTimeMs();
+
+    if (now <= m_Last)
+        return;
+
+    double dt = (now - m_Last) / 1000.0;
+    double step = (now - m_Last) / (double)m_Travel;
+
+    m_Last = now;
+
+    for (auto& v : m_Valves) {
+        SimValve& valve = v.second;
+
+        // Both motor relays on jam the valve
+        if (valve.open && !valve.close)
+            valve.position = std::min(valve.position + step, 1.0);
+        else if (valve.close && !valve.open)
+            valve.position = std::max(valve.position - step, 0.0);
+    }
+
+    auto cold = m_Valves.find(m_ColdValve);
+    auto input = m_Valves.find(m_InputValve);
+    bool fed = cold != m_Valves.end() && input != m_Valves.end() &&
+               cold->second.position > 0 && input->second.position > 0;
+
+    // The heater is pressurized by the cold supply. With the drain open
+    // pressure falls, and the water is replaced by cold one.
+    double target = m_DrainOn ? (fed ? 0.3 : 0) : (fed ? 1 : m_Pressure);
+
+    m_Pressure += (target - m_Pressure) * (1 - exp(-dt / 2));
+
+    if (m_DrainOn && fed)
+        m_HeaterTemp += (m_ColdTemp - m_HeaterTemp) * (1 - exp(-dt / 30));
+    else if (m_HeaterOn && m_Pressure > 0.5)
+        m_HeaterTemp = std::min<double>(m_HeaterTemp + m_HeatRate * dt / 60, m_HeaterMax);
+    else
+        m_HeaterTemp += (m_Ambient - m_HeaterTemp) * (1 - exp(-dt / (m_CoolTime * 60)));
+
+    uint64_t elapsed = (now - m_Start) / 1000;
+
+    if (m_ReportInterval && elapsed >= m_NextReport) {
+        Report(elapsed);
+        m_NextReport += m_ReportInterval;
+    }
+
+    if (m_Duration && elapsed >= m_Duration) {
+        Report(elapsed);
+        LOG(INFO) << "Simulation complete";
+        m_Duration = 0;
+        // Normal shutdown
+        raise(SIGTERM);
+    }
+}
+
+void SimPlant::Report(uint64_t elapsed)
+{
+    double real = (RealMonotonicTimeMs() - m_RealStart) / 1000.0;
+    long rss = 0;
+
+#ifdef __linux__
+    // Resident set size, for catching memory growth in long runs
+    FILE* f = fopen("/proc/self/statm", "r");
+
+    if (f) {
+        long size;
+
+        if (fscanf(f, "%ld %ld", &size, &rss) == 2)
+            rss *= sysconf(_SC_PAGESIZE) / 1024;
+        fclose(f);
+    }
+#endif
+
+    LOG(INFO) << "Simulated " << elapsed / 3600.0 << " h in " << real << " s, RSS " << rss << " kB";
+}
+
+float SimPlant::SupplyTemperature(uint64_t elapsed)
+{
+    // The profile repeats, linear interpolation between the points
+    uint64_t period = m_Profile.back().first;
+    uint64_t t = period ? elapsed % period : 0;
+    size_t i = 1;
+
+    while (i < m_Profile.size() && m_Profile[i].first <= t)
+        i++;
+
+    if (i == m_Profile.size())
+        return m_Profile.back().second;
+
+    const auto& a = m_Profile[i - 1];
+    const auto& b = m_Profile[i];
+
+    return a.second + (b.second - a.second) * (t - a.first) / (b.first - a.first);
+}
+
+void SimPlant::SetOutput(const Signal& sig, bool on)
+{
+    std::lock_guard lock(m_Lock);
+
+    // Let the state so far play out first
+    Update();
+
+    switch (sig.type)
+    {
+    case ValveOpen:
+        sig.valve->open = on;
+        break;
+    case ValveClose:
+        sig.valve->close = on;
+        break;
+    case HeaterPower:
+        m_HeaterOn = on;
+        break;
+    case HeaterDrain:
+        m_DrainOn = on;
+        break;
+    default:
+        break;
+    }
+}
+
+int SimPlant::GetInput(const Signal& sig, const Schedule& leaks)
+{
+    std::lock_guard lock(m_Lock);
+
+    Update();
+
+    switch (sig.type)
+    {
+    case ValveOpened:
+        return sig.valve->position >= 1 ? Switch::On : Switch::Off;
+    case ValveClosed:
+        return sig.valve->position <= 0 ? Switch::On : Switch::Off;
+    case HeaterPressure:
+        return m_Pressure > 0.5 ? Switch::On : Switch::Off;
+    case Leak:
+    {
+        uint64_t elapsed = (m_Last - m_Start) / 1000;
+
+        for (const auto& l : leaks) {
+            if (elapsed >= l.first && elapsed < l.first + l.second)
+                return Switch::On;
+        }
+        return Switch::Off;
+    }
+    default:
+        return Switch::Fault;
+    }
+}
+
+float SimPlant::GetTemperature(const Signal& sig)
+{
+    std::lock_guard lock(m_Lock);
+    float t;
+
+    Update();
+
+    switch (sig.type)
+    {
+    case SupplyTemp:
+        t = SupplyTemperature((m_Last - m_Start) / 1000);
+        break;
+    case HeaterTemp:
+        t = m_HeaterTemp;
+        break;
+    default:
+        return NAN;
+    }
+
+    if (m_Noise) {
+        std::normal_distribution<float> noise(0, m_Noise);
+
+        t += noise(m_Random);
+    }
+
+    return t;
+}
+
+class SimRelay : public Relay
+{
+public:
+    SimRelay(SimPlant* plant, const SimPlant::Signal& sig)
+        : Relay(false), m_Plant(plant), m_Signal(sig)
+    {}
+
+protected:
+    virtual void ApplyState(bool on) override
+    {
+        m_Plant->SetOutput(m_Signal, on);
+    }
+
+private:
+    SimPlant*        m_Plant;
+    SimPlant::Signal m_Signal;
+};
+
+class SimSwitch : public Switch
+{
+public:
+    SimSwitch(SimPlant* plant, const SimPlant::Signal& sig, const Schedule& leaks)
+        : Switch(false), m_Plant(plant), m_Signal(sig), m_Leaks(leaks)
+    {}
+
+    virtual int GetState() override
+    {
+        return m_Plant->GetInput(m_Signal, m_Leaks);
+    }
+
+private:
+    SimPlant*        m_Plant;
+    SimPlant::Signal m_Signal;
+    Schedule         m_Leaks;
+};
+
+class SimThermometer : public Thermometer
+{
+public:
+    SimThermometer(SimPlant* plant, const SimPlant::Signal& sig, float thresh)
+        : Thermometer(thresh), m_Plant(plant), m_Signal(sig)
+    {}
+
+    void Start() override
+    {
+        // Background sampling runs in real time, which doesn't go well with
+        // the virtual clock. The plant is computed anyway, so it's quick.
+        SetSampling(0, 0);
+        Thermometer::Start();
+    }
+
+protected:
+    virtual float Measure() override
+    {
+        return m_Plant->GetTemperature(m_Signal);
+    }
+
+private:
+    SimPlant*        m_Plant;
+    SimPlant::Signal m_Signal;
+};
+
+// *** XML deserializers begin here ***
+
+// <bus type="SimPlant" id="PLANT" clock="virtual" duration="604800"
+//      supply_profile="0:55,43200:55,43260:20,50400:20,50460:55,86400:55"/>
+REGISTER_DEVICE_TYPE(SimPlant)(xmlNode *node, HWConfig *)
+{
+    const char* clock = GetStrProp(node, "clock");
+
+    if (GetIntProp(node, "travel", 8000) <= 0 || GetIntProp(node, "duration", 0) < 0 ||
+        GetIntProp(node, "report_interval", 3600) < 0) {
+        LOG(ERR) << "Malformed SimPlant description";
+        return nullptr;
+    }
+
+    // Before anybody looks at the time
+    if (clock && !strcmp(clock, "virtual")) {
+        StartVirtualClock();
+    }
+
+    return new SimPlant(node);
+}
+
+static SimPlant* getPlant(xmlNode *node, HWConfig *cfg, SimPlant::Signal& sig)
+{
+    SimPlant *plant = dynamic_cast<SimPlant *>(cfg->GetDeviceProp(node, "device"));
+
+    if (!plant || !plant->ParseSignal(GetStrProp(node, "signal"), sig)) {
+        LOG(ERR) << "Malformed simulated device description " << *node;
+        return nullptr;
+    }
+
+    return plant;
+}
+
+REGISTER_DEVICE_TYPE(SimRelay)(xmlNode *node, HWConfig *cfg)
+{
+    SimPlant::Signal sig;
+    SimPlant *plant = getPlant(node, cfg, sig);
+
+    return plant ? new SimRelay(plant, sig) : nullptr;
+}
+
+// leaks="start:length,..." in seconds of simulated time, for leak sensors
+REGISTER_DEVICE_TYPE(SimSwitch)(xmlNode *node, HWConfig *cfg)
+{
+    SimPlant::Signal sig;
+    SimPlant *plant = getPlant(node, cfg, sig);
+    Schedule leaks;
+
+    if (!parsePairs(GetStrProp(node, "leaks"), leaks)) {
+        LOG(ERR) << "Malformed leak schedule " << *node;
+        return nullptr;
+    }
+
+    return plant ? new SimSwitch(plant, sig, leaks) : nullptr;
+}
+
+REGISTER_DEVICE_TYPE(SimThermometer)(xmlNode *node, HWConfig *cfg)
+{
+    SimPlant::Signal sig;
+    SimPlant *plant = getPlant(node, cfg, sig);
+    float threshold = GetFloatProp(node, "threshold");
+
+    if (isnan(threshold)) {
+        LOG(ERR) << "Malformed SimThermometer description";
+        return nullptr;
+    }
+
+    return plant ? new SimThermometer(plant, sig, threshold) : nullptr;
+}
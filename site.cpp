@@ -0,0 +1,277 @@
+#ifdef __linux__
+#include <pthread.h>
+#endif
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+#include <libxml/parser.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "event_bus.h"
+#include "site.h"
+#include "utils.h"
+
+static uint64_t nowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int AddControlTasks(Scheduler& sched, HWConfig* cfg)
+{
+    HWState* hw = cfg->m_HWState;
+    int leaks = sched.Add("leaks", cfg->m_LeakPollInterval, [hw] { hw->PollLeaks(); });
+
+    sched.Add("valves", cfg->m_ValvePollInterval, [hw] { hw->PollValves(); });
+    sched.Add("supply", cfg->m_SupplyPollInterval, [hw] { hw->PollSupply(); });
+
+    return leaks;
+}
+
+Site::Site(const std::string& name, const char* configPath)
+    : m_Name(name), m_Busy(0)
+{
+    LogContext logContext(&m_Name);
+
+    m_Config  = new HWConfig(name, configPath);
+    m_HWState = m_Config->m_HWState;
+    m_Sched.SetBus(m_Config->GetBus());
+
+    // Same as single-site startup, see main()
+    m_HWState->Poll();
+    m_Config->ReportCurrentState();
+    m_LeaksTask = AddControlTasks(m_Sched, m_Config);
+
+    LOG(INFO) << "Site started";
+}
+
+Site::~Site()
+{
+    LogContext logContext(&m_Name);
+
+    delete m_Config;
+}
+
+// Runs control loops of its sites, waiting for the nearest deadline or
+// an input change of any of them
+class SiteShard
+{
+public:
+    SiteShard(unsigned int n) : m_Name("sites-" + std::to_string(n)), m_Quit(false)
+    {}
+
+    ~SiteShard()
+    {
+        m_Quit = true;
+        if (m_Thread.joinable())
+            m_Thread.join();
+    }
+
+    void AddSite(Site* site)
+    {
+        m_Sites.push_back(site);
+
+        for (Hardware* hw : site->m_Config->GetEventSources()) {
+            m_Sources.push_back(hw);
+            m_SourceSites.push_back(site);
+        }
+    }
+
+    void Start()
+    {
+        m_Thread = std::thread(&SiteShard::Loop, this);
+    }
+
+private:
+    void Loop();
+    bool WaitForEvents(unsigned int timeout);
+
+    std::string            m_Name;
+    std::vector<Site*>     m_Sites;
+    // Event sources and sites, they belong to
+    std::vector<Hardware*> m_Sources;
+    std::vector<Site*>     m_SourceSites;
+    std::atomic<bool>      m_Quit;
+    std::thread            m_Thread;
+};
+
+void SiteShard::Loop()
+{
+#ifdef __linux__
+    pthread_setname_np(pthread_self(), m_Name.c_str());
+#endif
+
+    // Bounds shutdown latency
+    static const unsigned int maxWait = 1000;
+
+    while (!m_Quit) {
+        unsigned int timeout = maxWait;
+
+        for (Site* site : m_Sites) {
+            LogContext logContext(&site->m_Name);
+            uint64_t start = nowUs();
+
+            timeout = std::min(timeout, site->m_Sched.RunDue());
+            site->m_Busy += nowUs() - start;
+        }
+
+        WaitForEvents(timeout);
+    }
+}
+
+// Same as HWConfig::WaitForEvents(), but for all our sites
+bool SiteShard::WaitForEvents(unsigned int timeout)
+{
+#ifdef _WIN32
+    msleep(timeout);
+    return false;
+#else
+    std::vector<struct pollfd> fds(m_Sources.size());
+
+    for (size_t i = 0; i < fds.size(); i++) {
+        fds[i].fd = m_Sources[i]->GetEventFd();
+        fds[i].events = POLLIN;
+    }
+
+    if (poll(fds.data(), fds.size(), timeout) <= 0)
+        return false;
+
+    for (size_t i = 0; i < fds.size(); i++) {
+        if (fds[i].revents) {
+            Site* site = m_SourceSites[i];
+            LogContext logContext(&site->m_Name);
+
+            m_Sources[i]->HandleEvent();
+            site->m_Sched.Trigger(site->m_LeaksTask);
+        }
+    }
+
+    return true;
+#endif
+}
+
+void SiteList::createLogger(xmlNode* node)
+{
+    LogListener* logger = HWConfig::CreateLogger(node, nullptr);
+
+    if (logger) {
+        m_Loggers.push_back(logger);
+        AddLogListener(logger);
+    }
+}
+
+SiteList::SiteList(const char* path)
+{
+    LIBXML_TEST_VERSION
+    xmlDoc *doc = xmlReadFile(path, NULL, 0);
+
+    if (doc == NULL) {
+        fatal("Could not parse site list %s", path);
+    }
+
+    xmlNode *root = xmlDocGetRootElement(doc);
+    int threads = GetIntProp(root, "threads", 1);
+
+    if (threads < 1) {
+        fatal("Malformed thread count in %s", path);
+    }
+
+    // Loggers go first, so that sites can report problems
+    for (xmlNode* node = root->children; node; node = node->next) {
+        if (node->type != XML_ELEMENT_NODE)
+            continue;
+        if (!strcmp((const char *)node->name, "logger"))
+            createLogger(node);
+        else if (!strcmp((const char *)node->name, "log_limits"))
+            HWConfig::ConfigureLogLimits(node);
+    }
+
+    for (xmlNode* node = root->children; node; node = node->next) {
+        if (node->type != XML_ELEMENT_NODE || strcmp((const char *)node->name, "site"))
+            continue;
+
+        const char* name = GetStrProp(node, "name");
+        const char* config = GetStrProp(node, "config");
+
+        // The name is a part of URLs and file names
+        if (!name || !config || !*name || strpbrk(name, "/\\. ")) {
+            LOG(ERR) << "Malformed site description " << *node;
+            continue;
+        }
+
+        bool duplicate = false;
+
+        for (Site* s : m_Sites)
+            duplicate |= s->m_Name == name;
+
+        if (duplicate) {
+            LOG(ERR) << "Duplicate site " << name;
+            continue;
+        }
+
+        m_Sites.push_back(new Site(name, config));
+    }
+
+    xmlFreeDoc(doc);
+    xmlCleanupParser();
+
+    if (m_Sites.empty()) {
+        fatal("No sites in %s", path);
+    }
+
+    // Shards would advance it concurrently
+    if (g_VirtualClock) {
+        fatal("Virtual clock is not supported with multiple sites");
+    }
+
+    // Round-robin, sites are supposed to be of about the same cost
+    unsigned int nShards = std::min<size_t>(threads, m_Sites.size());
+
+    for (unsigned int i = 0; i < nShards; i++)
+        m_Shards.push_back(new SiteShard(i));
+    for (size_t i = 0; i < m_Sites.size(); i++)
+        m_Shards[i % nShards]->AddSite(m_Sites[i]);
+
+    m_StatsTime = nowUs();
+    LOG(INFO) << m_Sites.size() << " sites on " << nShards << " threads";
+}
+
+SiteList::~SiteList()
+{
+    // Stop control loops before destroying anything they use
+    for (SiteShard* shard : m_Shards)
+        delete shard;
+    for (Site* site : m_Sites)
+        delete site;
+
+    for (LogListener* logger : m_Loggers) {
+        RemoveLogListener(logger);
+        delete logger;
+    }
+}
+
+void SiteList::Start()
+{
+    for (SiteShard* shard : m_Shards)
+        shard->Start();
+}
+
+void SiteList::ReportStats()
+{
+    uint64_t now = nowUs();
+    uint64_t elapsed = now - m_StatsTime;
+
+    m_StatsTime = now;
+    if (!elapsed)
+        return;
+
+    for (Site* site : m_Sites) {
+        float utilization = site->m_Busy.exchange(0) * 100.0f / elapsed;
+
+        LOG(DEBUG) << "Site " << site->m_Name << ": " << utilization << "% busy";
+        SendEvent("Site/" + site->m_Name + "/utilization", utilization);
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * Multi-site mode: many independent controllers in one process, e.g. one
+ * per apartment on a shared gateway. Every site has its own configuration,
+ * hardware, event bus, saved state and control loop. Control loops are run
+ * by a small pool of threads, every thread serves a fixed shard of sites.
+ *
+ * Site list format:
+ * <sites threads="2">
+ *   <logger type="file" path="/var/log/aquarius.log"/>
+ *   <log_limits burst="20"/>
+ *   <site name="apt1" config="/etc/aquarius/apt1.xml"/>
+ *   <site name="apt2" config="/etc/aquarius/apt2.xml"/>
+ * </sites>
+ * Loggers and log limits are shared by all sites; lines are prefixed with
+ * the site name.
+ */
+#ifndef SITE_H
+#define SITE_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hwconfig.h"
+#include "hwstate.h"
+#include "logging.h"
+#include "scheduler.h"
+
+// Periodic parts of the control loop. Returns id of the leak polling task,
+// which is to be triggered on input change events.
+int AddControlTasks(Scheduler& sched, HWConfig* cfg);
+
+class Site
+{
+public:
+    Site(const std::string& name, const char* configPath);
+    ~Site();
+
+    const std::string m_Name;
+    HWConfig*         m_Config;
+    HWState*          m_HWState;
+
+private:
+    friend class SiteShard;
+    friend class SiteList;
+
+    Scheduler             m_Sched;
+    int                   m_LeaksTask;
+    // Time, spent in the control loop, in microseconds
+    std::atomic<uint64_t> m_Busy;
+};
+
+class SiteShard;
+
+class SiteList
+{
+public:
+    // Loads all the sites, fails fatally on a malformed list
+    SiteList(const char* path);
+    ~SiteList();
+
+    void Start();
+
+    const std::vector<Site*>& GetSites() const
+    {
+        return m_Sites;
+    }
+
+    // Publishes share of time, spent by every site's control loop, as
+    // Site/<name>/utilization (percent)
+    void ReportStats();
+
+private:
+    void createLogger(xmlNode* node);
+
+    std::vector<Site*>         m_Sites;
+    std::vector<SiteShard*>    m_Shards;
+    std::vector<LogListener*>  m_Loggers;
+    uint64_t                   m_StatsTime;
+};
+
+#endif
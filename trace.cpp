@@ -0,0 +1,220 @@
+#ifdef __linux__
+#include <pthread.h>
+#endif
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+#include "logging.h"
+#include "trace.h"
+
+// Spans per thread; a busy control loop makes a few hundred per second
+static const size_t RingSize = 16384;
+static const size_t DetailSize = 24;
+
+struct TraceEvent
+{
+    const char* name; // Span names are string literals
+    char        detail[DetailSize];
+    const char* site;
+    uint64_t    start; // us
+    uint32_t    duration;
+};
+
+struct TraceRing
+{
+    unsigned int            tid;
+    std::string             thread;
+    std::mutex              lock;   // Taken by the owner only to write, so uncontended
+    std::vector<TraceEvent> events;
+    size_t                  next;   // Total number of events written
+};
+
+std::atomic<bool> Trace::g_Enabled(false);
+std::atomic<bool> Trace::g_DumpRequested(false);
+
+// Rings of all threads, ever traced. Threads are few and long living, so
+// rings are never freed.
+static std::mutex              g_RingsLock;
+static std::vector<TraceRing*> g_Rings;
+static thread_local TraceRing* g_Ring;
+
+static uint64_t nowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static TraceRing* createRing()
+{
+    TraceRing* ring = new TraceRing();
+    char name[32] = "";
+
+#ifdef __linux__
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+#endif
+
+    ring->events.resize(RingSize);
+    ring->next = 0;
+
+    std::lock_guard lock(g_RingsLock);
+
+    ring->tid    = g_Rings.size() + 1;
+    ring->thread = *name ? name : "thread-" + std::to_string(ring->tid);
+    g_Rings.push_back(ring);
+
+    return ring;
+}
+
+void Trace::Enable()
+{
+    if (!g_Enabled.exchange(true)) {
+        LOG(INFO) << "Timing trace enabled";
+    }
+}
+
+void Trace::Record(const char* name, const char* detail, uint64_t start, uint64_t end)
+{
+    if (!g_Ring)
+        g_Ring = createRing();
+
+    std::lock_guard lock(g_Ring->lock);
+    TraceEvent& e = g_Ring->events[g_Ring->next++ % RingSize];
+    const std::string* site = LogContext::Get();
+
+    e.name     = name;
+    e.site     = site ? site->c_str() : nullptr;
+    e.start    = start;
+    e.duration = end - start;
+
+    if (detail) {
+        strncpy(e.detail, detail, DetailSize - 1);
+        e.detail[DetailSize - 1] = 0;
+    } else {
+        e.detail[0] = 0;
+    }
+}
+
+void TraceSpan::begin(const char* name, const char* detail)
+{
+    m_Name   = name;
+    m_Detail = detail;
+    m_Start  = nowUs();
+}
+
+void TraceSpan::end()
+{
+    Trace::Record(m_Name, m_Detail, m_Start, nowUs());
+}
+
+static void writeString(std::ostream& os, const char* s)
+{
+    os << '"';
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            os << '\\';
+        if ((unsigned char)*s >= ' ')
+            os << *s;
+    }
+    os << '"';
+}
+
+void Trace::Dump(std::ostream& os, unsigned int seconds, const char* site)
+{
+    uint64_t since = seconds ? nowUs() - seconds * 1000000ULL : 0;
+    std::vector<TraceRing*> rings;
+    std::vector<TraceEvent> events;
+    bool first = true;
+
+    g_RingsLock.lock();
+    rings = g_Rings;
+    g_RingsLock.unlock();
+
+    os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    for (TraceRing* ring : rings) {
+        // Copy, so that the owner isn't blocked while we're formatting
+        events.clear();
+        ring->lock.lock();
+
+        size_t count = std::min(ring->next, RingSize);
+
+        for (size_t i = ring->next - count; i < ring->next; i++) {
+            const TraceEvent& e = ring->events[i % RingSize];
+
+            if (e.start + e.duration >= since && (!site || (e.site && !strcmp(e.site, site))))
+                events.push_back(e);
+        }
+
+        ring->lock.unlock();
+
+        // Other sites' threads are none of our business
+        if (site && events.empty())
+            continue;
+
+        if (!first)
+            os << ',';
+        first = false;
+
+        os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring->tid
+           << ",\"args\":{\"name\":";
+        writeString(os, ring->thread.c_str());
+        os << "}}";
+
+        for (const TraceEvent& e : events) {
+            os << ",{\"name\":";
+            writeString(os, e.name);
+            os << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->tid << ",\"ts\":" << e.start
+               << ",\"dur\":" << e.duration;
+
+            if (e.detail[0] || e.site) {
+                os << ",\"args\":{";
+                if (e.detail[0]) {
+                    os << "\"detail\":";
+                    writeString(os, e.detail);
+                }
+                if (e.site) {
+                    os << (e.detail[0] ? ",\"site\":" : "\"site\":");
+                    writeString(os, e.site);
+                }
+                os << '}';
+            }
+            os << '}';
+        }
+    }
+
+    os << "]}";
+}
+
+bool Trace::DumpToFile(const char* path, unsigned int seconds)
+{
+    std::ofstream f(path);
+
+    if (f) {
+        Dump(f, seconds);
+        f.close();
+    }
+
+    if (!f) {
+        LOG(ERR) << "Failed to write timing trace into " << path;
+        return false;
+    }
+
+    LOG(INFO) << "Timing trace written into " << path;
+    return true;
+}
+
+void Trace::Poll(const char* path)
+{
+    if (!g_DumpRequested.exchange(false))
+        return;
+
+    if (IsEnabled())
+        DumpToFile(path);
+    else
+        Enable();
+}
@@ -0,0 +1,92 @@
+/*
+ * Timing spans for finding out where a slow control cycle spends its time.
+ * A span is a scoped object, which records its name, start and duration
+ * into a ring buffer of the current thread. Rings are dumped in Chrome trace
+ * event format, which chrome://tracing and Perfetto UI can open.
+ *
+ * Tracing is off until enabled, a span then costs a single relaxed load.
+ * It's turned on by the first /debug/trace request or SIGUSR2 and stays on.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <ostream>
+#include <string>
+
+class Trace
+{
+public:
+    static bool IsEnabled()
+    {
+        return g_Enabled.load(std::memory_order_relaxed);
+    }
+
+    static void Enable();
+
+    // Spans, finished within the last "seconds"; zero means all of them.
+    // If site is given, only spans, recorded on its behalf, are dumped.
+    static void Dump(std::ostream& os, unsigned int seconds = 0, const char* site = nullptr);
+    static bool DumpToFile(const char* path, unsigned int seconds = 0);
+
+    // Dump on signal: the handler only sets a flag, Poll() does the work.
+    // The first request just enables tracing.
+    static void RequestDump()
+    {
+        g_DumpRequested = true;
+    }
+
+    static void Poll(const char* path);
+
+private:
+    friend class TraceSpan;
+
+    static void Record(const char* name, const char* detail, uint64_t start, uint64_t end);
+
+    static std::atomic<bool> g_Enabled;
+    static std::atomic<bool> g_DumpRequested;
+};
+
+class TraceSpan
+{
+public:
+    // Detail, e.g. device name, is shown as an argument of the span
+    TraceSpan(const char* name, const char* detail = nullptr)
+    {
+        if (Trace::IsEnabled())
+            begin(name, detail);
+        else
+            m_Name = nullptr;
+    }
+
+    TraceSpan(const char* name, const std::string& detail)
+    {
+        if (Trace::IsEnabled())
+            begin(name, detail.c_str());
+        else
+            m_Name = nullptr;
+    }
+
+    ~TraceSpan()
+    {
+        if (m_Name)
+            end();
+    }
+
+private:
+    void begin(const char* name, const char* detail);
+    void end();
+
+    const char* m_Name;
+    const char* m_Detail;
+    uint64_t    m_Start;
+};
+
+#define TRACE_CONCAT2(a, b) a ## b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+// Span until the end of the current scope
+#define TRACE_SPAN(...) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(__VA_ARGS__)
+
+#endif
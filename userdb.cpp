@@ -94,7 +94,7 @@ void InitUserDB()
         access = getInt(line, pos);
 
         if (access < 0) {
-            Log(Log::ERR) << "Malformed user record: " << line;
+            LOG(ERR) << "Malformed user record: " << line;
             continue;
         }
 
@@ -126,7 +126,7 @@ unsigned int Authenticate(const char *user, const char *passwd)
     auto it = g_UserDB.find(user);
 
     if (it == g_UserDB.end() || it->second.m_Passwd != passwd) {
-        Log(Log::ERR) << "User " << user << " failed to authenticate";
+        LOG(ERR) << "User " << user << " failed to authenticate";
         return 0;
     } else {
         return it->second.m_Access;
@@ -139,7 +139,7 @@ void RegisterSession(Session* s)
     g_Sessions[s->m_Id] = s;
     g_Lock.unlock();
 
-    Log(Log::INFO) << *s << " logged in";
+    LOG(INFO) << *s << " logged in";
 }
 
 Session *GetSession(unsigned long id)
@@ -165,7 +165,7 @@ void TerminateSession(Session *s)
     g_Sessions.erase(s->m_Id);
     g_Lock.unlock();
 
-    Log(Log::INFO) << *s << "logged out";
+    LOG(INFO) << *s << "logged out";
 
     delete s;
 }
@@ -188,7 +188,7 @@ void CheckSessions()
     g_Lock.unlock();
 
     for (Session* s : expired) {
-        Log(Log::INFO) << *s << " expired";
+        LOG(INFO) << *s << " expired";
         delete s;
     }
 }
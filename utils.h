@@ -6,16 +6,18 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
 #include <time.h>
 
+#include <atomic>
+
 #ifdef _WIN32
 
 #include <Windows.h>
 
-static inline time_t GetMonotonicTime()
+static inline uint64_t RealMonotonicTimeMs()
 {
-	// WARNING!!! This works only for 49 days of uptime! Only for debugging!!!
-	return GetTickCount() / 1000;
+	return GetTickCount64();
 }
 
 static inline unsigned int sleep(unsigned int seconds)
@@ -24,7 +26,7 @@ static inline unsigned int sleep(unsigned int seconds)
 	return 0;
 }
 
-static inline void msleep(unsigned int msec)
+static inline void RealSleepMs(unsigned int msec)
 {
 	Sleep(msec);
 }
@@ -50,21 +52,55 @@ static inline unsigned int htole32(unsigned int host_32bits)
 #include <endian.h>
 #include <unistd.h>
 
-// Sleep for given time in milliseconds.
-// Windows loves milliseconds so we use this wrapper for small delays
-static inline void msleep(unsigned int msec)
+static inline void RealSleepMs(unsigned int msec)
 {
 	usleep(msec * 1000);
 }
 
-// Get monotonically increasing time in seconds
-static inline time_t GetMonotonicTime()
+static inline uint64_t RealMonotonicTimeMs()
 {
     struct timespec ts;
 
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    return ts.tv_sec;
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 #endif
+
+// Virtual clock for the plant simulator (see sim_hw.cpp). While it's on,
+// time moves only when somebody sleeps, and sleeping returns immediately,
+// so days of operation pass in seconds.
+inline std::atomic<bool>     g_VirtualClock(false);
+inline std::atomic<uint64_t> g_VirtualTimeMs(0);
+
+static inline void StartVirtualClock()
+{
+    if (!g_VirtualClock) {
+        g_VirtualTimeMs = RealMonotonicTimeMs();
+        g_VirtualClock = true;
+    }
+}
+
+// Get monotonically increasing time in milliseconds
+static inline uint64_t GetMonotonicTimeMs()
+{
+    return g_VirtualClock ? g_VirtualTimeMs.load() : RealMonotonicTimeMs();
+}
+
+// Same in seconds
+static inline time_t GetMonotonicTime()
+{
+    return GetMonotonicTimeMs() / 1000;
+}
+
+// Sleep for given time in milliseconds.
+// Windows loves milliseconds so we use this wrapper for small delays
+static inline void msleep(unsigned int msec)
+{
+    if (g_VirtualClock)
+        g_VirtualTimeMs += msec;
+    else
+        RealSleepMs(msec);
+}
+
 #endif
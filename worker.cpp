@@ -0,0 +1,125 @@
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "event_bus.h"
+#include "logging.h"
+#include "worker.h"
+
+static std::mutex           g_WorkersLock;
+static std::vector<Worker*> g_Workers;
+
+static uint64_t nowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Worker::Worker(const std::string& name, unsigned int period)
+    : m_Name(name), m_Site(LogContext::Get()), m_Period(period), m_Quit(false), m_Wake(false),
+      m_Busy(0), m_MaxRun(0), m_StatsTime(nowUs())
+{
+    std::lock_guard lock(g_WorkersLock);
+    g_Workers.push_back(this);
+}
+
+Worker::~Worker()
+{
+    Stop();
+
+    std::lock_guard lock(g_WorkersLock);
+    g_Workers.erase(std::find(g_Workers.begin(), g_Workers.end(), this));
+}
+
+void Worker::ReportStats()
+{
+    std::lock_guard lock(g_WorkersLock);
+    uint64_t now = nowUs();
+
+    for (Worker* w : g_Workers) {
+        uint64_t busy = w->m_Busy.exchange(0);
+        uint64_t maxRun = w->m_MaxRun.exchange(0);
+        float utilization = now > w->m_StatsTime ? busy * 100.0f / (now - w->m_StatsTime) : 0;
+
+        w->m_StatsTime = now;
+
+        LOG(DEBUG) << "Worker " << w->m_Name << ": " << utilization << "% busy, longest run "
+                   << maxRun / 1000.0f << " ms";
+        SendEvent("Worker/" + w->m_Name + "/utilization", utilization);
+        SendEvent("Worker/" + w->m_Name + "/latency", maxRun / 1000.0f);
+    }
+}
+
+void Worker::Start()
+{
+    if (!m_Thread.joinable()) {
+        m_Quit = false;
+        m_Thread = std::thread(&Worker::Loop, this);
+    }
+}
+
+void Worker::Stop()
+{
+    if (m_Thread.joinable()) {
+        m_Lock.lock();
+        m_Quit = true;
+        m_Lock.unlock();
+        m_Cond.notify_one();
+        m_Thread.join();
+    }
+}
+
+void Worker::Wake()
+{
+    m_Lock.lock();
+    m_Wake = true;
+    m_Lock.unlock();
+    m_Cond.notify_one();
+}
+
+void Worker::Loop()
+{
+#ifdef __linux__
+    // Shows up in top and gdb; the kernel limits names to 15 characters
+    pthread_setname_np(pthread_self(), m_Name.substr(0, 15).c_str());
+#endif
+    LogContext logContext(m_Site);
+
+    auto next = std::chrono::steady_clock::now();
+    std::unique_lock lock(m_Lock);
+
+    while (!m_Quit) {
+        uint64_t start = nowUs();
+
+        lock.unlock();
+        Run();
+        lock.lock();
+
+        uint64_t spent = nowUs() - start;
+
+        m_Busy += spent;
+        if (spent > m_MaxRun)
+            m_MaxRun = spent;
+
+        // Absolute deadlines, so that time, spent in Run(), doesn't add up
+        next += std::chrono::milliseconds(m_Period);
+
+        auto now = std::chrono::steady_clock::now();
+
+        if (next < now) {
+            // Run() took longer than the period, don't try to catch up
+            next = now;
+        }
+
+        m_Cond.wait_until(lock, next, [this] { return m_Quit || m_Wake; });
+
+        if (m_Wake) {
+            m_Wake = false;
+            next = std::chrono::steady_clock::now();
+        }
+    }
+}
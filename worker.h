@@ -0,0 +1,62 @@
+/*
+ * Background thread, calling Run() periodically. Used for talking to slow
+ * hardware, so that it doesn't stall the control loop.
+ */
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class Worker
+{
+public:
+    // Period is in milliseconds. The thread logs on behalf of the site of
+    // the creating thread, see LogContext.
+    Worker(const std::string& name, unsigned int period);
+    virtual ~Worker();
+
+    void Start();
+    // Waits for Run() to complete. Must be called before anything, used
+    // by Run(), is destroyed.
+    void Stop();
+    // Run again right now, not waiting for the period to expire
+    void Wake();
+
+    unsigned int GetPeriod() const
+    {
+        return m_Period;
+    }
+
+    // Publishes share of time, spent in Run(), and the longest Run() since
+    // the previous call as Worker/<name>/utilization (percent) and
+    // Worker/<name>/latency (ms) for every existing worker
+    static void ReportStats();
+
+protected:
+    virtual void Run() = 0;
+
+private:
+    void Loop();
+
+    std::string             m_Name;
+    const std::string*      m_Site;
+    unsigned int            m_Period;
+    std::thread             m_Thread;
+    std::mutex              m_Lock;
+    std::condition_variable m_Cond;
+    bool                    m_Quit;
+    bool                    m_Wake;
+
+    // Statistics in microseconds
+    std::atomic<uint64_t>   m_Busy;
+    std::atomic<uint64_t>   m_MaxRun;
+    uint64_t                m_StatsTime;
+};
+
+#endif